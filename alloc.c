@@ -22,7 +22,6 @@ THE SOFTWARE.
 
 #include "alloc.h"
 #include <assert.h>
-#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -35,31 +34,25 @@ THE SOFTWARE.
 // Block size for allocating internal data structures.
 #define ALLOC_BLOCKSIZE PAGESIZE
 
-typedef struct memory_metadata_t memory_metadata_t;
+// The mappings are tracked in a radix tree on the page number, laid out like
+// the page tables: four levels of page-sized nodes, with 9 bits of the page
+// number at each level, cover a 48-bit address space.
+#define RADIX_BITS 9
+#define RADIX_FANOUT (1 << RADIX_BITS)
+#define RADIX_LEVELS 4
 
 /****************************************************************************/
 /*                        Internal memory tracking.                         */
 /****************************************************************************/
 
-struct memory_metadata_t
-{
-    void *addr;
-    size_t length;
-    memory_metadata_t *next, *prev;
-};
+/* The tree maps the first page of each mapping to its length, so that
+   threadscan_alloc_munmap() can find it from the address alone.  It's
+   lock-free: a missing node is mapped and swung into place with a CAS, and
+   the loser of a race unmaps its copy.  Nodes are never removed, since the
+   mappings threadscan makes are few and clustered, so the tree stays
+   small. */
 
-static size_t LOW_ADDR (memory_metadata_t *m) {
-    return (size_t)m->addr;
-}
-
-static size_t HIGH_ADDR (memory_metadata_t *m) {
-    return LOW_ADDR(m) + m->length;
-}
-
-static memory_metadata_t *free_list = NULL;
-static memory_metadata_t *alloc_list = NULL;
-
-static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *volatile metadata_root[RADIX_FANOUT];
 
 /**
  * Wrap mmap(), since we only really use it as a great big malloc().  This
@@ -88,118 +81,57 @@ int munmap_wrap (void *addr, size_t length)
 }
 
 /**
- * Perform the insertion of the metadata into the list.  Why not embed this
- * in metadata_insert()?  Sometimes we want to insert while already holding
- * the lock.  Note: Ensure the lock is held when calling this function.
+ * Return the leaf entry of the tree for the mapping at addr.  If create is
+ * set, the missing nodes on the way to it are added.  Otherwise, NULL is
+ * returned if there aren't any.
  */
-static void metadata_do_insert (memory_metadata_t *meta)
+static volatile size_t *metadata_entry (void *addr, int create)
 {
-    if (NULL == alloc_list) {
-        alloc_list = meta;
-        meta->next = meta->prev = meta;
-    } else if (HIGH_ADDR(alloc_list->prev) <= LOW_ADDR(meta)) {
-        // What's all this?  This is the common case, if mmap() is allocating
-        // blocks at increasing addresses.  This optimizes when the block
-        // needs to go at the end of the list.
-        meta->prev = alloc_list->prev;
-        meta->next = alloc_list;
-        alloc_list->prev->next = meta;
-        alloc_list->prev = meta;
-    } else {
-        memory_metadata_t *curr = alloc_list;
-        while (LOW_ADDR(curr) < HIGH_ADDR(meta)) curr = curr->next;
-        meta->next = curr;
-        meta->prev = curr->prev;
-        curr->prev->next = meta;
-        curr->prev = meta;
-        if (curr == alloc_list) alloc_list = meta;
-    }
-}
+    size_t page = (size_t)addr / PAGESIZE;
+    void *volatile *node = metadata_root;
+    int level;
 
-/**
- * Insert the metadata node into the allocated list.
- */
-static void metadata_insert (memory_metadata_t *meta)
-{
-    /* The list is sorted.  There should not be many entries, so operations
-       should be cheap. */
-
-    pthread_mutex_lock(&list_lock);
-    metadata_do_insert(meta);
-    pthread_mutex_unlock(&list_lock);
-}
-
-/**
- * Remove the memory_metadata_t object containing *addr from the allocated
- * list and return it.
- */
-static memory_metadata_t *metadata_remove (void *addr)
-{
-    memory_metadata_t *curr = NULL;
-
-    assert(alloc_list); // Without the lock?!  It _should_ point to something.
-
-    pthread_mutex_lock(&list_lock);
-    for (curr = alloc_list; curr->addr != addr; curr = curr->next);
-    if (NULL == curr) {
-        threadscan_fatal("threadscan: internal error at %s:%d\n",
-                         __FILE__, __LINE__);
+    if (page >> (RADIX_BITS * RADIX_LEVELS)) {
+        threadscan_fatal("threadscan: mmap() address out of range.\n");
     }
-    curr->next->prev = curr->prev;
-    curr->prev->next = curr->next;
-    if (curr == alloc_list) alloc_list = curr->next;
-    pthread_mutex_unlock(&list_lock);
 
-    // For sanity's sake:
-    curr->next = curr->prev = NULL;
+    for (level = RADIX_LEVELS - 1; level > 0; --level) {
+        size_t index = (page >> (RADIX_BITS * level)) & (RADIX_FANOUT - 1);
+        void *next = node[index];
+        if (NULL == next) {
+            if (!create) return NULL;
+            next = mmap_wrap(ALLOC_BLOCKSIZE);
+            if (!BCAS(&node[index], NULL, next)) {
+                // Somebody else added it first.
+                munmap_wrap(next, ALLOC_BLOCKSIZE);
+                next = node[index];
+            }
+        }
+        node = (void *volatile*)next;
+    }
 
-    return curr;
+    return (volatile size_t*)&node[page & (RADIX_FANOUT - 1)];
 }
 
 /**
- * Return a fresh memory_metadata_t object.
+ * Record the length of the mapping at addr.
  */
-static memory_metadata_t *metadata_new ()
+static void metadata_insert (void *addr, size_t length)
 {
-    pthread_mutex_lock(&list_lock);
-    if (NULL == free_list) {
-        // No free nodes.  Make a few.
-        size_t offset;
-        char *p = (char*)mmap_wrap(ALLOC_BLOCKSIZE);
-
-        // The first entry is this memory block's metadata.
-        memory_metadata_t *node = (memory_metadata_t*)p;
-        node->addr = (void*)node;
-        node->length = ALLOC_BLOCKSIZE;
-        metadata_do_insert(node);
-
-        // Turn the rest of the memory into a list of nodes.
-        for (offset = sizeof(memory_metadata_t);
-             offset < ALLOC_BLOCKSIZE - sizeof(memory_metadata_t);
-             offset += sizeof(memory_metadata_t)) {
-            node = (memory_metadata_t*)(p + offset);
-            node->next = free_list;
-            free_list = node;
-        }
-    }
-
-    // Grab the first "free" entry and return it.
-    memory_metadata_t *ret = free_list;
-    assert(ret);
-    free_list = free_list->next;
-    pthread_mutex_unlock(&list_lock);
-    return ret;
+    volatile size_t *entry = metadata_entry(addr, 1);
+    assert(0 == *entry);
+    *entry = length;
 }
 
 /**
- * Return a memory_metadata_t object to the pool of memory whence it came.
+ * Forget the mapping at addr and return its length, or 0 if there isn't
+ * one.
  */
-static void metadata_free (memory_metadata_t *meta)
+static size_t metadata_remove (void *addr)
 {
-    pthread_mutex_lock(&list_lock);
-    meta->next = free_list;
-    free_list = meta;
-    pthread_mutex_unlock(&list_lock);
+    volatile size_t *entry = metadata_entry(addr, 0);
+    if (NULL == entry) return 0;
+    return __sync_lock_test_and_set(entry, 0);
 }
 
 /****************************************************************************/
@@ -213,18 +145,26 @@ static void metadata_free (memory_metadata_t *meta)
  */
 void *threadscan_alloc_mmap (size_t size)
 {
-    memory_metadata_t *meta = metadata_new();
+    void *addr;
     assert(size % PAGESIZE == 0);
-    assert(meta);
-    meta->length = size;
-    meta->addr = mmap_wrap(size);
-    assert(meta->addr && meta->addr != MAP_FAILED);
-    metadata_insert(meta);
-    if (0 != mprotect(meta->addr, size, PROT_READ | PROT_WRITE)) {
-        threadscan_diagnostic("threadscan: mprotect failed %s:%d\n",
-                              __FILE__, __LINE__);
-    }
-    return meta->addr;
+    assert(size > 0);
+    addr = mmap_wrap(size);
+    metadata_insert(addr, size);
+    return addr;
+}
+
+/**
+ * Like threadscan_alloc_mmap(), but ask for transparent huge pages.  For
+ * big buffers that stay mapped, so that fewer faults and TLB entries cover
+ * them.
+ */
+void *threadscan_alloc_mmap_huge (size_t size)
+{
+    void *addr = threadscan_alloc_mmap(size);
+
+    // It's only a hint.  Without huge pages, the memory stays as it is.
+    madvise(addr, size, MADV_HUGEPAGE);
+    return addr;
 }
 
 /**
@@ -234,12 +174,11 @@ void threadscan_alloc_munmap (void *ptr)
 {
     assert(ptr);
 
-    memory_metadata_t *meta = metadata_remove(ptr);
-    if (NULL == meta) {
+    size_t length = metadata_remove(ptr);
+    if (0 == length) {
         threadscan_fatal("threadscan: lost track of memory.\n");
     }
-    if (0 != munmap_wrap(meta->addr, meta->length)) {
+    if (0 != munmap_wrap(ptr, length)) {
         threadscan_fatal("threadscan: failed munmap().\n");
     }
-    metadata_free(meta);
 }
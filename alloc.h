@@ -38,6 +38,12 @@ THE SOFTWARE.
  */
 void *threadscan_alloc_mmap (size_t size);
 
+/**
+ * Like threadscan_alloc_mmap(), but backed by transparent huge pages, if
+ * the kernel has them.
+ */
+void *threadscan_alloc_mmap_huge (size_t size);
+
 /**
  * munmap() for the threadscan system.
  */
@@ -0,0 +1,137 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Benchmark Description:
+   Page faults and RSS per round.  The calling thread keeps HOLD pointers
+   it collected alive in a local block, so every round has survivors to
+   store, and then it collects one pointer list's worth at a time, which
+   makes one round each.  The working memory of the first round is faulted
+   in fresh, and later rounds reuse it.  The same run is done with
+   THREADSCAN_HUGE_PAGES=0 and THREADSCAN_HUGE_PAGES=1.
+
+   Usage: bench/arena [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "env.h"
+#include "threadscan.h"
+
+#define HOLD 2000
+
+static void *held[HOLD];
+
+static long minor_faults ()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+/**
+ * Resident set size in KB, from /proc/self/statm.
+ */
+static long rss_kb ()
+{
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f) {
+        if (2 != fscanf(f, "%ld %ld", &pages, &rss)) rss = 0;
+        fclose(f);
+    }
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Run the rounds in this process, with the setting it was started with.
+ */
+static void run (int rounds)
+{
+    long faults, first = 0, total = 0, most = 0, rss_first = 0;
+    int i, r;
+
+    threadscan_register_local_block(held, sizeof(held));
+    for (i = 0; i < HOLD; ++i) {
+        held[i] = malloc(32);
+        threadscan_collect(held[i]);
+    }
+
+    for (r = 0; r < rounds; ++r) {
+        faults = minor_faults();
+        for (i = 0; i < g_threadscan_ptrs_per_thread; ++i) {
+            threadscan_collect(malloc(32));
+        }
+        faults = minor_faults() - faults;
+        if (0 == r) {
+            first = faults;
+            rss_first = rss_kb();
+        } else {
+            total += faults;
+            if (faults > most) most = faults;
+        }
+    }
+
+    printf("  THREADSCAN_HUGE_PAGES=%s: %ld faults in the first round, %.1f "
+           "per round after (max %ld)\n", getenv("THREADSCAN_HUGE_PAGES"),
+           first, rounds > 1 ? (double)total / (rounds - 1) : 0.0, most);
+    printf("    RSS %ld KB after the first round, %ld KB at the end\n",
+           rss_first, rss_kb());
+    threadscan_unregister_local_block(held);
+}
+
+int main (int argc, char **argv)
+{
+    static const char *modes[] = { "0", "1" };
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+    int i;
+
+    if (rounds < 1) {
+        fprintf(stderr, "rounds must be at least 1\n");
+        return 1;
+    }
+
+    // The setting is read when the library loads, so each one gets a
+    // process of its own.
+    if (getenv("THREADSCAN_HUGE_PAGES")) {
+        run(rounds);
+        return 0;
+    }
+
+    printf("%d rounds of %d pointers, %d live:\n", rounds,
+           g_threadscan_ptrs_per_thread, HOLD);
+    fflush(stdout);
+    for (i = 0; i < 2; ++i) {
+        pid_t pid = fork();
+        if (0 == pid) {
+            setenv("THREADSCAN_HUGE_PAGES", modes[i], 1);
+            execv("/proc/self/exe", argv);
+            perror("execv");
+            _exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
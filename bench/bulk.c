@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Benchmark Description:
+   Collect unlinked groups of 64 pointers, the size of a skiplist tower or a
+   hash bucket chain, with one threadscan_collect_bulk() call per group and
+   with a loop of threadscan_collect() calls.  Reclamation runs as usual in
+   both cases, so the times include it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "threadscan.h"
+
+#define BATCH 64
+#define TOTAL (1 << 22)
+
+static void *pool[TOTAL];
+
+static double now ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Collect the pool in batches, and return the time per pointer in ns.
+ */
+static double collect_pool (int bulk)
+{
+    double t0;
+    int i, j;
+
+    for (i = 0; i < TOTAL; ++i) pool[i] = malloc(32);
+
+    t0 = now();
+    for (i = 0; i < TOTAL; i += BATCH) {
+        if (bulk) {
+            threadscan_collect_bulk(&pool[i], BATCH);
+        } else {
+            for (j = 0; j < BATCH; ++j) threadscan_collect(pool[i + j]);
+        }
+    }
+    return (now() - t0) * 1e9 / TOTAL;
+}
+
+int main ()
+{
+    // Run each twice and keep the second, after the first has warmed up
+    // the allocator and the reclamation buffers.
+    double single, bulk;
+
+    collect_pool(0);
+    single = collect_pool(0);
+    collect_pool(1);
+    bulk = collect_pool(1);
+
+    printf("%d pointers in groups of %d:\n", TOTAL, BATCH);
+    printf("  threadscan_collect loop: %6.1f ns/pointer\n", single);
+    printf("  threadscan_collect_bulk: %6.1f ns/pointer\n", bulk);
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Benchmark Description:
+   Churner threads create and join short-lived threads in a loop, while
+   collector threads keep reclamation running.  Each short-lived thread
+   collects a few pointers, so it takes part in rounds too.  Reports thread
+   creations and collects per second, and the longest a create and join
+   took, which goes up when thread churn waits on rounds.
+
+   Usage: bench/churn [churners [collectors [seconds [local block MB]]]]
+
+   With a local block, one collector registers one of that size, so the
+   rounds take longer.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "threadscan.h"
+
+#define MAX_THREADS 64
+#define CHILD_COLLECTS 16
+
+// Per-thread counts, a cache line apart.
+typedef struct counts_t counts_t;
+
+struct counts_t {
+    unsigned long creates;
+    unsigned long collects;
+    unsigned long max_us;
+    char pad[64 - 3 * sizeof(unsigned long)];
+};
+
+static volatile int stop;
+static counts_t counts[MAX_THREADS];
+static size_t block_mb;
+static counts_t *block_owner;     // The collector with the local block.
+
+static unsigned long now_us ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void *child (void *arg)
+{
+    int i;
+
+    for (i = 0; i < CHILD_COLLECTS; ++i) threadscan_collect(malloc(32));
+    return NULL;
+}
+
+static void *churner (void *arg)
+{
+    counts_t *c = (counts_t*)arg;
+    pthread_t t;
+
+    while (!stop) {
+        unsigned long start = now_us(), us;
+        if (pthread_create(&t, NULL, child, NULL)) {
+            perror("pthread_create");
+            abort();
+        }
+        pthread_join(t, NULL);
+        us = now_us() - start;
+        if (us > c->max_us) c->max_us = us;
+        ++c->creates;
+    }
+    return NULL;
+}
+
+static void *collector (void *arg)
+{
+    counts_t *c = (counts_t*)arg;
+    char *block = NULL;
+
+    if (block_mb && c == block_owner) {
+        block = (char*)calloc(block_mb, 1 << 20);
+        threadscan_register_local_block(block, block_mb << 20);
+    }
+    while (!stop) {
+        threadscan_collect(malloc(32));
+        ++c->collects;
+    }
+    if (block) {
+        threadscan_unregister_local_block(block);
+        free(block);
+    }
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    int churners = argc > 1 ? atoi(argv[1]) : 2;
+    int collectors = argc > 2 ? atoi(argv[2]) : 2;
+    int seconds = argc > 3 ? atoi(argv[3]) : 3;
+    pthread_t threads[MAX_THREADS];
+    unsigned long creates = 0, collects = 0, max_us = 0;
+    struct timespec now, end;
+    int i;
+
+    block_mb = argc > 4 ? atoi(argv[4]) : 0;
+    if (churners < 0 || collectors < 0 || churners + collectors < 1
+        || churners + collectors > MAX_THREADS || seconds < 1) {
+        fprintf(stderr, "need 1 to %d threads, and at least a second\n",
+                MAX_THREADS);
+        return 1;
+    }
+    block_owner = &counts[churners];
+
+    for (i = 0; i < churners + collectors; ++i) {
+        pthread_create(&threads[i], NULL, i < churners ? churner : collector,
+                       &counts[i]);
+    }
+
+    // Wait with the wrapped nanosleep(), so this thread is parked and
+    // rounds don't have to signal it.  sleep() would get around the
+    // wrapper.
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += seconds;
+    do {
+        struct timespec tick = { 0, 10000000 };
+        nanosleep(&tick, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec < end.tv_sec
+             || (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+    stop = 1;
+
+    for (i = 0; i < churners + collectors; ++i) {
+        pthread_join(threads[i], NULL);
+        creates += counts[i].creates;
+        collects += counts[i].collects;
+        if (counts[i].max_us > max_us) max_us = counts[i].max_us;
+    }
+
+    printf("%d churners, %d collectors, %zu MB local block:\n", churners,
+           collectors, block_mb);
+    printf("  %lu thread creates/s, %lu collects/s\n", creates / seconds,
+           collects / seconds);
+    printf("  longest create and join: %lu us\n", max_us);
+    return 0;
+}
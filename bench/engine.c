@@ -0,0 +1,136 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Benchmark Description:
+   Compare the two reclamation engines (THREADSCAN_ENGINE) across pointer
+   counts.  For each count, the sort engine sorts the addresses and builds
+   the search index over them, and the hash engine builds its hash set.
+   Then each looks up the same 64K candidates, half of which are hits, the
+   way a round searches memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scan.h"
+#include "util.h"
+
+// Candidates looked up per round, and per call to the lookup kernels.
+#define LOOKUPS 65536
+#define BATCH 256
+
+static double now ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * A 16-byte aligned address in a region about 1 KB per address.
+ */
+static size_t random_addr (size_t n)
+{
+    size_t rnd = (size_t)rand() * RAND_MAX + rand();
+    return 0x7f0000000000ULL + rnd % (n * 64) * 16;
+}
+
+int main ()
+{
+    static const int sizes[] = { 4096, 32768, 262144, 1048576, 4194304,
+                                 8388608 };
+    int k;
+
+    printf("%9s %14s %14s\n", "pointers", "sort engine", "hash engine");
+    for (k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); ++k) {
+        int n = sizes[k];
+        int reps = n < 100000 ? 50 : 3;
+        size_t space = threadscan_scan_hash_size(n)
+            + threadscan_scan_index_size(n);
+        size_t *src = (size_t*)malloc(n * sizeof(size_t));
+        size_t *a = (size_t*)aligned_alloc(64, (n + SCAN_INDEX_FANOUT)
+                                           * sizeof(size_t));
+        size_t *tmp = (size_t*)malloc(n * sizeof(size_t));
+        size_t *buf = (size_t*)aligned_alloc(64, (space + 8)
+                                             * sizeof(size_t));
+        size_t *keys = (size_t*)malloc(LOOKUPS * sizeof(size_t));
+        int out[BATCH];
+        double t0, t_sort = 0, t_hash = 0;
+        long sort_hits = 0, hash_hits = 0;
+        int i, j, r;
+        size_t min = ~(size_t)0;
+
+        for (i = 0; i < n; ++i) {
+            src[i] = random_addr(n);
+            if (src[i] < min) min = src[i];
+        }
+        // Half hits.  The index only takes keys from its lowest address up,
+        // as the search filter guarantees in a real round.
+        for (i = 0; i < LOOKUPS; ++i) {
+            keys[i] = (i & 1) ? src[rand() % n] : random_addr(n);
+            if (keys[i] < min) keys[i] = min;
+        }
+
+        for (r = 0; r < reps; ++r) {
+            scan_index_t idx;
+            memcpy(a, src, n * sizeof(size_t));
+            t0 = now();
+            threadscan_util_sort(a, tmp, n);
+            threadscan_scan_index_build(&idx, a, n, buf);
+            for (i = 0; i < LOOKUPS; i += BATCH) {
+                threadscan_scan_index_find(&idx, &keys[i], BATCH, out);
+                for (j = 0; j < BATCH; ++j) {
+                    sort_hits += a[out[j]] == keys[i + j];
+                }
+            }
+            t_sort += now() - t0;
+        }
+
+        for (r = 0; r < reps; ++r) {
+            scan_hash_t hash;
+            t0 = now();
+            threadscan_scan_hash_build(&hash, src, n, buf);
+            for (i = 0; i < LOOKUPS; i += BATCH) {
+                threadscan_scan_hash_find(&hash, &keys[i], BATCH, out);
+                for (j = 0; j < BATCH; ++j) hash_hits += out[j] >= 0;
+            }
+            t_hash += now() - t0;
+        }
+
+        if (sort_hits != hash_hits) {
+            printf("engines disagree at %d pointers: %ld vs. %ld hits\n",
+                   n, sort_hits / reps, hash_hits / reps);
+            return 1;
+        }
+        printf("%9d %11.2f ms %11.2f ms\n", n, t_sort / reps * 1e3,
+               t_hash / reps * 1e3);
+
+        free(src);
+        free(a);
+        free(tmp);
+        free(buf);
+        free(keys);
+    }
+
+    return 0;
+}
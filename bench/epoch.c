@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Benchmark Description:
+   Threads look up nodes in a shared array inside operations, and one in
+   four operations swaps a node out and collects it.  The same run is
+   timed with THREADSCAN_EPOCH=0 (every round searches) and
+   THREADSCAN_EPOCH=1 (rounds free without a search when they can).
+
+   Usage: bench/epoch [threads [local block KB]]
+
+   With a local block, each thread registers one of that size, filled with
+   words that look like addresses, so the searches have more to read.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "threadscan.h"
+
+#define SLOTS 4096
+#define OPS_PER_THREAD 2000000
+#define MAX_THREADS 64
+
+typedef struct node_t node_t;
+
+struct node_t {
+    size_t value[4];
+};
+
+static node_t *volatile slots[SLOTS];
+static volatile size_t sink;
+static size_t block_kb;
+
+static void *worker (void *arg)
+{
+    unsigned int seed = (unsigned int)(size_t)arg * 7919 + 1;
+    size_t *block = NULL, sum = 0, j;
+    long i;
+
+    if (block_kb) {
+        block = (size_t*)calloc(block_kb, 1024);
+        for (j = 0; j < block_kb * 1024 / sizeof(size_t); ++j) {
+            block[j] = (size_t)slots[j % SLOTS] + sizeof(size_t);
+        }
+        threadscan_register_local_block(block, block_kb * 1024);
+    }
+
+    for (i = 0; i < OPS_PER_THREAD; ++i) {
+        unsigned int k;
+        seed = seed * 1103515245 + 12345;
+        k = (seed >> 8) % SLOTS;
+
+        threadscan_begin_op();
+        sum += slots[k]->value[0];
+        if (i % 4 == 0) {
+            node_t *node = (node_t*)malloc(sizeof(node_t));
+            node->value[0] = i;
+            threadscan_collect(__sync_lock_test_and_set(&slots[k], node));
+        }
+        threadscan_end_op();
+    }
+
+    sink += sum;
+    if (block) {
+        threadscan_unregister_local_block(block);
+        free(block);
+    }
+    return NULL;
+}
+
+/**
+ * Time the workload in this process, with the mode it was started in.
+ */
+static void run (int n_threads)
+{
+    pthread_t threads[MAX_THREADS];
+    struct timespec start, end;
+    double sec;
+    int i;
+
+    for (i = 0; i < SLOTS; ++i) slots[i] = (node_t*)calloc(1, sizeof(node_t));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n_threads; ++i) {
+        pthread_create(&threads[i], NULL, worker, (void*)(size_t)i);
+    }
+    for (i = 0; i < n_threads; ++i) pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    sec = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("  THREADSCAN_EPOCH=%s: %6.2f Mops/s\n", getenv("THREADSCAN_EPOCH"),
+           n_threads * (double)OPS_PER_THREAD / sec / 1e6);
+}
+
+int main (int argc, char **argv)
+{
+    static const char *modes[] = { "0", "1" };
+    int n_threads = argc > 1 ? atoi(argv[1]) : 4;
+    int i;
+
+    block_kb = argc > 2 ? atoi(argv[2]) : 0;
+    if (n_threads < 1 || n_threads > MAX_THREADS) {
+        fprintf(stderr, "threads must be from 1 to %d\n", MAX_THREADS);
+        return 1;
+    }
+
+    // The mode is read when the library loads, so each one gets a process
+    // of its own.
+    if (getenv("THREADSCAN_EPOCH")) {
+        run(n_threads);
+        return 0;
+    }
+
+    printf("%d threads, %zu KB local blocks:\n", n_threads, block_kb);
+    fflush(stdout);
+    for (i = 0; i < 2; ++i) {
+        pid_t pid = fork();
+        if (0 == pid) {
+            setenv("THREADSCAN_EPOCH", modes[i], 1);
+            execv("/proc/self/exe", argv);
+            perror("execv");
+            _exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
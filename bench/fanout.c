@@ -0,0 +1,142 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Benchmark Description:
+   Handshake latency against the number of threads.  The other threads
+   block in sigwait(), which isn't wrapped, so every round has to signal
+   all of them and wait until they've all searched.  The calling thread
+   collects a pointer list's worth at a time, which makes one round each,
+   and the time per round, less the time with no other threads, is the
+   time from the requests to the last search.
+
+   Each thread count is run with the tree's width from THREADSCAN_FANOUT
+   (8 if it isn't set), and with the width set to the thread count, which
+   is the linear loop: the reclaimer signals every thread itself.  Running
+   with THREADSCAN_FANOUT=0 makes both columns linear.
+
+   Usage: bench/fanout [max threads [rounds]]
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "env.h"
+#include "threadscan.h"
+
+// Tells a sleeping thread to exit.  It's blocked, so it's never lost.
+#define SIGSTOPSLEEP SIGUSR2
+
+static double now ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *sleeper (void *arg)
+{
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGSTOPSLEEP);
+    sigwait(&set, &sig);
+    return NULL;
+}
+
+/**
+ * Return the average time of a round in seconds, with the given width.
+ */
+static double time_rounds (int width, int rounds)
+{
+    double start;
+    int i, r;
+
+    g_threadscan_fanout = width;
+
+    // One round first, so the working memory is faulted in.
+    for (i = 0; i < g_threadscan_ptrs_per_thread; ++i) {
+        threadscan_collect(malloc(16));
+    }
+    start = now();
+    for (r = 0; r < rounds; ++r) {
+        for (i = 0; i < g_threadscan_ptrs_per_thread; ++i) {
+            threadscan_collect(malloc(16));
+        }
+    }
+    return (now() - start) / rounds;
+}
+
+int main (int argc, char **argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 1024;
+    int rounds = argc > 2 ? atoi(argv[2]) : 100;
+    int width = g_threadscan_fanout;
+    pthread_t *threads;
+    double base;
+    sigset_t set;
+    int n, i;
+
+    if (max_threads < 1 || rounds < 1) {
+        fprintf(stderr, "need at least a thread and a round\n");
+        return 1;
+    }
+    threads = (pthread_t*)malloc(max_threads * sizeof(pthread_t));
+
+    // The sleepers inherit the blocked signal.
+    sigemptyset(&set);
+    sigaddset(&set, SIGSTOPSLEEP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    base = time_rounds(width, rounds);
+    printf("%d rounds of %d pointers, %.1f us per round alone.\n", rounds,
+           g_threadscan_ptrs_per_thread, base * 1e6);
+    printf("Handshake time per round, in us:\n");
+    printf("%8s %10s %12s\n", "threads",
+           width > 0 ? "tree" : "linear", "linear");
+
+    // Double the thread count from 16, and end on max_threads.
+    n = max_threads < 16 ? max_threads : 16;
+    while (1) {
+        double tree, linear;
+        for (i = 0; i < n; ++i) {
+            if (pthread_create(&threads[i], NULL, sleeper, NULL)) {
+                fprintf(stderr, "stopped at %d threads\n", i);
+                return 1;
+            }
+        }
+        tree = time_rounds(width, rounds) - base;
+        linear = time_rounds(n, rounds) - base;
+        printf("%8d %10.1f %12.1f\n", n, tree * 1e6, linear * 1e6);
+        fflush(stdout);
+
+        for (i = 0; i < n; ++i) pthread_kill(threads[i], SIGSTOPSLEEP);
+        for (i = 0; i < n; ++i) pthread_join(threads[i], NULL);
+        if (n == max_threads) break;
+        n = n * 2 < max_threads ? n * 2 : max_threads;
+    }
+    g_threadscan_fanout = width;
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Benchmark Description:
+   Threads collect in a tight loop, with 1x, 2x and 4x as many threads as
+   there are CPUs.  When oversubscribed, threads waiting on a round take
+   CPU from the threads the round is waiting on, unless they sleep.
+   Reports Mops/s and the CPU seconds the process used.
+
+   Usage: bench/oversub [ops per thread [local block KB]]
+
+   With a local block, each thread registers one of that size, so the
+   rounds take longer.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "threadscan.h"
+
+static long ops_per_thread;
+static size_t block_kb;
+
+static double now ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * User and system CPU seconds used by the process so far.
+ */
+static double cpu_seconds ()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+static void *worker (void *arg)
+{
+    char *block = NULL;
+    long i;
+
+    if (block_kb) {
+        block = (char*)calloc(block_kb, 1024);
+        threadscan_register_local_block(block, block_kb * 1024);
+    }
+    for (i = 0; i < ops_per_thread; ++i) threadscan_collect(malloc(32));
+    if (block) {
+        threadscan_unregister_local_block(block);
+        free(block);
+    }
+    return NULL;
+}
+
+/**
+ * Run n_threads workers to the end, and print the rate and CPU time.
+ */
+static void run (int n_threads, int n_cpus)
+{
+    pthread_t *threads = (pthread_t*)malloc(n_threads * sizeof(pthread_t));
+    double start = now(), cpu = cpu_seconds(), sec;
+    int i;
+
+    for (i = 0; i < n_threads; ++i) {
+        pthread_create(&threads[i], NULL, worker, NULL);
+    }
+    for (i = 0; i < n_threads; ++i) pthread_join(threads[i], NULL);
+    sec = now() - start;
+    cpu = cpu_seconds() - cpu;
+
+    printf("  %3d threads (%dx): %6.2f Mops/s, %6.2f CPU seconds\n",
+           n_threads, n_threads / n_cpus,
+           n_threads * (double)ops_per_thread / sec / 1e6, cpu);
+    free(threads);
+}
+
+int main (int argc, char **argv)
+{
+    int n_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN), k;
+
+    ops_per_thread = argc > 1 ? atol(argv[1]) : 2000000;
+    block_kb = argc > 2 ? atoi(argv[2]) : 0;
+    if (ops_per_thread < 1) {
+        fprintf(stderr, "ops per thread must be at least 1\n");
+        return 1;
+    }
+    if (n_cpus < 1) n_cpus = 1;
+
+    printf("%d CPUs, %ld ops per thread, %zu KB local blocks:\n", n_cpus,
+           ops_per_thread, block_kb);
+    for (k = 1; k <= 4; k *= 2) run(k * n_cpus, n_cpus);
+    return 0;
+}
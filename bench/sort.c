@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Benchmark Description:
+   Sort heap-like addresses with threadscan_util_sort() and with the
+   quicksort it replaced, at 10K, 1M and 8M addresses.  The results are
+   checked against each other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "util.h"
+
+static double now ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/****************************************************************************/
+/*                     The quicksort from before radix.                     */
+/****************************************************************************/
+
+static void swap (size_t *addrs, int n, int m)
+{
+    size_t addr = addrs[n];
+    addrs[n] = addrs[m];
+    addrs[m] = addr;
+}
+
+static int partition (size_t *addrs, int min, int max)
+{
+    int pivot = (max + min) / 2;
+    size_t pivot_val = addrs[pivot];
+    int mid = min;
+    int i;
+
+    swap(addrs, pivot, max);
+    for (i = min; i < max; ++i) {
+        if (addrs[i] <= pivot_val) {
+            swap(addrs, i, mid);
+            ++mid;
+        }
+    }
+    swap(addrs, mid, max);
+    return mid;
+}
+
+static void insertion_sort (size_t *addrs, int min, int max)
+{
+    int i, j;
+    for (i = min + 1; i <= max; ++i) {
+        for (j = i; j > min && addrs[j - 1] > addrs[j]; --j) {
+            swap(addrs, j, j - 1);
+        }
+    }
+}
+
+static void quicksort (size_t *addrs, int min, int max)
+{
+    if (max - min > 16) {
+        int mid = partition(addrs, min, max);
+        quicksort(addrs, min, mid - 1);
+        quicksort(addrs, mid + 1, max);
+    } else {
+        insertion_sort(addrs, min, max);
+    }
+}
+
+/****************************************************************************/
+/*                                Benchmark                                 */
+/****************************************************************************/
+
+int main ()
+{
+    static const int sizes[] = { 10000, 1000000, 8000000 };
+    int k;
+
+    for (k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); ++k) {
+        int n = sizes[k];
+        int reps = n < 100000 ? 200 : 3;
+        size_t *src = (size_t*)malloc(n * sizeof(size_t));
+        size_t *a = (size_t*)malloc(n * sizeof(size_t));
+        size_t *tmp = (size_t*)malloc(n * sizeof(size_t));
+        size_t *ref = (size_t*)malloc(n * sizeof(size_t));
+        double t0, tq = 0, tr = 0;
+        int i, r;
+
+        // 16-byte aligned addresses in a region about 64 bytes per address,
+        // like a heap of small nodes.
+        srand(42);
+        for (i = 0; i < n; ++i) {
+            size_t rnd = (size_t)rand() * RAND_MAX + rand();
+            src[i] = 0x7f0000000000ULL + rnd % ((size_t)n * 4) * 16;
+        }
+
+        for (r = 0; r < reps; ++r) {
+            memcpy(a, src, n * sizeof(size_t));
+            t0 = now();
+            quicksort(a, 0, n - 1);
+            tq += now() - t0;
+        }
+        memcpy(ref, a, n * sizeof(size_t));
+
+        for (r = 0; r < reps; ++r) {
+            memcpy(a, src, n * sizeof(size_t));
+            t0 = now();
+            threadscan_util_sort(a, tmp, n);
+            tr += now() - t0;
+        }
+        if (0 != memcmp(a, ref, n * sizeof(size_t))) {
+            printf("sort mismatch at %d addresses\n", n);
+            return 1;
+        }
+
+        printf("%8d addresses: quicksort %9.3f ms, radix %9.3f ms (%.2fx)\n",
+               n, tq / reps * 1e3, tr / reps * 1e3, tq / tr);
+        free(src);
+        free(a);
+        free(tmp);
+        free(ref);
+    }
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "dirty.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "util.h"
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+// Bit 55 of a pagemap entry is the page's soft-dirty bit.
+#define PM_SOFT_DIRTY ((uint64_t)1 << 55)
+
+// Pagemap entries read at a time: a page of them.
+#define PM_BATCH (PAGESIZE / sizeof(uint64_t))
+
+#define PAGE_ROUND(n) (((n) + PAGESIZE - 1) & ~(PAGESIZE - 1))
+
+// Bytes mapped for a cache's arrays, given their capacities.  There's one
+// more offset than there are pages, for the end of the last page.
+#define START_SIZE(pages) PAGE_ROUND(((pages) + 1) * sizeof(size_t))
+#define DIRTY_SIZE(pages) PAGE_ROUND(pages)
+#define WORDS_SIZE(words) PAGE_ROUND((words) * sizeof(size_t))
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+static int g_pagemap_fd = -1;
+static int g_clear_refs_fd = -1;
+
+/****************************************************************************/
+/*                                 Helpers                                  */
+/****************************************************************************/
+
+/**
+ * Return whether the page at addr is soft-dirty, or -1 on error.
+ */
+static int page_is_dirty (size_t addr)
+{
+    uint64_t entry;
+    off_t offset = (off_t)(addr / PAGESIZE * sizeof(entry));
+
+    if (pread(g_pagemap_fd, &entry, sizeof(entry), offset)
+        != sizeof(entry)) {
+        return -1;
+    }
+    return (entry & PM_SOFT_DIRTY) != 0;
+}
+
+
+/**
+ * Replace *buf, of old_size bytes, with a zeroed mapping of new_size bytes.
+ * The contents are copied over if keep is set.  This is called from the
+ * signal handler, so it uses mmap() directly instead of
+ * threadscan_alloc_mmap(), which takes a lock.
+ */
+static void *grow (void *buf, size_t old_size, size_t new_size, int keep)
+{
+    void *new_buf = mmap(NULL, new_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == new_buf) {
+        threadscan_fatal("threadscan: failed mmap().\n");
+    }
+    if (buf) {
+        if (keep) memcpy(new_buf, buf, old_size);
+        munmap(buf, old_size);
+    }
+    return new_buf;
+}
+
+/****************************************************************************/
+/*                                Interface                                 */
+/****************************************************************************/
+
+int threadscan_dirty_init ()
+{
+    volatile char *page;
+    int ok;
+
+    g_pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    g_clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+    page = (volatile char*)mmap(NULL, PAGESIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (g_pagemap_fd < 0 || g_clear_refs_fd < 0 || MAP_FAILED == page) {
+        ok = 0;
+    } else {
+        // The files can be there without the kernel tracking anything, so
+        // check that a write to a clean page shows up.
+        page[0] = 1;
+        threadscan_dirty_clear();
+        ok = 0 == page_is_dirty((size_t)page);
+        page[0] = 2;
+        ok = ok && 1 == page_is_dirty((size_t)page);
+    }
+    if (MAP_FAILED != page) munmap((void*)page, PAGESIZE);
+
+    if (!ok) {
+        if (g_pagemap_fd >= 0) close(g_pagemap_fd);
+        if (g_clear_refs_fd >= 0) close(g_clear_refs_fd);
+        g_pagemap_fd = g_clear_refs_fd = -1;
+    }
+    return ok;
+}
+
+void threadscan_dirty_clear ()
+{
+    if (pwrite(g_clear_refs_fd, "4", 1, 0) != 1) {
+        threadscan_fatal("threadscan: unable to clear soft-dirty bits.\n");
+    }
+}
+
+void threadscan_dirty_read (page_cache_t *cache)
+{
+    uint64_t entries[PM_BATCH];
+    size_t i, j;
+
+    for (i = 0; i < cache->n_pages; i += PM_BATCH) {
+        size_t n = MIN_OF(PM_BATCH, cache->n_pages - i);
+        off_t offset =
+            (off_t)((cache->low / PAGESIZE + i) * sizeof(uint64_t));
+        ssize_t len = pread(g_pagemap_fd, entries, n * sizeof(uint64_t),
+                            offset);
+
+        if (len != (ssize_t)(n * sizeof(uint64_t))) {
+            // Search the pages again, rather than guess.
+            memset(&cache->dirty[i], 1, cache->n_pages - i);
+            return;
+        }
+        for (j = 0; j < n; ++j) {
+            cache->dirty[i + j] = (entries[j] & PM_SOFT_DIRTY) != 0;
+        }
+    }
+}
+
+void threadscan_dirty_reserve (page_cache_t *cache, size_t n_pages,
+                               size_t n_words)
+{
+    if (n_pages > cache->pages_capacity) {
+        size_t old = cache->pages_capacity;
+        size_t pages = old * 2 > n_pages ? old * 2 : n_pages;
+
+        // As many as fit in the whole pages mapped.
+        pages = MIN_OF(START_SIZE(pages) / sizeof(size_t) - 1,
+                       DIRTY_SIZE(pages));
+        cache->start = (size_t*)grow(cache->start, old ? START_SIZE(old) : 0,
+                                     START_SIZE(pages), 0);
+        cache->dirty = (unsigned char*)grow(cache->dirty,
+                                            old ? DIRTY_SIZE(old) : 0,
+                                            DIRTY_SIZE(pages), 0);
+        cache->pages_capacity = pages;
+    }
+    if (n_words > cache->words_capacity) {
+        size_t old = cache->words_capacity;
+        size_t words = old * 2 > n_words ? old * 2 : n_words;
+
+        words = WORDS_SIZE(words) / sizeof(size_t);
+        cache->words = (size_t*)grow(cache->words, WORDS_SIZE(old),
+                                     WORDS_SIZE(words), 1);
+        cache->words_capacity = words;
+    }
+}
+
+void threadscan_dirty_cache_free (page_cache_t *cache)
+{
+    if (cache->start) {
+        munmap(cache->start, START_SIZE(cache->pages_capacity));
+        munmap(cache->dirty, DIRTY_SIZE(cache->pages_capacity));
+    }
+    if (cache->words) {
+        munmap(cache->words, WORDS_SIZE(cache->words_capacity));
+    }
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,89 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Soft-dirty page tracking, so a round can skip memory that hasn't been
+   written since the last one.  Writing "4" to /proc/self/clear_refs clears
+   the soft-dirty bit of every page in the process, and the kernel sets it
+   again, in /proc/self/pagemap, when the page is written.
+
+   A page_cache_t holds the words of a range of memory that might be
+   collected addresses, page by page.  A page that's clean since its words
+   were cached doesn't have to be read again; its cached words are searched
+   instead.
+ */
+
+#ifndef _DIRTY_H_
+#define _DIRTY_H_
+
+#include <stddef.h>
+
+typedef struct page_cache_t page_cache_t;
+
+struct page_cache_t {
+    // The whole pages cached, and the clear they were read after (0 for
+    // none).
+    size_t low;
+    size_t n_pages;
+    size_t epoch;
+
+    // The words cached for page i are words[start[i]] up to
+    // words[start[i + 1]].
+    size_t *start;
+    size_t *words;
+    size_t n_words;
+
+    // One byte per page: whether it was written before the last clear.
+    unsigned char *dirty;
+
+    size_t pages_capacity;
+    size_t words_capacity;
+};
+
+/**
+ * Check that the kernel tracks soft-dirty pages.  Return 1 if it does, 0
+ * otherwise.
+ */
+int threadscan_dirty_init ();
+
+/**
+ * Clear the soft-dirty bits of every page in the process.
+ */
+void threadscan_dirty_clear ();
+
+/**
+ * Fill in cache->dirty for the cached pages.
+ */
+void threadscan_dirty_read (page_cache_t *cache);
+
+/**
+ * Make room in the cache for n_pages pages and n_words words.
+ */
+void threadscan_dirty_reserve (page_cache_t *cache, size_t n_pages,
+                               size_t n_words);
+
+/**
+ * Release the cache's memory.
+ */
+void threadscan_dirty_cache_free (page_cache_t *cache);
+
+#endif // !defined _DIRTY_H_
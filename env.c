@@ -22,18 +22,125 @@ THE SOFTWARE.
 
 #include "env.h"
 #include <stdlib.h>
+#include <string.h>
 #include "util.h"
 
 #define MAX_PTRS_PER_THREAD (32 * 1024)
 #define MIN_PTRS_PER_THREAD 1024
 
 static const char env_ptrs_per_thread[] = "THREADSCAN_PTRS_PER_THREAD";
+static const char env_sort_helpers[] = "THREADSCAN_SORT_HELPERS";
+static const char env_scan_isa[] = "THREADSCAN_SCAN_ISA";
+static const char env_engine[] = "THREADSCAN_ENGINE";
+static const char env_collector[] = "THREADSCAN_COLLECTOR";
+static const char env_collector_cpu[] = "THREADSCAN_COLLECTOR_CPU";
+static const char env_collector_interval[] = "THREADSCAN_COLLECTOR_INTERVAL";
+static const char env_collector_watermark[] =
+    "THREADSCAN_COLLECTOR_WATERMARK";
+static const char env_old_gen_interval[] = "THREADSCAN_OLD_GEN_INTERVAL";
+static const char env_old_gen_limit[] = "THREADSCAN_OLD_GEN_LIMIT";
+static const char env_stats[] = "THREADSCAN_STATS";
+static const char env_byte_budget[] = "THREADSCAN_BYTE_BUDGET";
+static const char env_pressure[] = "THREADSCAN_PRESSURE";
+static const char env_pressure_interval[] = "THREADSCAN_PRESSURE_INTERVAL";
+static const char env_pressure_psi_path[] = "THREADSCAN_PRESSURE_PSI_PATH";
+static const char env_pressure_cgroup_path[] =
+    "THREADSCAN_PRESSURE_CGROUP_PATH";
+static const char env_pressure_psi_limit[] = "THREADSCAN_PRESSURE_PSI_LIMIT";
+static const char env_pressure_cgroup_limit[] =
+    "THREADSCAN_PRESSURE_CGROUP_LIMIT";
+static const char env_soft_dirty[] = "THREADSCAN_SOFT_DIRTY";
+static const char env_soft_dirty_interval[] =
+    "THREADSCAN_SOFT_DIRTY_INTERVAL";
+static const char env_safepoint[] = "THREADSCAN_SAFEPOINT";
+static const char env_safepoint_timeout[] = "THREADSCAN_SAFEPOINT_TIMEOUT";
+static const char env_epoch[] = "THREADSCAN_EPOCH";
+static const char env_fanout[] = "THREADSCAN_FANOUT";
+static const char env_numa[] = "THREADSCAN_NUMA";
+static const char env_numa_nodes[] = "THREADSCAN_NUMA_NODES";
+static const char env_numa_helpers[] = "THREADSCAN_NUMA_HELPERS";
+static const char env_huge_pages[] = "THREADSCAN_HUGE_PAGES";
 
 // # of ptrs a thread can "save up" before initiating a collection run.
 // The number of pointers per thread should be a power of 2 because we use
 // this number to do masking (to avoid the costly modulo operation).
 int g_threadscan_ptrs_per_thread;
 
+// Whether threads waiting on a reclamation may help sort its pointers.
+int g_threadscan_sort_helpers;
+
+// Instruction set for the search kernels, or SCAN_ISA_AUTO.
+int g_threadscan_scan_isa;
+
+// How reclamation finds addresses: ENGINE_SORT or ENGINE_HASH.
+int g_threadscan_engine;
+
+// Whether a background thread does the reclamation.
+int g_threadscan_collector;
+
+// CPU the collector thread is pinned to, or -1.
+int g_threadscan_collector_cpu;
+
+// Milliseconds between collector runs, or 0 to only run at the watermark.
+int g_threadscan_collector_interval;
+
+// Percent of a thread's pointer list that wakes the collector.
+int g_threadscan_collector_watermark;
+
+// Rounds between searches for the old generation of leftover pointers.
+int g_threadscan_old_gen_interval;
+
+// Size at which the old generation is searched anyway, or 0 for the default.
+int g_threadscan_old_gen_limit;
+
+// Whether to print statistics when the program exits.
+int g_threadscan_stats;
+
+// Bytes collected through threadscan_collect_sized() that trigger a
+// reclamation.
+size_t g_threadscan_byte_budget;
+
+// Whether to watch for memory pressure, and how often, in milliseconds.
+int g_threadscan_pressure;
+int g_threadscan_pressure_interval;
+
+// Where to read the PSI memory stall information and the cgroup limits.
+const char *g_threadscan_pressure_psi_path;
+const char *g_threadscan_pressure_cgroup_path;
+
+// Percent stall time (PSI "some avg10"), and percent of the cgroup's
+// memory.max in use, that count as pressure.
+int g_threadscan_pressure_psi_limit;
+int g_threadscan_pressure_cgroup_limit;
+
+// Whether to skip memory that hasn't been written since the last round,
+// and how often, at most, in milliseconds, to clear the soft-dirty bits.
+int g_threadscan_soft_dirty;
+int g_threadscan_soft_dirty_interval;
+
+// Whether threads answer at safepoints, and how long, in microseconds, the
+// reclaimer waits for them before it signals them.
+int g_threadscan_safepoint;
+int g_threadscan_safepoint_timeout;
+
+// Whether threads mark their operations, so pointers can be free'd without
+// a search once every thread has been outside of one.
+int g_threadscan_epoch;
+
+// Number of threads each signalled thread passes the signal on to, or 0 if
+// the reclaimer signals them all.
+int g_threadscan_fanout;
+
+// Whether to place memory on NUMA nodes, the number of nodes to pretend
+// there are, or 0 for the real topology, and whether a helper on each node
+// frees the pointers there.
+int g_threadscan_numa;
+int g_threadscan_numa_nodes;
+int g_threadscan_numa_helpers;
+
+// Whether the reclaimer's working memory is backed by huge pages.
+int g_threadscan_huge_pages;
+
 /** Parse an integer from a string.  0 if val is NULL.
  */
 static int get_int (const char *val, int default_val)
@@ -84,4 +191,226 @@ static void env_init ()
 
         g_threadscan_ptrs_per_thread = ptrs_per_thread;
     }
+
+    // Engine -- the working pointers list is sorted and searched through an
+    // index by default (THREADSCAN_ENGINE=sort).  THREADSCAN_ENGINE=hash
+    // puts it in a hash set instead, which skips the sort.
+    {
+        const char *engine = getenv(env_engine);
+        g_threadscan_engine = ENGINE_SORT;
+        if (NULL == engine || 0 == strcmp(engine, "sort")) {
+            // Use the default.
+        } else if (0 == strcmp(engine, "hash")) {
+            g_threadscan_engine = ENGINE_HASH;
+        } else {
+            threadscan_diagnostic("warning: %s = %s\n"
+                                  "  But valid values are sort and hash\n",
+                                  env_engine, engine);
+        }
+    }
+
+    // Sort helpers -- threads whose pointer lists are full wait for the
+    // reclaimer, and they can spend that time sorting buckets of the working
+    // pointers list.  On by default; set THREADSCAN_SORT_HELPERS=0 to leave
+    // the sort to the reclaimer.
+    g_threadscan_sort_helpers = get_int(getenv(env_sort_helpers), 1);
+
+    // Scan ISA -- the search kernels are picked for the CPU when the library
+    // loads.  THREADSCAN_SCAN_ISA may be set to sse2, avx2 or avx512 to
+    // force a particular set, e.g., to compare them.
+    {
+        const char *isa = getenv(env_scan_isa);
+        g_threadscan_scan_isa = SCAN_ISA_AUTO;
+        if (NULL == isa) {
+            // Use the default.
+        } else if (0 == strcmp(isa, "sse2")) {
+            g_threadscan_scan_isa = SCAN_ISA_SSE2;
+        } else if (0 == strcmp(isa, "avx2")) {
+            g_threadscan_scan_isa = SCAN_ISA_AVX2;
+        } else if (0 == strcmp(isa, "avx512")) {
+            g_threadscan_scan_isa = SCAN_ISA_AVX512;
+        } else {
+            threadscan_diagnostic("warning: %s = %s\n"
+                                  "  But valid values are sse2, avx2 and "
+                                  "avx512\n",
+                                  env_scan_isa, isa);
+        }
+    }
+
+    // Collector -- with THREADSCAN_COLLECTOR=1, a thread owned by the library
+    // does the reclamation.  It runs every THREADSCAN_COLLECTOR_INTERVAL
+    // milliseconds (default 100; 0 for never), and whenever a thread's
+    // pointer list is THREADSCAN_COLLECTOR_WATERMARK percent full (default
+    // 50).  THREADSCAN_COLLECTOR_CPU pins it to a CPU.
+    {
+        g_threadscan_collector = get_int(getenv(env_collector), 0);
+        g_threadscan_collector_cpu = get_int(getenv(env_collector_cpu), -1);
+        g_threadscan_collector_interval =
+            get_int(getenv(env_collector_interval), 100);
+        g_threadscan_collector_watermark =
+            get_int(getenv(env_collector_watermark), 50);
+
+        if (g_threadscan_collector_interval < 0) {
+            threadscan_diagnostic("warning: %s = %s\n"
+                                  "  But min value is 0\n",
+                                  env_collector_interval,
+                                  getenv(env_collector_interval));
+            g_threadscan_collector_interval = 0;
+        }
+        if (g_threadscan_collector_watermark < 1
+            || g_threadscan_collector_watermark > 100) {
+            threadscan_diagnostic("warning: %s = %s\n"
+                                  "  But valid values are 1 to 100\n",
+                                  env_collector_watermark,
+                                  getenv(env_collector_watermark));
+            g_threadscan_collector_watermark = 50;
+        }
+    }
+
+    // Old generation -- pointers that survive two rounds move to the old
+    // generation, which is only searched every THREADSCAN_OLD_GEN_INTERVAL
+    // rounds (default 8; 1 searches it every round), or once it holds
+    // THREADSCAN_OLD_GEN_LIMIT pointers (default 0, a quarter of the
+    // pointers a round can hold).
+    {
+        g_threadscan_old_gen_interval =
+            get_int(getenv(env_old_gen_interval), 8);
+        g_threadscan_old_gen_limit = get_int(getenv(env_old_gen_limit), 0);
+        if (g_threadscan_old_gen_interval < 1) {
+            threadscan_diagnostic("warning: %s = %s\n"
+                                  "  But min value is 1\n",
+                                  env_old_gen_interval,
+                                  getenv(env_old_gen_interval));
+            g_threadscan_old_gen_interval = 1;
+        }
+        if (g_threadscan_old_gen_limit < 0) {
+            threadscan_diagnostic("warning: %s = %s\n"
+                                  "  But min value is 0\n",
+                                  env_old_gen_limit,
+                                  getenv(env_old_gen_limit));
+            g_threadscan_old_gen_limit = 0;
+        }
+    }
+
+    // Stats -- THREADSCAN_STATS=1 prints counters for tuning to stderr when
+    // the program exits.
+    g_threadscan_stats = get_int(getenv(env_stats), 0);
+
+    // Byte budget -- threads that collect with threadscan_collect_sized()
+    // start a reclamation once THREADSCAN_BYTE_BUDGET megabytes (default 64)
+    // are waiting for one.
+    {
+        int budget_mb = get_int(getenv(env_byte_budget), 64);
+        if (budget_mb < 1) {
+            threadscan_diagnostic("warning: %s = %s\n"
+                                  "  But min value is 1\n",
+                                  env_byte_budget, getenv(env_byte_budget));
+            budget_mb = 1;
+        }
+        g_threadscan_byte_budget = (size_t)budget_mb * 1024 * 1024;
+    }
+
+    // Memory pressure -- with THREADSCAN_PRESSURE=1, a thread checks every
+    // THREADSCAN_PRESSURE_INTERVAL milliseconds (default 250) whether the
+    // process is short on memory.  That's when the PSI "some avg10" stall
+    // figure is at least THREADSCAN_PRESSURE_PSI_LIMIT percent (default
+    // 10), or the cgroup uses THREADSCAN_PRESSURE_CGROUP_LIMIT percent of
+    // its memory.max (default 90).  The files are read from
+    // THREADSCAN_PRESSURE_PSI_PATH (default /proc/pressure/memory) and
+    // the THREADSCAN_PRESSURE_CGROUP_PATH directory (default
+    // /sys/fs/cgroup).
+    {
+        const char *path;
+
+        g_threadscan_pressure = get_int(getenv(env_pressure), 0);
+        g_threadscan_pressure_interval =
+            get_int(getenv(env_pressure_interval), 250);
+        g_threadscan_pressure_psi_limit =
+            get_int(getenv(env_pressure_psi_limit), 10);
+        g_threadscan_pressure_cgroup_limit =
+            get_int(getenv(env_pressure_cgroup_limit), 90);
+
+        path = getenv(env_pressure_psi_path);
+        g_threadscan_pressure_psi_path =
+            path ? path : "/proc/pressure/memory";
+        path = getenv(env_pressure_cgroup_path);
+        g_threadscan_pressure_cgroup_path = path ? path : "/sys/fs/cgroup";
+
+        if (g_threadscan_pressure_interval < 1) {
+            threadscan_diagnostic("warning: %s = %s\n"
+                                  "  But min value is 1\n",
+                                  env_pressure_interval,
+                                  getenv(env_pressure_interval));
+            g_threadscan_pressure_interval = 1;
+        }
+    }
+
+    // Soft-dirty pages -- with THREADSCAN_SOFT_DIRTY=1, the pages of stacks
+    // and local blocks that haven't been written since the last round
+    // aren't read again.  The kernel has to track soft-dirty pages.  The
+    // bits are cleared at most every THREADSCAN_SOFT_DIRTY_INTERVAL
+    // milliseconds (default 10, or 0 for every round that can use them).
+    g_threadscan_soft_dirty = get_int(getenv(env_soft_dirty), 0);
+    g_threadscan_soft_dirty_interval =
+        get_int(getenv(env_soft_dirty_interval), 10);
+    if (g_threadscan_soft_dirty_interval < 0) {
+        threadscan_diagnostic("warning: %s = %s\n"
+                              "  But min value is 0\n",
+                              env_soft_dirty_interval,
+                              getenv(env_soft_dirty_interval));
+        g_threadscan_soft_dirty_interval = 0;
+    }
+
+    // Safepoints -- with THREADSCAN_SAFEPOINT=1, the reclaimer doesn't
+    // signal the other threads right away.  It waits for them to search at
+    // their next call to threadscan_safepoint(), and signals those that
+    // haven't after THREADSCAN_SAFEPOINT_TIMEOUT microseconds (default
+    // 1000).
+    g_threadscan_safepoint = get_int(getenv(env_safepoint), 0);
+    g_threadscan_safepoint_timeout =
+        get_int(getenv(env_safepoint_timeout), 1000);
+    if (g_threadscan_safepoint_timeout < 0) {
+        threadscan_diagnostic("warning: %s = %s\n"
+                              "  But min value is 0\n",
+                              env_safepoint_timeout,
+                              getenv(env_safepoint_timeout));
+        g_threadscan_safepoint_timeout = 0;
+    }
+
+    // Epochs -- with THREADSCAN_EPOCH=1, threads promise to hold references
+    // to collected objects only between threadscan_begin_op() and
+    // threadscan_end_op().  A round frees its pointers without searching
+    // once every thread has been outside an operation since they were
+    // collected.
+    g_threadscan_epoch = get_int(getenv(env_epoch), 0);
+
+    // Fan-out -- the reclaimer signals THREADSCAN_FANOUT threads (default
+    // 8), and each of them signals that many more before it searches, and
+    // so on.  With 0, the reclaimer signals every thread itself.
+    g_threadscan_fanout = get_int(getenv(env_fanout), 8);
+    if (g_threadscan_fanout < 0) {
+        threadscan_diagnostic("warning: %s = %s\n"
+                              "  But min value is 0\n",
+                              env_fanout, getenv(env_fanout));
+        g_threadscan_fanout = 0;
+    }
+
+    // NUMA -- unless THREADSCAN_NUMA=0, each thread's lists are kept on its
+    // own node, and each node searches its own copy of the search index.
+    // With THREADSCAN_NUMA_HELPERS=1, a thread on each node frees the
+    // pointers there.  THREADSCAN_NUMA_NODES fakes that many nodes, for
+    // testing on a machine with one.
+    g_threadscan_numa = get_int(getenv(env_numa), 1);
+    g_threadscan_numa_nodes = get_int(getenv(env_numa_nodes), 0);
+    g_threadscan_numa_helpers = get_int(getenv(env_numa_helpers), 0);
+    if (g_threadscan_numa_nodes < 0) {
+        threadscan_diagnostic("warning: %s = %s\n"
+                              "  But min value is 0\n",
+                              env_numa_nodes, getenv(env_numa_nodes));
+        g_threadscan_numa_nodes = 0;
+    }
+
+    // Huge pages -- with THREADSCAN_HUGE_PAGES=1, the working memory that
+    // rounds reuse asks the kernel for transparent huge pages.
+    g_threadscan_huge_pages = get_int(getenv(env_huge_pages), 0);
 }
@@ -23,11 +23,94 @@ THE SOFTWARE.
 #ifndef _ENV_H_
 #define _ENV_H_ 1
 
-#define MAX_THREAD_COUNT 256
+#include <stddef.h>
+
+#define SCAN_ISA_AUTO 0
+#define SCAN_ISA_SSE2 1
+#define SCAN_ISA_AVX2 2
+#define SCAN_ISA_AVX512 3
+
+#define ENGINE_SORT 0
+#define ENGINE_HASH 1
 
 // # of ptrs a thread can "save up" before initiating a collection run.
 // The number of pointers per thread should be a power of 2 because we use
 // this number to do masking (to avoid the costly modulo operation).
 extern int g_threadscan_ptrs_per_thread;
 
+// Whether threads waiting on a reclamation may help sort its pointers.
+extern int g_threadscan_sort_helpers;
+
+// Instruction set for the search kernels, or SCAN_ISA_AUTO.
+extern int g_threadscan_scan_isa;
+
+// How reclamation finds addresses: ENGINE_SORT or ENGINE_HASH.
+extern int g_threadscan_engine;
+
+// Whether a background thread does the reclamation.
+extern int g_threadscan_collector;
+
+// CPU the collector thread is pinned to, or -1.
+extern int g_threadscan_collector_cpu;
+
+// Milliseconds between collector runs, or 0 to only run at the watermark.
+extern int g_threadscan_collector_interval;
+
+// Percent of a thread's pointer list that wakes the collector.
+extern int g_threadscan_collector_watermark;
+
+// Rounds between searches for the old generation of leftover pointers.
+extern int g_threadscan_old_gen_interval;
+
+// Size at which the old generation is searched anyway, or 0 for the default.
+extern int g_threadscan_old_gen_limit;
+
+// Whether to print statistics when the program exits.
+extern int g_threadscan_stats;
+
+// Bytes collected through threadscan_collect_sized() that trigger a
+// reclamation.
+extern size_t g_threadscan_byte_budget;
+
+// Whether to watch for memory pressure, and how often, in milliseconds.
+extern int g_threadscan_pressure;
+extern int g_threadscan_pressure_interval;
+
+// Where to read the PSI memory stall information and the cgroup limits.
+extern const char *g_threadscan_pressure_psi_path;
+extern const char *g_threadscan_pressure_cgroup_path;
+
+// Percent stall time (PSI "some avg10"), and percent of the cgroup's
+// memory.max in use, that count as pressure.
+extern int g_threadscan_pressure_psi_limit;
+extern int g_threadscan_pressure_cgroup_limit;
+
+// Whether to skip memory that hasn't been written since the last round,
+// and how often, at most, in milliseconds, to clear the soft-dirty bits.
+extern int g_threadscan_soft_dirty;
+extern int g_threadscan_soft_dirty_interval;
+
+// Whether threads answer at safepoints, and how long, in microseconds, the
+// reclaimer waits for them before it signals them.
+extern int g_threadscan_safepoint;
+extern int g_threadscan_safepoint_timeout;
+
+// Whether threads mark their operations, so pointers can be free'd without
+// a search once every thread has been outside of one.
+extern int g_threadscan_epoch;
+
+// Number of threads each signalled thread passes the signal on to, or 0 if
+// the reclaimer signals them all.
+extern int g_threadscan_fanout;
+
+// Whether to place memory on NUMA nodes, the number of nodes to pretend
+// there are, or 0 for the real topology, and whether a helper on each node
+// frees the pointers there.
+extern int g_threadscan_numa;
+extern int g_threadscan_numa_nodes;
+extern int g_threadscan_numa_helpers;
+
+// Whether the reclaimer's working memory is backed by huge pages.
+extern int g_threadscan_huge_pages;
+
 #endif // !defined _ENV_H_
@@ -23,6 +23,8 @@ THE SOFTWARE.
 #ifndef _THREADSCAN_H_
 #define _THREADSCAN_H_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,13 +37,123 @@ extern "C" {
  */
 extern void threadscan_collect (void *ptr);
 
+/**
+ * Submit n pointers for memory reclamation at once, e.g., all the nodes of a
+ * segment that was unlinked in one step.  Equivalent to calling
+ * threadscan_collect() on each of them, but cheaper.
+ */
+extern void threadscan_collect_bulk (void **ptrs, size_t n);
+
+/**
+ * Like threadscan_collect(), but when there are no more references to ptr,
+ * call fn(ptr, ctx) instead of free(), e.g., to return a node to a pool or
+ * to run a destructor.  fn may collect more pointers; they are reclaimed in
+ * a later pass.  If fn is NULL, this is the same as threadscan_collect().
+ */
+extern void threadscan_collect_fn (void *ptr,
+                                   void (*fn) (void *ptr, void *ctx),
+                                   void *ctx);
+
+/**
+ * Set the function that reclaims pointers collected without one of their
+ * own, in place of free().  Call it before collecting anything.  A NULL fn
+ * goes back to free().
+ */
+extern void threadscan_set_reclaim_fn (void (*fn) (void *ptr, void *ctx),
+                                       void *ctx);
+
+/**
+ * Like threadscan_collect(), but for an object of the given size.  Once the
+ * bytes collected and not yet handed to a reclamation pass the budget set
+ * by THREADSCAN_BYTE_BUDGET (in MB), the caller reclaims, or waits for a
+ * reclamation, before returning.
+ */
+extern void threadscan_collect_sized (void *ptr, size_t bytes);
+
 /**
  * Specify a block of memory, local to the thread that called the function,
  * that ThreadScan will search during the reclamation phase.  Without this
- * call ThreadScan will search only the thread stacks.
+ * call ThreadScan will search only the thread stacks.  A thread may
+ * register up to 8 blocks.  Registering a block again sets its size.
  */
 extern void threadscan_register_local_block (void *addr, size_t size);
 
+/**
+ * Change the size of a block registered by the calling thread.
+ */
+extern void threadscan_resize_local_block (void *addr, size_t size);
+
+/**
+ * Stop searching a block registered by the calling thread.  Once this
+ * returns, the block is no longer searched and may be freed.
+ */
+extern void threadscan_unregister_local_block (void *addr);
+
+/**
+ * With THREADSCAN_EPOCH=1, a thread promises to hold references to
+ * collected objects only between threadscan_begin_op() and
+ * threadscan_end_op().  Once every thread has been outside an operation
+ * since a pointer was collected, it is free'd without searching any stacks
+ * or signalling any threads.  Threads that stay in one operation for a long
+ * time only delay this; their stacks are searched, as usual, in the
+ * meantime.  Calls may nest, and only the outermost pair counts.
+ */
+extern void threadscan_begin_op (void);
+extern void threadscan_end_op (void);
+
+/**
+ * A reclamation domain: pointers collected into it are only searched for in
+ * the memory of the threads attached to it, and its rounds run separately
+ * from the rounds of other domains.  Everything collected without a domain
+ * goes to the default domain, which every thread is in.  A process can
+ * have up to 15 domains besides the default one at a time:
+ * threadscan_domain_create() returns NULL when it has that many.
+ */
+typedef struct threadscan_domain_t threadscan_domain_t;
+
+extern threadscan_domain_t *threadscan_domain_create (void);
+
+/**
+ * Destroy a domain, and free its memory and its id for a new domain.
+ * Every thread must have detached from it first, and returned from its
+ * calls on it.  The pointers still waiting in it are reclaimed.
+ */
+extern void threadscan_domain_destroy (threadscan_domain_t *dom);
+
+/**
+ * Attach the calling thread to the domain, or detach it.  A thread has to
+ * be attached to a domain to collect into it, and while it is, its stack
+ * and local blocks are searched in the domain's rounds.  Pointers the
+ * thread collected into the domain are handed to a round before it
+ * detaches.
+ */
+extern void threadscan_domain_attach (threadscan_domain_t *dom);
+extern void threadscan_domain_detach (threadscan_domain_t *dom);
+
+/**
+ * Like threadscan_collect(), but into the domain.  The calling thread must
+ * be attached to it.
+ */
+extern void threadscan_domain_collect (threadscan_domain_t *dom, void *ptr);
+
+extern volatile size_t threadscan_safepoint_round;
+extern void threadscan_safepoint_poll (void);
+
+/**
+ * With THREADSCAN_SAFEPOINT=1, the reclaimer doesn't signal the other
+ * threads.  It waits for each one to search its own stack at its next call
+ * to threadscan_safepoint(), e.g., at the top of an event loop, and only
+ * signals the threads that haven't by THREADSCAN_SAFEPOINT_TIMEOUT
+ * microseconds.  When no reclaimer is waiting, this is one load and a
+ * branch.
+ */
+static inline void threadscan_safepoint (void)
+{
+    if (__builtin_expect(threadscan_safepoint_round != 0, 0)) {
+        threadscan_safepoint_poll();
+    }
+}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
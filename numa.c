@@ -0,0 +1,375 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE // For sched_setaffinity() and the CPU_SET() macros.
+
+#include "alloc.h"
+#include <assert.h>
+#include "env.h"
+#include "numa.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "util.h"
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+#define NODE_DIR "/sys/devices/system/node"
+
+// Enough for a cpulist file on a big machine.
+#define READ_BUFFER_SIZE 4096
+
+// From <linux/mempolicy.h>, which doesn't get along with the libc headers.
+#define MPOL_PREFERRED 1
+#define MPOL_MF_MOVE (1 << 1)
+
+// Pages are looked up this many at a time.
+#define NODE_QUERY 64
+
+// A batch of pointers for a helper to free.
+#define FREE_BATCH_SIZE (16 * PAGESIZE)
+#define FREE_BATCH_PTRS                                                 \
+    ((FREE_BATCH_SIZE - sizeof(free_batch_t)) / sizeof(size_t))
+
+typedef struct free_batch_t free_batch_t;
+
+typedef struct node_helper_t node_helper_t;
+
+struct free_batch_t {
+    free_batch_t *next;
+    size_t n;
+    size_t ptrs[];
+};
+
+struct node_helper_t {
+    // Full batches, pushed by reclaimers and taken all at once by the
+    // helper, which sleeps on wq while there are none.
+    free_batch_t *volatile batches;
+    wait_queue_t wq;
+    cpu_set_t cpus;
+    int running;
+};
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+static int g_node_count = 1;
+
+// With a fake topology, the next node a thread is put on.
+static int g_fake;
+static volatile int g_next_fake_node;
+
+static node_helper_t g_helpers[MAX_NUMA_NODES];
+static int g_helpers_running;
+
+/****************************************************************************/
+/*                               File reading                               */
+/****************************************************************************/
+
+/**
+ * Read the first line of a file into buf as a string.  Return 0 on success,
+ * -1 if the file can't be read.  The topology is read while the library is
+ * loaded, before the wrapper for read() is ready, so this uses stdio.
+ */
+static int read_file (const char *path, char *buf, size_t size)
+{
+    FILE *fp = fopen(path, "r");
+    int ret = 0;
+
+    if (NULL == fp) return -1;
+    if (NULL == fgets(buf, (int)size, fp)) ret = -1;
+    fclose(fp);
+    return ret;
+}
+
+/**
+ * Parse a list of ranges, like "0-3,8,10-11", and add them to set, if it
+ * isn't NULL.  Return one more than the highest number in the list, or 0
+ * if there isn't one.
+ */
+static int parse_range_list (const char *s, cpu_set_t *set)
+{
+    int end = 0;
+
+    while (*s >= '0' && *s <= '9') {
+        char *next;
+        int low = (int)strtol(s, &next, 10), high = low, i;
+        if ('-' == *next) high = (int)strtol(next + 1, &next, 10);
+        for (i = low; set && i <= high && i < CPU_SETSIZE; ++i) {
+            CPU_SET(i, set);
+        }
+        if (high + 1 > end) end = high + 1;
+        s = ',' == *next ? next + 1 : next;
+    }
+
+    return end;
+}
+
+/****************************************************************************/
+/*                                 Topology                                 */
+/****************************************************************************/
+
+/**
+ * Read the topology.  Return the number of nodes: 1 if the machine has
+ * only one, or if NUMA placement is off.
+ */
+int threadscan_numa_init ()
+{
+    char buf[READ_BUFFER_SIZE];
+
+    if (!g_threadscan_numa) return g_node_count = 1;
+
+    if (g_threadscan_numa_nodes > 0) {
+        g_fake = 1;
+        g_node_count = MIN_OF(g_threadscan_numa_nodes, MAX_NUMA_NODES);
+        return g_node_count;
+    }
+
+    // Without the node directory, it isn't a NUMA kernel, and there's one.
+    if (0 != read_file(NODE_DIR "/online", buf, sizeof(buf))) {
+        return g_node_count = 1;
+    }
+    g_node_count = MIN_OF(parse_range_list(buf, NULL), MAX_NUMA_NODES);
+    if (g_node_count < 1) g_node_count = 1;
+    return g_node_count;
+}
+
+/**
+ * Return the number of nodes, as found by threadscan_numa_init().
+ */
+int threadscan_numa_node_count ()
+{
+    return g_node_count;
+}
+
+/**
+ * Return the node the calling thread runs on, and should keep its memory
+ * on.
+ */
+int threadscan_numa_thread_node ()
+{
+    unsigned int cpu, node;
+
+    if (g_node_count <= 1) return 0;
+    if (g_fake) {
+        return __sync_fetch_and_add(&g_next_fake_node, 1) % g_node_count;
+    }
+    if (0 != syscall(SYS_getcpu, &cpu, &node, NULL)) return 0;
+    return MIN_OF((int)node, g_node_count - 1);
+}
+
+/**
+ * Prefer node for the pages of [addr, addr + size), and move the ones that
+ * are already somewhere else.  Does nothing with one node.
+ */
+void threadscan_numa_bind (void *addr, size_t size, int node)
+{
+    unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long)) + 1]
+        = { 0 };
+
+    if (g_node_count <= 1 || g_fake) return;
+
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+
+    // It's only a preference.  If the kernel won't do it, the pages stay
+    // where they are.
+    syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask, MAX_NUMA_NODES + 1,
+            MPOL_MF_MOVE);
+}
+
+/**
+ * Find the nodes of the pages the n pointers are on.  A node is -1 if the
+ * kernel doesn't say.
+ */
+static void nodes_of (const size_t *ptrs, int n, int *nodes)
+{
+    void *pages[NODE_QUERY];
+    int i;
+
+    assert(n <= NODE_QUERY);
+
+    if (g_fake) {
+        for (i = 0; i < n; ++i) {
+            nodes[i] = (int)(ptrs[i] / PAGESIZE % g_node_count);
+        }
+        return;
+    }
+
+    // With no nodes to move them to, move_pages() only says where they are.
+    for (i = 0; i < n; ++i) pages[i] = (void*)PAGEALIGN(ptrs[i]);
+    if (0 != syscall(SYS_move_pages, 0, n, pages, NULL, nodes, 0)) {
+        for (i = 0; i < n; ++i) nodes[i] = -1;
+    }
+}
+
+/****************************************************************************/
+/*                               Node helpers                               */
+/****************************************************************************/
+
+static int has_batches (void *arg)
+{
+    return NULL != ((node_helper_t*)arg)->batches;
+}
+
+/**
+ * Body of a node helper: free the pointers in every batch it's given.
+ */
+static void *helper_main (void *arg)
+{
+    node_helper_t *helper = (node_helper_t*)arg;
+
+    if (CPU_COUNT(&helper->cpus) > 0
+        && 0 != sched_setaffinity(0, sizeof(cpu_set_t), &helper->cpus)) {
+        threadscan_diagnostic("threadscan: unable to pin a node helper.\n");
+    }
+
+    while (1) {
+        free_batch_t *batch;
+
+        threadscan_util_wait(&helper->wq, has_batches, helper, NULL);
+        batch = __sync_lock_test_and_set(&helper->batches, NULL);
+        while (batch) {
+            free_batch_t *next = batch->next;
+            size_t i;
+            for (i = 0; i < batch->n; ++i) free((void*)batch->ptrs[i]);
+            threadscan_alloc_munmap(batch);
+            batch = next;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start a helper thread on each node to free pointers there.  Return 1 if
+ * they were started, 0 otherwise.
+ */
+int threadscan_numa_start_helpers ()
+{
+    char path[64], buf[READ_BUFFER_SIZE];
+    pthread_t thread;
+    int node;
+
+    if (g_node_count <= 1) return 0;
+
+    for (node = 0; node < g_node_count; ++node) {
+        node_helper_t *helper = &g_helpers[node];
+        CPU_ZERO(&helper->cpus);
+        if (!g_fake) {
+            // A node without CPUs gets no helper.  Its pointers are free'd
+            // wherever they're found.
+            snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+            if (0 != read_file(path, buf, sizeof(buf))
+                || 0 == parse_range_list(buf, &helper->cpus)) {
+                continue;
+            }
+        }
+        if (0 != pthread_create(&thread, NULL, helper_main, helper)) {
+            threadscan_fatal("threadscan: unable to start a node helper.\n");
+        }
+        pthread_detach(thread);
+        helper->running = 1;
+    }
+
+    g_helpers_running = 1;
+    return 1;
+}
+
+/**
+ * Return whether the node helpers are running.
+ */
+int threadscan_numa_helpers_running ()
+{
+    return g_helpers_running;
+}
+
+/**
+ * Give a batch to the helper on node.
+ */
+static void hand_off (int node, free_batch_t *batch)
+{
+    node_helper_t *helper = &g_helpers[node];
+
+    do {
+        batch->next = helper->batches;
+    } while (!BCAS(&helper->batches, batch->next, batch));
+    threadscan_util_wake(&helper->wq);
+}
+
+/**
+ * Add the n pointers to the batches for the helpers on the nodes where they
+ * live.  Full batches are passed to the helpers.
+ */
+void threadscan_numa_free (numa_frees_t *frees, const size_t *ptrs, int n)
+{
+    int nodes[NODE_QUERY];
+    int i, j;
+
+    for (i = 0; i < n; i += NODE_QUERY) {
+        int count = MIN_OF(NODE_QUERY, n - i);
+        nodes_of(&ptrs[i], count, nodes);
+        for (j = 0; j < count; ++j) {
+            int node = nodes[j];
+            free_batch_t *batch;
+
+            if (node < 0 || node >= g_node_count
+                || !g_helpers[node].running) {
+                free((void*)ptrs[i + j]);
+                continue;
+            }
+
+            batch = frees->filling[node];
+            if (NULL == batch) {
+                batch = (free_batch_t*)threadscan_alloc_mmap(FREE_BATCH_SIZE);
+                batch->n = 0;
+                frees->filling[node] = batch;
+            }
+            batch->ptrs[batch->n++] = ptrs[i + j];
+            if (FREE_BATCH_PTRS == batch->n) {
+                hand_off(node, batch);
+                frees->filling[node] = NULL;
+            }
+        }
+    }
+}
+
+/**
+ * Pass the partly full batches to the helpers.
+ */
+void threadscan_numa_flush (numa_frees_t *frees)
+{
+    int node;
+
+    for (node = 0; node < g_node_count; ++node) {
+        if (frees->filling[node]) {
+            hand_off(node, frees->filling[node]);
+            frees->filling[node] = NULL;
+        }
+    }
+}
@@ -0,0 +1,107 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   The NUMA topology of the machine, read from /sys/devices/system/node,
+   and the placement of memory and threads on its nodes.  With
+   THREADSCAN_NUMA_NODES, the topology is faked: threads are dealt out to
+   the nodes in turn, and nothing is actually placed, so the rest of the
+   library can be tested on a machine with one node.
+ */
+
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include <stddef.h>
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+// Most nodes the library keeps track of.  Nodes past this are treated as
+// the last one.
+#define MAX_NUMA_NODES 64
+
+typedef struct numa_frees_t numa_frees_t;
+
+/**
+ * Batches of pointers for the node helpers to free, one for each node, as
+ * one caller fills them.
+ */
+struct numa_frees_t {
+    struct free_batch_t *filling[MAX_NUMA_NODES];
+};
+
+/****************************************************************************/
+/*                                 Topology                                 */
+/****************************************************************************/
+
+/**
+ * Read the topology.  Return the number of nodes: 1 if the machine has
+ * only one, or if NUMA placement is off.
+ */
+int threadscan_numa_init ();
+
+/**
+ * Return the number of nodes, as found by threadscan_numa_init().
+ */
+int threadscan_numa_node_count ();
+
+/**
+ * Return the node the calling thread runs on, and should keep its memory
+ * on.
+ */
+int threadscan_numa_thread_node ();
+
+/**
+ * Prefer node for the pages of [addr, addr + size), and move the ones that
+ * are already somewhere else.  Does nothing with one node.
+ */
+void threadscan_numa_bind (void *addr, size_t size, int node);
+
+/****************************************************************************/
+/*                               Node helpers                               */
+/****************************************************************************/
+
+/**
+ * Start a helper thread on each node to free pointers there.  Return 1 if
+ * they were started, 0 otherwise.
+ */
+int threadscan_numa_start_helpers ();
+
+/**
+ * Return whether the node helpers are running.
+ */
+int threadscan_numa_helpers_running ();
+
+/**
+ * Add the n pointers to the batches for the helpers on the nodes where they
+ * live.  Full batches are passed to the helpers.
+ */
+void threadscan_numa_free (numa_frees_t *frees, const size_t *ptrs, int n);
+
+/**
+ * Pass the partly full batches to the helpers.
+ */
+void threadscan_numa_flush (numa_frees_t *frees);
+
+#endif // !defined _NUMA_H_
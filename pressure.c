@@ -0,0 +1,159 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "env.h"
+#include <fcntl.h>
+#include <limits.h>
+#include "pressure.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "util.h"
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+// Enough for the PSI file, which is two lines, and the cgroup files.
+#define READ_BUFFER_SIZE 256
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+static int g_use_psi;
+static int g_use_cgroup;
+
+static char g_cgroup_current[PATH_MAX];
+static char g_cgroup_max[PATH_MAX];
+
+/****************************************************************************/
+/*                               File reading                               */
+/****************************************************************************/
+
+/**
+ * Read the start of a file into buf as a string.  Return 0 on success, -1
+ * if the file can't be read.  This doesn't allocate, so it's safe to call
+ * from any thread.
+ */
+static int read_file (const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY);
+    ssize_t len;
+
+    if (fd < 0) return -1;
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len < 0) return -1;
+    buf[len] = '\0';
+    return 0;
+}
+
+/**
+ * Return the "some avg10" figure from the PSI file: the percent of the last
+ * ten seconds that some thread was stalled on memory.  -1 on error.
+ */
+static double read_psi ()
+{
+    char buf[READ_BUFFER_SIZE];
+    char *avg10;
+
+    if (0 != read_file(g_threadscan_pressure_psi_path, buf, sizeof(buf))) {
+        return -1;
+    }
+
+    // The file looks like:
+    //   some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    //   full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    if (0 != strncmp(buf, "some ", 5)
+        || NULL == (avg10 = strstr(buf, "avg10="))) {
+        return -1;
+    }
+    return strtod(avg10 + 6, NULL);
+}
+
+/**
+ * Return how much of its memory.max the cgroup is using, in percent.  -1
+ * if it can't be read or there's no limit.
+ */
+static double read_cgroup ()
+{
+    char buf[READ_BUFFER_SIZE];
+    unsigned long long current, max;
+
+    if (0 != read_file(g_cgroup_max, buf, sizeof(buf))
+        || 0 == strncmp(buf, "max", 3)) {
+        return -1;
+    }
+    max = strtoull(buf, NULL, 10);
+
+    if (0 != read_file(g_cgroup_current, buf, sizeof(buf)) || 0 == max) {
+        return -1;
+    }
+    current = strtoull(buf, NULL, 10);
+
+    return 100.0 * current / max;
+}
+
+/****************************************************************************/
+/*                                Interface                                 */
+/****************************************************************************/
+
+/**
+ * Check which sources of pressure information can be read.  Return 1 if
+ * there are any, 0 otherwise.
+ */
+int threadscan_pressure_init ()
+{
+    snprintf(g_cgroup_current, sizeof(g_cgroup_current), "%s/memory.current",
+             g_threadscan_pressure_cgroup_path);
+    snprintf(g_cgroup_max, sizeof(g_cgroup_max), "%s/memory.max",
+             g_threadscan_pressure_cgroup_path);
+
+    g_use_psi = read_psi() >= 0;
+    g_use_cgroup = read_cgroup() >= 0;
+
+    if (!g_use_psi && !g_use_cgroup) {
+        threadscan_diagnostic("warning: no memory pressure information in "
+                              "%s or %s.\n",
+                              g_threadscan_pressure_psi_path,
+                              g_threadscan_pressure_cgroup_path);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Read the pressure sources and return 1 if either is past its limit, 0
+ * otherwise.
+ */
+int threadscan_pressure_poll ()
+{
+    if (g_use_psi && read_psi() >= g_threadscan_pressure_psi_limit) {
+        return 1;
+    }
+    if (g_use_cgroup && read_cgroup() >= g_threadscan_pressure_cgroup_limit) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Watch for memory pressure on the process: the memory stall information
+   the kernel reports in /proc/pressure/memory (PSI), and how close the
+   cgroup is to its memory.max.  The paths come from the environment, so
+   they can point at test files.
+ */
+
+#ifndef _PRESSURE_H_
+#define _PRESSURE_H_
+
+/**
+ * Check which sources of pressure information can be read.  Return 1 if
+ * there are any, 0 otherwise.
+ */
+int threadscan_pressure_init ();
+
+/**
+ * Read the pressure sources and return 1 if either is past its limit, 0
+ * otherwise.
+ */
+int threadscan_pressure_poll ();
+
+#endif // !defined _PRESSURE_H_
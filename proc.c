@@ -20,15 +20,16 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-#define _GNU_SOURCE // For pthread_yield().
 #include "alloc.h"
 #include <assert.h>
+#include "env.h"
 #include <errno.h>
 #include "proc.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include "util.h"
 
@@ -54,6 +55,17 @@ struct mapline_t {
     char location[MAPLINE_LOCATION_SIZE];
 };
 
+/**
+ * A new reclaimer waiting for td to stop helping with rounds before curr.
+ */
+
+typedef struct timestamp_wait_t timestamp_wait_t;
+
+struct timestamp_wait_t {
+    domain_member_t *member;
+    size_t curr;
+};
+
 /****************************************************************************/
 /*                             Static utilities                             */
 /****************************************************************************/
@@ -61,10 +73,12 @@ struct mapline_t {
 /**
  * List of threads the system needs to know about for signalling and
  * stalling.  This list gets updated whenever a new thread is created or
- * whenever an old thread exits.
+ * whenever an old thread exits.  Going through it doesn't hold either up.
  */
-static thread_list_t thread_list = { (thread_data_t*)0x1,
-                                     PTHREAD_MUTEX_INITIALIZER };
+static thread_list_t thread_list = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .epoch_lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 /**
  * Return the list of thread metadata objects for all the threads known to
@@ -72,6 +86,15 @@ static thread_list_t thread_list = { (thread_data_t*)0x1,
  */
 thread_list_t *threadscan_proc_get_thread_list () { return &thread_list; }
 
+/**
+ * Every domain, by id.  The default domain is registered first.  A
+ * destroyed domain's slot is NULL until its id is reused.  domain_count is
+ * one past the highest id ever given out.
+ */
+static domain_t *volatile domains[MAX_DOMAINS];
+static volatile int domain_count;
+static pthread_mutex_t domains_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Path to the maps file for this process: /proc/<pid>/maps
  */
@@ -157,9 +180,6 @@ void threadscan_proc_stack_from_addr (mem_range_t *mem_range, size_t addr)
  */
 void threadscan_proc_add_thread_data (thread_data_t *td)
 {
-    // The list initialization will only actually happen if this is the
-    // first time.
-    threadscan_util_thread_list_init(&thread_list);
     threadscan_util_thread_list_add(&thread_list, td);
 }
 
@@ -173,27 +193,342 @@ void threadscan_proc_remove_thread_data (thread_data_t *td)
 }
 
 /**
- * Send a signal to all threads in the process (except the calling thread)
- * using pthread_kill().
+ * Wait until nothing that went through the thread list can still have the
+ * data of the threads removed from it so far, so that it can be freed.
  */
-int threadscan_proc_signal_all_except (int sig, thread_data_t *except)
+void threadscan_proc_wait_for_readers ()
+{
+    threadscan_util_thread_list_wait_for_readers(&thread_list);
+}
+
+/**
+ * Give a domain the lowest free id and a signalling tree.  Return 0, with
+ * nothing allocated, if all MAX_DOMAINS ids are in use.
+ */
+int threadscan_proc_add_domain (domain_t *dom)
+{
+    int id;
+
+    pthread_mutex_lock(&domains_lock);
+    for (id = 0; id < MAX_DOMAINS && domains[id]; ++id) continue;
+    if (MAX_DOMAINS == id) {
+        pthread_mutex_unlock(&domains_lock);
+        return 0;
+    }
+
+    dom->id = id;
+    dom->timestamp = 1;
+    dom->tree.nodes = (thread_data_t**)threadscan_alloc_mmap(PAGESIZE);
+    dom->tree.count = 0;
+    dom->tree.capacity = PAGESIZE / sizeof(thread_data_t*);
+    domains[id] = dom;
+    __sync_synchronize(); // mfence.
+    if (id >= domain_count) domain_count = id + 1;
+    pthread_mutex_unlock(&domains_lock);
+    return 1;
+}
+
+/**
+ * Take the domain's id back, so a new domain can have it, and free its
+ * signalling tree.  Return 0, and leave the domain as it was, if a thread
+ * is still a member.
+ */
+int threadscan_proc_remove_domain (domain_t *dom)
 {
-    int signal_count = 0;
     thread_data_t *td;
+    int members = 0;
+
+    FOREACH_IN_THREAD_LIST(td, &thread_list)
+        assert(td);
+        members += IS_MEMBER(td, dom->id);
+    ENDFOREACH_IN_THREAD_LIST(td, &thread_list);
+    if (members > 0) return 0;
+
+    pthread_mutex_lock(&domains_lock);
+    domains[dom->id] = NULL;
+    pthread_mutex_unlock(&domains_lock);
+    threadscan_alloc_munmap(dom->tree.nodes);
+    return 1;
+}
+
+/**
+ * Return the domain with the given id, or NULL if there isn't one.
+ */
+domain_t *threadscan_proc_get_domain (int id)
+{
+    return id < domain_count ? domains[id] : NULL;
+}
+
+/**
+ * Make the calling thread, td, a member of the domain, or stop it being
+ * one.  Rounds that have started already may or may not see the change.
+ */
+void threadscan_proc_set_membership (domain_t *dom, thread_data_t *td,
+                                     int member)
+{
+    if (member) {
+        threadscan_util_thread_data_join(td, dom->id);
+    } else {
+        __sync_fetch_and_and(&td->domains, ~(1U << dom->id));
+    }
+}
+
+/**
+ * Double the room for nodes in the tree.  Nobody reads them until the tree
+ * is ready, so the old ones can go right away.
+ */
+static void grow_fanout (signal_tree_t *tree)
+{
+    thread_data_t **nodes = (thread_data_t**)
+        threadscan_alloc_mmap(tree->capacity * 2 * sizeof(thread_data_t*));
+
+    memcpy(nodes, tree->nodes, tree->count * sizeof(thread_data_t*));
+    threadscan_alloc_munmap(tree->nodes);
+    tree->nodes = nodes;
+    tree->capacity *= 2;
+}
+
+/**
+ * Send the signal to td, a thread of the process pid.  Return whether it
+ * was sent.  If the thread has exited, it answered its request on the way
+ * out.
+ */
+static int send_signal (pid_t pid, thread_data_t *td, int sig)
+{
+    if (0 == syscall(SYS_tgkill, pid, td->tid, sig)) return 1;
+    if (ESRCH != errno) {
+        threadscan_fatal("threadscan: tgkill() failed: %s\n",
+                         strerror(errno));
+    }
+    return 0;
+}
+
+/**
+ * Count every node and its children as unfinished, and size the subtrees.
+ * Children come after their parents, so a backwards pass sees each subtree
+ * whole before it adds it to its parent.
+ */
+static void plan_fanout (domain_t *dom)
+{
+    signal_tree_t *tree = &dom->tree;
+    int i;
+
+    tree->degree = g_threadscan_fanout > 0 ? g_threadscan_fanout
+        : tree->count;
+    if (tree->degree < 1) tree->degree = 1;
+
+    for (i = 0; i < tree->count; ++i) {
+        domain_member_t *member = &tree->nodes[i]->members[dom->id];
+        member->fanout_left = 1;
+        member->fanout_size = 1;
+    }
+    for (i = tree->count - 1; i >= tree->degree; --i) {
+        domain_member_t *parent =
+            &tree->nodes[i / tree->degree - 1]->members[dom->id];
+        ++parent->fanout_left;
+        parent->fanout_size += tree->nodes[i]->members[dom->id].fanout_size;
+    }
+}
+
+/**
+ * Ask all active threads in the domain (except the calling thread) to
+ * search their memory for the given round.  The ones to be signalled go in
+ * the signalling tree, and the roots are signalled now.  If lazy is set,
+ * only the threads that were late to answer in recent rounds are signalled.
+ * Parked threads aren't asked: they're set to THREAD_SEARCHED, for the
+ * caller to search.  Return the number of threads asked, and set
+ * *signal_count to the number signalled.  The caller releases the tree
+ * once they've all answered.
+ */
+int threadscan_proc_request_scan_all_except (domain_t *dom, size_t round,
+                                             int sig, int lazy,
+                                             thread_data_t *except,
+                                             int *signal_count)
+{
+    signal_tree_t *tree = &dom->tree;
+    int request_count = 0, i;
+    thread_data_t *td;
+
+    assert(0 == tree->count);
+    tree->ready = 0;
+    tree->pid = getpid();
 
     // Yay!  C doesn't have lambdas!  So this is way uglier and more fragile
     // than it needs to be!  Thanks, C.
     FOREACH_IN_THREAD_LIST(td, &thread_list)
         assert(td);
-        if (td != except && td->is_active) {
-            int ret = pthread_kill(td->self, sig);
-            if (EINVAL == ret) {
-                threadscan_fatal("threadscan: "
-                                 "pthread_kill() returned EINVAL.\n");
-            } else if (ESRCH == ret) {
-                threadscan_diagnostic("threadscan: "
-                                      "pthread_kill() returned ESRCH.\n");
+        if (td != except && td->is_active && IS_MEMBER(td, dom->id)) {
+            domain_member_t *member = &td->members[dom->id];
+            int parked = 0, left = 0;
+            int signal = !lazy || td->late_rounds > 0;
+            // A thread learns its place in the tree when it takes the
+            // request, so it has to have one by then.
+            if (signal) member->fanout_index = tree->count;
+            member->scan_request = round;
+            __sync_synchronize(); // mfence.
+            if (!td->is_active || !IS_MEMBER(td, dom->id)) {
+                // The thread is exiting or leaving the domain, and it may
+                // have looked for requests before this one was made.  Take
+                // it back, unless the thread took it already.
+                left = BCAS(&member->scan_request, round, 0);
+            } else if (BCAS(&td->park_state, THREAD_PARKED,
+                            THREAD_SEARCHED)) {
+                // The caller searches a parked thread's memory itself.  If
+                // the thread's signal handler beat it to the request, the
+                // thread answers, as usual.  A thread that another domain's
+                // reclaimer is searching isn't parked for this one, and it
+                // answers, too.
+                parked = BCAS(&member->scan_request, round, 0);
+                if (!parked) {
+                    td->park_state = THREAD_PARKED;
+                    threadscan_util_wake(&td->park_wq);
+                }
+            }
+            if (left) {
+                member->fanout_index = -1;
+            } else if (parked) {
+                // Not asked.
+                member->fanout_index = -1;
+                member->parked = 1;
             } else {
+                if (signal) {
+                    if (td->late_rounds > 0) --td->late_rounds;
+                    if (tree->count == tree->capacity) grow_fanout(tree);
+                    tree->nodes[tree->count++] = td;
+                }
+                ++request_count;
+            }
+        }
+    ENDFOREACH_IN_THREAD_LIST(td, &thread_list);
+
+    plan_fanout(dom);
+    __sync_synchronize(); // mfence.
+    tree->ready = 1;
+    threadscan_util_wake(&tree->wq);
+
+    for (i = 0; i < MIN_OF(tree->degree, tree->count); ++i) {
+        send_signal(tree->pid, tree->nodes[i], sig);
+    }
+    *signal_count = tree->count;
+
+    return request_count;
+}
+
+/**
+ * Return whether the signalling tree at arg has been built.
+ */
+static int fanout_planned (void *arg)
+{
+    return ((signal_tree_t*)arg)->ready;
+}
+
+/**
+ * The calling thread, td, took its request to search in the domain.  If
+ * it's in the signalling tree, signal its children.  This may be called
+ * from a signal handler.
+ */
+void threadscan_proc_forward_scan (domain_t *dom, thread_data_t *td, int sig)
+{
+    signal_tree_t *tree = &dom->tree;
+    int i = td->members[dom->id].fanout_index, c, end, saved_errno = errno;
+
+    if (i < 0) return;
+
+    threadscan_util_wait(&tree->wq, fanout_planned, tree, NULL);
+    c = tree->degree * (i + 1);
+    end = MIN_OF(c + tree->degree, tree->count);
+    for (; c < end; ++c) send_signal(tree->pid, tree->nodes[c], sig);
+
+    errno = saved_errno;
+}
+
+/**
+ * The calling thread, td, has searched its memory for the domain.  Return
+ * the number of threads it can answer for: 1 if it isn't in the signalling
+ * tree, and otherwise the size of the root's subtree if this finished it,
+ * or 0.
+ */
+int threadscan_proc_scan_done (domain_t *dom, thread_data_t *td)
+{
+    signal_tree_t *tree = &dom->tree;
+    int i = td->members[dom->id].fanout_index;
+
+    if (i < 0) return 1;
+
+    // The last of a node and its children to finish finishes the node for
+    // its parent.
+    while (1) {
+        domain_member_t *member = &tree->nodes[i]->members[dom->id];
+        if (0 != __sync_sub_and_fetch(&member->fanout_left, 1)) break;
+        if (i < tree->degree) return member->fanout_size;
+        i = i / tree->degree - 1;
+    }
+    return 0;
+}
+
+/**
+ * Take apart the domain's signalling tree, once every thread in it has
+ * answered.
+ */
+void threadscan_proc_release_fanout (domain_t *dom)
+{
+    signal_tree_t *tree = &dom->tree;
+    int i;
+
+    for (i = 0; i < tree->count; ++i) {
+        tree->nodes[i]->members[dom->id].fanout_index = -1;
+    }
+    tree->count = 0;
+    threadscan_util_wake(&tree->wq);
+}
+
+/**
+ * Return whether the domain member at arg is out of the signalling tree.
+ */
+static int out_of_fanout (void *arg)
+{
+    return ((domain_member_t*)arg)->fanout_index < 0;
+}
+
+/**
+ * The calling thread, td, is exiting, and it has answered any request to
+ * search.  Wait for it to be out of the signalling tree of every domain.
+ * A domain whose tree it's in has a round going, so it can't be destroyed
+ * before the wait is over.
+ */
+void threadscan_proc_wait_for_fanout (thread_data_t *td)
+{
+    int id;
+
+    for (id = 0; id < domain_count; ++id) {
+        if (out_of_fanout(&td->members[id])) continue;
+        threadscan_util_wait(&domains[id]->tree.wq, out_of_fanout,
+                             &td->members[id], NULL);
+    }
+}
+
+/**
+ * Send the signal to the threads that haven't yet taken their requests to
+ * search for the given round of the domain, and mark them late.  Return the
+ * number of signals sent.
+ *
+ * The threads left are the ones that were to answer at safepoints, so
+ * they aren't in the signalling tree, and it's too late to add them: the
+ * tree is planned, and signals may be on their way down it.  There are
+ * usually few of them, and they're signalled one by one.
+ */
+int threadscan_proc_signal_requested (domain_t *dom, size_t round, int sig)
+{
+    int signal_count = 0;
+    thread_data_t *td;
+
+    FOREACH_IN_THREAD_LIST(td, &thread_list)
+        assert(td);
+        if (td->members[dom->id].scan_request == round) {
+            // If the thread takes the request before the signal arrives,
+            // its signal handler does nothing.
+            if (send_signal(dom->tree.pid, td, sig)) {
+                td->late_rounds = SAFEPOINT_LATE_ROUNDS;
                 ++signal_count;
             }
         }
@@ -203,21 +538,32 @@ int threadscan_proc_signal_all_except (int sig, thread_data_t *except)
 }
 
 /**
- * Wait for all threads that are trying to help out to discover the
- * current timestamp.
+ * Return whether the thread in arg isn't helping a round before curr.
  */
-void threadscan_proc_wait_for_timestamp (size_t curr)
+static int knows_timestamp (void *arg)
 {
+    timestamp_wait_t *wait = (timestamp_wait_t*)arg;
+    size_t stamp = wait->member->local_timestamp;
+
+    return !TIMESTAMP_IS_ACTIVE(stamp) || TIMESTAMP(stamp) == wait->curr;
+}
+
+/**
+ * Wait for all threads that are trying to help out in the domain to
+ * discover its current timestamp.  Threads wake wq when they stop helping.
+ */
+void threadscan_proc_wait_for_timestamp (domain_t *dom, size_t curr,
+                                         wait_queue_t *wq)
+{
+    timestamp_wait_t wait;
     thread_data_t *td;
+
+    wait.curr = curr;
     FOREACH_IN_THREAD_LIST(td, &thread_list)
         assert(td);
-        size_t stamp = td->local_timestamp;
-        while (TIMESTAMP_IS_ACTIVE(stamp)
-               && TIMESTAMP(stamp) != curr) {
-            // This thread is still helping the previous round.
-            pthread_yield();
-            stamp = td->local_timestamp;
-        }
+        // The thread may still be helping the previous round.
+        wait.member = &td->members[dom->id];
+        threadscan_util_wait(wq, knows_timestamp, &wait, NULL);
     ENDFOREACH_IN_THREAD_LIST(td, &thread_list);
 
     // After the loop, all threads either know about the current timestamp
@@ -225,9 +571,3 @@ void threadscan_proc_wait_for_timestamp (size_t curr)
     // know about the current timestamp but they will find out about it if
     // they try to help.
 }
-
-__attribute__((constructor))
-static void proc_init ()
-{
-    thread_list.head = NULL;
-}
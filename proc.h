@@ -52,17 +52,91 @@ void threadscan_proc_add_thread_data (thread_data_t *td);
  * threadscan.
  */
 void threadscan_proc_remove_thread_data (thread_data_t *td);
+void threadscan_proc_wait_for_readers ();
+
+/****************************************************************************/
+/*                                 Domains                                  */
+/****************************************************************************/
+
+/**
+ * Give a domain the lowest free id and a signalling tree.  Return 0, with
+ * nothing allocated, if all MAX_DOMAINS ids are in use.
+ */
+int threadscan_proc_add_domain (domain_t *dom);
+
+/**
+ * Take the domain's id back, so a new domain can have it, and free its
+ * signalling tree.  Return 0, and leave the domain as it was, if a thread
+ * is still a member.
+ */
+int threadscan_proc_remove_domain (domain_t *dom);
+
+/**
+ * Return the domain with the given id, or NULL if there isn't one.
+ */
+domain_t *threadscan_proc_get_domain (int id);
+
+/**
+ * Make the calling thread, td, a member of the domain, or stop it being
+ * one.  Rounds that have started already go on with td as it was.
+ */
+void threadscan_proc_set_membership (domain_t *dom, thread_data_t *td,
+                                     int member);
+
+/**
+ * Ask all active threads in the domain (except the calling thread) to
+ * search their memory for the given round.  The ones to be signalled go in
+ * the signalling tree, and the roots are signalled now.  If lazy is set,
+ * only the threads that were late to answer in recent rounds are signalled.
+ * Parked threads aren't asked: they're set to THREAD_SEARCHED, for the
+ * caller to search.  Return the number of threads asked, and set
+ * *signal_count to the number signalled.  The caller releases the tree
+ * once they've all answered.
+ */
+int threadscan_proc_request_scan_all_except (domain_t *dom, size_t round,
+                                             int sig, int lazy,
+                                             thread_data_t *except,
+                                             int *signal_count);
+
+/**
+ * The calling thread, td, took its request to search in the domain.  If
+ * it's in the signalling tree, signal its children.  This may be called
+ * from a signal handler.
+ */
+void threadscan_proc_forward_scan (domain_t *dom, thread_data_t *td, int sig);
+
+/**
+ * The calling thread, td, has searched its memory for the domain.  Return
+ * the number of threads it can answer for: 1 if it isn't in the signalling
+ * tree, and otherwise the size of the root's subtree if this finished it,
+ * or 0.
+ */
+int threadscan_proc_scan_done (domain_t *dom, thread_data_t *td);
+
+/**
+ * Take apart the domain's signalling tree, once every thread in it has
+ * answered.
+ */
+void threadscan_proc_release_fanout (domain_t *dom);
+
+/**
+ * The calling thread, td, is exiting, and it has answered any request to
+ * search.  Wait for it to be out of the signalling tree of every domain.
+ */
+void threadscan_proc_wait_for_fanout (thread_data_t *td);
 
 /**
- * Send a signal to all threads in the process (except the calling thread)
- * using pthread_kill().
+ * Send the signal to the threads that haven't yet taken their requests to
+ * search for the given round of the domain, and mark them late.  Return the
+ * number of signals sent.
  */
-int threadscan_proc_signal_all_except (int sig, thread_data_t *except);
+int threadscan_proc_signal_requested (domain_t *dom, size_t round, int sig);
 
 /**
- * Wait for all threads that are trying to help out to discover the
- * current timestamp.
+ * Wait for all threads that are trying to help out in the domain to
+ * discover its current timestamp.  Threads wake wq when they stop helping.
  */
-void threadscan_proc_wait_for_timestamp (size_t curr);
+void threadscan_proc_wait_for_timestamp (domain_t *dom, size_t curr,
+                                         wait_queue_t *wq);
 
 #endif // !defined _PROC_H_
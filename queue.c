@@ -48,6 +48,14 @@ int threadscan_queue_is_full (queue_t *q)
     return q->idx_head + 1 >= q->idx_tail ? 1 : 0;
 }
 
+/**
+ * Return the number of values on the queue.
+ */
+size_t threadscan_queue_length (queue_t *q)
+{
+    return q->idx_head - (q->idx_tail - q->capacity);
+}
+
 /**
  * Push a value onto the head of the queue.  Caller must verify there is
  * space on the queue.
@@ -68,7 +76,26 @@ size_t threadscan_queue_pop (queue_t *q);
  * Push a block of values onto the queue of count "len".  Caller must verify
  * there is space on the queue.
  */
-void threadscan_queue_push_bulk (queue_t *q, size_t values[], size_t len);
+void threadscan_queue_push_bulk (queue_t *q, size_t values[], size_t len)
+{
+    size_t head = INDEXIFY(q->idx_head, q->capacity);
+    size_t first = q->capacity - head;
+
+    assert(q->idx_head + len < q->idx_tail);
+
+    // Like pop_bulk(), the block may wrap around the end of the buffer, and
+    // then it takes two memcpy's.
+    if (first > len) first = len;
+    memcpy(&q->e[head], values, first * sizeof(size_t));
+    if (len > first) {
+        memcpy(q->e, &values[first], (len - first) * sizeof(size_t));
+    }
+
+    // The values have to be in the buffer before the reclaimer can see the
+    // new head.
+    __asm__ __volatile__("" : : : "memory");
+    q->idx_head += len;
+}
 
 /**
  * Pop a block of values from the queue, up to "len" in count.  The values
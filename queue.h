@@ -63,6 +63,11 @@ void threadscan_queue_init (queue_t *q, size_t *buf, size_t capacity);
  */
 int threadscan_queue_is_full (queue_t *q);
 
+/**
+ * Return the number of values on the queue.
+ */
+size_t threadscan_queue_length (queue_t *q);
+
 /**
  * Push a value onto the head of the queue.  Caller must verify there is
  * space on the queue.
@@ -0,0 +1,172 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "alloc.h"
+#include <assert.h>
+#include <pthread.h>
+#include "reclaim.h"
+#include <string.h>
+#include "util.h"
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+// A power of 2, and the table is a whole number of pages.
+#define MIN_SLOTS 1024
+
+// Slot states, besides holding a pointer.  No heap pointer is 0 or 1.
+#define EMPTY 0
+#define REMOVED 1
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+/**
+ * An open-addressing hash map from address to record.  It's only touched
+ * by threads collecting with a reclaim function and by reclaimers that have
+ * found some of those pointers, so a lock is fine.
+ */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static reclaim_record_t *g_slots;
+static size_t g_n_slots;              // A power of 2.
+static size_t g_used;                 // Slots that aren't EMPTY.
+static volatile size_t g_count;       // Slots that hold a pointer.
+
+/****************************************************************************/
+/*                                 Hash map                                 */
+/****************************************************************************/
+
+/**
+ * Fibonacci hashing, like the hash set in scan.c.
+ */
+static inline size_t slot_of (size_t ptr, size_t n_slots)
+{
+    return ((ptr >> 4) * 0x9E3779B97F4A7C15ULL)
+        >> (64 - __builtin_ctzl(n_slots));
+}
+
+/**
+ * Put the record in the first free slot of its probe sequence, or over the
+ * record for the same pointer, and return what the slot held.  The lock
+ * must be held.
+ */
+static size_t place (reclaim_record_t *slots, size_t n_slots,
+                     const reclaim_record_t *rec)
+{
+    size_t slot = slot_of(rec->ptr, n_slots);
+    size_t prev;
+    while (slots[slot].ptr > REMOVED && slots[slot].ptr != rec->ptr) {
+        slot = (slot + 1) & (n_slots - 1);
+    }
+    prev = slots[slot].ptr;
+    slots[slot] = *rec;
+    return prev;
+}
+
+/**
+ * Make room for another record.  The table is rebuilt without its REMOVED
+ * slots, and doubled if it's more than a quarter full.  The lock must be
+ * held.
+ */
+static void make_room ()
+{
+    reclaim_record_t *old = g_slots;
+    size_t old_n = g_n_slots;
+    size_t i;
+
+    if ((g_used + 1) * 2 <= g_n_slots) return;
+
+    g_n_slots = old_n == 0 ? MIN_SLOTS
+        : g_count * 4 > old_n ? old_n * 2 : old_n;
+    g_slots = (reclaim_record_t*)threadscan_alloc_mmap(g_n_slots
+                                                       * sizeof(*g_slots));
+    for (i = 0; i < old_n; ++i) {
+        if (old[i].ptr > REMOVED) place(g_slots, g_n_slots, &old[i]);
+    }
+    g_used = g_count;
+
+    if (old) threadscan_alloc_munmap(old);
+}
+
+/****************************************************************************/
+/*                                Interface                                 */
+/****************************************************************************/
+
+/**
+ * Remember that ptr is to be reclaimed with fn(ptr, ctx).
+ */
+void threadscan_reclaim_map_insert (size_t ptr, reclaim_fn_t fn, void *ctx)
+{
+    reclaim_record_t rec = { ptr, fn, ctx };
+    size_t prev;
+
+    assert(ptr > REMOVED);
+
+    pthread_mutex_lock(&g_lock);
+    make_room();
+    prev = place(g_slots, g_n_slots, &rec);
+    if (EMPTY == prev) ++g_used;
+    if (prev <= REMOVED) ++g_count;
+    pthread_mutex_unlock(&g_lock);
+}
+
+/**
+ * Return 1 if no pointers have reclaim functions, 0 otherwise.
+ */
+int threadscan_reclaim_map_is_empty ()
+{
+    return 0 == g_count;
+}
+
+/**
+ * Take the records of the n pointers out of the map and write them to out.
+ * Pointers that have none get a record with a NULL fn.
+ */
+void threadscan_reclaim_map_take (const size_t *ptrs, int n,
+                                  reclaim_record_t *out)
+{
+    int i;
+
+    pthread_mutex_lock(&g_lock);
+    for (i = 0; i < n; ++i) {
+        size_t slot;
+
+        out[i].ptr = ptrs[i];
+        out[i].fn = NULL;
+        out[i].ctx = NULL;
+        if (0 == g_count) continue;
+
+        slot = slot_of(ptrs[i], g_n_slots);
+        while (g_slots[slot].ptr != EMPTY) {
+            if (g_slots[slot].ptr == ptrs[i]) {
+                out[i] = g_slots[slot];
+                g_slots[slot].ptr = REMOVED;
+                --g_count;
+                break;
+            }
+            slot = (slot + 1) & (g_n_slots - 1);
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+}
@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Reclaim functions other than free().  Pointers collected with a function
+   of their own are kept in a map from address to function, and when they
+   turn out to be unreferenced, the function is called instead of free().
+ */
+
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+#include <stddef.h>
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+typedef void (*reclaim_fn_t) (void *ptr, void *ctx);
+
+typedef struct reclaim_record_t reclaim_record_t;
+
+struct reclaim_record_t {
+    size_t ptr;
+    reclaim_fn_t fn;
+    void *ctx;
+};
+
+/****************************************************************************/
+/*                                Interface                                 */
+/****************************************************************************/
+
+/**
+ * Remember that ptr is to be reclaimed with fn(ptr, ctx).
+ */
+void threadscan_reclaim_map_insert (size_t ptr, reclaim_fn_t fn, void *ctx);
+
+/**
+ * Return 1 if no pointers have reclaim functions, 0 otherwise.  Pointers
+ * are added to the map before they're collected, so this is safe for a
+ * round to check after it has gathered its pointers.
+ */
+int threadscan_reclaim_map_is_empty ();
+
+/**
+ * Take the records of the n pointers out of the map and write them to out.
+ * Pointers that have none get a record with a NULL fn.
+ */
+void threadscan_reclaim_map_take (const size_t *ptrs, int n,
+                                  reclaim_record_t *out);
+
+#endif // !defined _RECLAIM_H_
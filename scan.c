@@ -0,0 +1,570 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <assert.h>
+#include "env.h"
+#include <immintrin.h>
+#include "scan.h"
+#include <string.h>
+#include "util.h"
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+#define PTR_MASK_BITS (~(size_t)3) // Mask off the low two bits.
+
+#define SIGN_BIT_64 0x8000000000000000ULL
+#define SIGN_BIT_32 0x80000000
+
+/**
+ * A word is in [min, max] iff (word - min) <= (max - min), unsigned.  All
+ * the kernels do the range check that way: one subtract and one compare.
+ */
+
+/****************************************************************************/
+/*                               SSE2 kernel                                */
+/****************************************************************************/
+
+/**
+ * SSE2 has no 64-bit compare, so it's built from 32-bit ones: the high
+ * halves decide unless they're equal, in which case the low halves do.
+ * Flipping the sign bit of every 32-bit lane turns the signed compares into
+ * unsigned ones.
+ */
+static size_t filter_sse2 (const size_t *mem, size_t n,
+                           size_t min, size_t max, size_t *out)
+{
+    const __m128i mask = _mm_set1_epi64x(PTR_MASK_BITS);
+    const __m128i vmin = _mm_set1_epi64x(min);
+    const __m128i flip = _mm_set1_epi32(SIGN_BIT_32);
+    const __m128i range = _mm_xor_si128(_mm_set1_epi64x(max - min), flip);
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((__m128i*)&mem[i]), mask);
+        __m128i d = _mm_xor_si128(_mm_sub_epi64(v, vmin), flip);
+        __m128i gt = _mm_cmpgt_epi32(d, range);
+        __m128i eq = _mm_cmpeq_epi32(d, range);
+        __m128i gt_hi = _mm_shuffle_epi32(gt, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128i gt_lo = _mm_shuffle_epi32(gt, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128i eq_hi = _mm_shuffle_epi32(eq, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128i out_of_range =
+            _mm_or_si128(gt_hi, _mm_and_si128(eq_hi, gt_lo));
+        int bits = ~_mm_movemask_pd(_mm_castsi128_pd(out_of_range)) & 0x3;
+
+        // Survivors are rare, so a branch is cheaper than a shuffle.
+        if (bits) {
+            if (bits & 1) out[count++] = mem[i] & PTR_MASK_BITS;
+            if (bits & 2) out[count++] = mem[i + 1] & PTR_MASK_BITS;
+        }
+    }
+
+    for ( ; i < n; ++i) {
+        size_t v = mem[i] & PTR_MASK_BITS;
+        if (v - min <= max - min) out[count++] = v;
+    }
+
+    return count;
+}
+
+/****************************************************************************/
+/*                               AVX2 kernel                                */
+/****************************************************************************/
+
+/**
+ * Permutations that compress the selected 64-bit lanes of an AVX2 register
+ * to the front, indexed by the 4-bit lane mask.  Expressed as pairs of
+ * 32-bit lanes for vpermd.
+ */
+#define LANE(x) (2 * (x)), (2 * (x) + 1)
+static const int avx2_compress_lut[16][8] __attribute__((aligned(32))) = {
+    { LANE(0), LANE(0), LANE(0), LANE(0) }, // 0000
+    { LANE(0), LANE(0), LANE(0), LANE(0) }, // 0001
+    { LANE(1), LANE(0), LANE(0), LANE(0) }, // 0010
+    { LANE(0), LANE(1), LANE(0), LANE(0) }, // 0011
+    { LANE(2), LANE(0), LANE(0), LANE(0) }, // 0100
+    { LANE(0), LANE(2), LANE(0), LANE(0) }, // 0101
+    { LANE(1), LANE(2), LANE(0), LANE(0) }, // 0110
+    { LANE(0), LANE(1), LANE(2), LANE(0) }, // 0111
+    { LANE(3), LANE(0), LANE(0), LANE(0) }, // 1000
+    { LANE(0), LANE(3), LANE(0), LANE(0) }, // 1001
+    { LANE(1), LANE(3), LANE(0), LANE(0) }, // 1010
+    { LANE(0), LANE(1), LANE(3), LANE(0) }, // 1011
+    { LANE(2), LANE(3), LANE(0), LANE(0) }, // 1100
+    { LANE(0), LANE(2), LANE(3), LANE(0) }, // 1101
+    { LANE(1), LANE(2), LANE(3), LANE(0) }, // 1110
+    { LANE(0), LANE(1), LANE(2), LANE(3) }, // 1111
+};
+#undef LANE
+
+/**
+ * AVX2 only has a signed 64-bit compare.  Flipping the sign bits makes it
+ * unsigned.
+ */
+__attribute__((target("avx2")))
+static size_t filter_avx2 (const size_t *mem, size_t n,
+                           size_t min, size_t max, size_t *out)
+{
+    const __m256i mask = _mm256_set1_epi64x(PTR_MASK_BITS);
+    const __m256i flip = _mm256_set1_epi64x(SIGN_BIT_64);
+    const __m256i vmin = _mm256_set1_epi64x(min);
+    const __m256i range = _mm256_set1_epi64x((max - min) ^ SIGN_BIT_64);
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v0 = _mm256_and_si256(
+            _mm256_loadu_si256((__m256i*)&mem[i]), mask);
+        __m256i v1 = _mm256_and_si256(
+            _mm256_loadu_si256((__m256i*)&mem[i + 4]), mask);
+        __m256i d0 = _mm256_xor_si256(_mm256_sub_epi64(v0, vmin), flip);
+        __m256i d1 = _mm256_xor_si256(_mm256_sub_epi64(v1, vmin), flip);
+        int out0 = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(d0, range)));
+        int out1 = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(d1, range)));
+
+        if ((out0 & out1) == 0xF) continue; // The common case.
+
+        int bits = ~out0 & 0xF;
+        __m256i perm = _mm256_load_si256((__m256i*)avx2_compress_lut[bits]);
+        _mm256_storeu_si256((__m256i*)&out[count],
+                            _mm256_permutevar8x32_epi32(v0, perm));
+        count += __builtin_popcount(bits);
+
+        bits = ~out1 & 0xF;
+        perm = _mm256_load_si256((__m256i*)avx2_compress_lut[bits]);
+        _mm256_storeu_si256((__m256i*)&out[count],
+                            _mm256_permutevar8x32_epi32(v1, perm));
+        count += __builtin_popcount(bits);
+    }
+
+    for ( ; i < n; ++i) {
+        size_t v = mem[i] & PTR_MASK_BITS;
+        if (v - min <= max - min) out[count++] = v;
+    }
+
+    return count;
+}
+
+/****************************************************************************/
+/*                              AVX-512 kernel                              */
+/****************************************************************************/
+
+/**
+ * AVX-512 has unsigned compares and compress-store, so this is the kernel
+ * the other two are imitating.
+ */
+__attribute__((target("avx512f")))
+static size_t filter_avx512 (const size_t *mem, size_t n,
+                             size_t min, size_t max, size_t *out)
+{
+    const __m512i mask = _mm512_set1_epi64(PTR_MASK_BITS);
+    const __m512i vmin = _mm512_set1_epi64(min);
+    const __m512i range = _mm512_set1_epi64(max - min);
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m512i v = _mm512_and_si512(_mm512_loadu_si512(&mem[i]), mask);
+        __mmask8 in_range =
+            _mm512_cmple_epu64_mask(_mm512_sub_epi64(v, vmin), range);
+        if (in_range) {
+            _mm512_mask_compressstoreu_epi64(&out[count], in_range, v);
+            count += __builtin_popcount(in_range);
+        }
+    }
+
+    for ( ; i < n; ++i) {
+        size_t v = mem[i] & PTR_MASK_BITS;
+        if (v - min <= max - min) out[count++] = v;
+    }
+
+    return count;
+}
+
+/****************************************************************************/
+/*                            Search index kernels                          */
+/****************************************************************************/
+
+/**
+ * Return the number of keys in the node that are <= key, ignoring the two
+ * low-order bits of the keys in the node, which may be marks.  This is the
+ * count of node keys < key + 4 because addresses are 4-aligned.  The
+ * compiler turns it into compares and adds, with no branches.
+ */
+static inline int node_rank_generic (const size_t *node, size_t key)
+{
+    size_t bound = key + 4;
+    int count = 0;
+    int i;
+    for (i = 0; i < SCAN_INDEX_FANOUT; ++i) {
+        count += node[i] < bound;
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static inline int node_rank_avx2 (const size_t *node, size_t key)
+{
+    // Keys and addresses are positive as signed values, and so is the
+    // sentinel, so the signed compare is safe here.
+    __m256i bound = _mm256_set1_epi64x(key + 4);
+    __m256i lo = _mm256_cmpgt_epi64(
+        bound, _mm256_load_si256((__m256i*)node));
+    __m256i hi = _mm256_cmpgt_epi64(
+        bound, _mm256_load_si256((__m256i*)&node[4]));
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(lo))
+        | (_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4);
+    return __builtin_popcount(mask);
+}
+
+__attribute__((target("avx512f")))
+static inline int node_rank_avx512 (const size_t *node, size_t key)
+{
+    __mmask8 mask =
+        _mm512_cmplt_epu64_mask(_mm512_load_si512(node),
+                                _mm512_set1_epi64(key + 4));
+    return __builtin_popcount(mask);
+}
+
+/**
+ * Batched lookup.  All the keys descend the tree together, one level at a
+ * time, and each key's node on the next level is prefetched as soon as it
+ * is known, so the misses for different keys overlap.
+ */
+static inline __attribute__((always_inline))
+void index_find (const scan_index_t *idx, const size_t *keys, int n,
+                 int *out, int (*rank) (const size_t *, size_t))
+{
+    int level, i;
+
+    for (i = 0; i < n; ++i) out[i] = 0;
+
+    for (level = idx->n_levels - 1; level >= 0; --level) {
+        const size_t *nodes = idx->levels[level];
+        for (i = 0; i < n; ++i) {
+            int node = out[i];
+            out[i] = node * SCAN_INDEX_FANOUT
+                + rank(&nodes[node * SCAN_INDEX_FANOUT], keys[i]) - 1;
+            if (level > 0) {
+                __builtin_prefetch(&idx->levels[level - 1]
+                                   [out[i] * SCAN_INDEX_FANOUT]);
+            }
+        }
+    }
+}
+
+static void index_find_generic (const scan_index_t *idx, const size_t *keys,
+                                int n, int *out)
+{
+    index_find(idx, keys, n, out, node_rank_generic);
+}
+
+__attribute__((target("avx2")))
+static void index_find_avx2 (const scan_index_t *idx, const size_t *keys,
+                             int n, int *out)
+{
+    index_find(idx, keys, n, out, node_rank_avx2);
+}
+
+__attribute__((target("avx512f")))
+static void index_find_avx512 (const scan_index_t *idx, const size_t *keys,
+                               int n, int *out)
+{
+    index_find(idx, keys, n, out, node_rank_avx512);
+}
+
+/****************************************************************************/
+/*                               Search index                               */
+/****************************************************************************/
+
+/**
+ * Round n up to a whole number of nodes.
+ */
+static size_t whole_nodes (size_t n)
+{
+    return (n + SCAN_INDEX_FANOUT - 1) & ~(size_t)(SCAN_INDEX_FANOUT - 1);
+}
+
+/**
+ * Return the number of words of space an index over n addresses needs,
+ * not counting level 0.
+ */
+size_t threadscan_scan_index_size (size_t n)
+{
+    size_t size = 0;
+
+    // Nodes are cache-aligned, so leave room to align the start.
+    size += SCAN_INDEX_FANOUT;
+    while (n > SCAN_INDEX_FANOUT) {
+        n = whole_nodes(n) / SCAN_INDEX_FANOUT;
+        size += whole_nodes(n);
+    }
+    return size;
+}
+
+/**
+ * Build an index over the n sorted addresses, which must have room after
+ * them for SCAN_INDEX_FANOUT - 1 words of padding.  buf is the space for
+ * the upper levels, of threadscan_scan_index_size(n) words.
+ */
+void threadscan_scan_index_build (scan_index_t *idx, size_t *addrs, size_t n,
+                                  size_t *buf)
+{
+    size_t i;
+
+    assert(n > 0);
+    assert(((size_t)addrs & (SCAN_INDEX_FANOUT * sizeof(size_t) - 1)) == 0);
+
+    buf = (size_t*)(((size_t)buf + SCAN_INDEX_FANOUT * sizeof(size_t) - 1)
+                    & ~(SCAN_INDEX_FANOUT * sizeof(size_t) - 1));
+
+    for (i = n; i < whole_nodes(n); ++i) addrs[i] = SCAN_INDEX_SENTINEL;
+    idx->levels[0] = addrs;
+    idx->n_levels = 1;
+
+    while (n > SCAN_INDEX_FANOUT) {
+        size_t *below = idx->levels[idx->n_levels - 1];
+        size_t n_above = whole_nodes(n) / SCAN_INDEX_FANOUT;
+
+        if (idx->n_levels == SCAN_INDEX_MAX_LEVELS) {
+            threadscan_fatal("threadscan internal error: "
+                             "search index is too deep.\n");
+        }
+
+        for (i = 0; i < n_above; ++i) {
+            buf[i] = below[i * SCAN_INDEX_FANOUT];
+        }
+        for ( ; i < whole_nodes(n_above); ++i) {
+            buf[i] = SCAN_INDEX_SENTINEL;
+        }
+
+        idx->levels[idx->n_levels++] = buf;
+        buf += whole_nodes(n_above);
+        n = n_above;
+    }
+}
+
+/****************************************************************************/
+/*                                 Hash set                                 */
+/****************************************************************************/
+
+/**
+ * Fibonacci hashing.  The low four bits of heap addresses are all zero, so
+ * they're shifted out first.
+ */
+static inline size_t hash_slot (const scan_hash_t *hash, size_t addr)
+{
+    return ((addr >> 4) * 0x9E3779B97F4A7C15ULL) >> hash->shift;
+}
+
+/**
+ * Return the number of slots in a hash set for n addresses.
+ */
+size_t threadscan_scan_hash_size (size_t n)
+{
+    size_t slots = SCAN_INDEX_FANOUT;
+    while (slots < 2 * n) slots *= 2;
+    return slots;
+}
+
+/**
+ * Build a hash set of the n addresses in buf, which has room for
+ * threadscan_scan_hash_size(n) slots.  Duplicate addresses are stored once.
+ */
+void threadscan_scan_hash_build (scan_hash_t *hash, const size_t *addrs,
+                                 size_t n, size_t *buf)
+{
+    size_t min = ~(size_t)0, max = 0;
+    size_t mask;
+    size_t i;
+
+    assert(n > 0);
+
+    hash->slots = buf;
+    hash->n_slots = threadscan_scan_hash_size(n);
+    hash->shift = 64 - __builtin_ctzl(hash->n_slots);
+    mask = hash->n_slots - 1;
+    memset(buf, 0, hash->n_slots * sizeof(size_t));
+
+    for (i = 0; i < n; ++i) {
+        size_t addr = addrs[i];
+        size_t slot = hash_slot(hash, addr);
+
+        while (buf[slot] != 0 && buf[slot] != addr) {
+            slot = (slot + 1) & mask;
+        }
+        buf[slot] = addr;
+
+        addr &= PTR_MASK_BITS;
+        if (addr < min) min = addr;
+        if (addr > max) max = addr;
+    }
+
+    hash->min = min;
+    hash->max = max;
+}
+
+/**
+ * Find the slot of each of the n keys in the hash set.  out[i] is the slot
+ * that holds keys[i], ignoring the two low-order bits of the slots, or -1 if
+ * keys[i] is not in the set.  The first slot of every key is prefetched
+ * before any of them are probed.
+ */
+void threadscan_scan_hash_find (const scan_hash_t *hash, const size_t *keys,
+                                int n, int *out)
+{
+    size_t mask = hash->n_slots - 1;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        out[i] = hash_slot(hash, keys[i]);
+        __builtin_prefetch(&hash->slots[out[i]]);
+    }
+
+    for (i = 0; i < n; ++i) {
+        size_t slot = out[i];
+        size_t v;
+        while ((v = hash->slots[slot]) != 0
+               && (v & PTR_MASK_BITS) != keys[i]) {
+            slot = (slot + 1) & mask;
+        }
+        out[i] = v == 0 ? -1 : (int)slot;
+    }
+}
+
+/****************************************************************************/
+/*                               Mark bitmaps                               */
+/****************************************************************************/
+
+/**
+ * OR the n words of src into dst and clear src.  The ranges are whatever
+ * part of a bitmap a thread touched, so they need not be aligned.
+ */
+static void merge_sse2 (size_t *dst, size_t *src, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        __m128i d = _mm_loadu_si128((const __m128i*)&dst[i]);
+        __m128i s = _mm_loadu_si128((const __m128i*)&src[i]);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_or_si128(d, s));
+        _mm_storeu_si128((__m128i*)&src[i], zero);
+    }
+    for (; i < n; ++i) {
+        dst[i] |= src[i];
+        src[i] = 0;
+    }
+}
+
+__attribute__((target("avx2")))
+static void merge_avx2 (size_t *dst, size_t *src, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)&dst[i]);
+        __m256i s = _mm256_loadu_si256((const __m256i*)&src[i]);
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_or_si256(d, s));
+        _mm256_storeu_si256((__m256i*)&src[i], zero);
+    }
+    for (; i < n; ++i) {
+        dst[i] |= src[i];
+        src[i] = 0;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void merge_avx512 (size_t *dst, size_t *src, size_t n)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m512i d = _mm512_loadu_si512(&dst[i]);
+        __m512i s = _mm512_loadu_si512(&src[i]);
+        _mm512_storeu_si512(&dst[i], _mm512_or_si512(d, s));
+        _mm512_storeu_si512(&src[i], zero);
+    }
+    if (i < n) {
+        __mmask8 tail = (1 << (n - i)) - 1;
+        __m512i d = _mm512_maskz_loadu_epi64(tail, &dst[i]);
+        __m512i s = _mm512_maskz_loadu_epi64(tail, &src[i]);
+        _mm512_mask_storeu_epi64(&dst[i], tail, _mm512_or_si512(d, s));
+        _mm512_mask_storeu_epi64(&src[i], tail, zero);
+    }
+}
+
+/****************************************************************************/
+/*                                Interface                                 */
+/****************************************************************************/
+
+scan_filter_t threadscan_scan_filter = filter_sse2;
+scan_index_find_t threadscan_scan_index_find = index_find_generic;
+scan_bitmap_merge_t threadscan_scan_bitmap_merge = merge_sse2;
+
+/**
+ * Pick the kernels for this CPU, or the ones requested through the
+ * environment if the CPU supports them.
+ */
+__attribute__((constructor (102)))
+static void scan_init ()
+{
+    int isa = g_threadscan_scan_isa;
+
+    __builtin_cpu_init();
+    if (SCAN_ISA_AUTO == isa) {
+        isa = __builtin_cpu_supports("avx512f") ? SCAN_ISA_AVX512
+            : __builtin_cpu_supports("avx2") ? SCAN_ISA_AVX2
+            : SCAN_ISA_SSE2;
+    } else if ((SCAN_ISA_AVX512 == isa
+                && !__builtin_cpu_supports("avx512f"))
+               || (SCAN_ISA_AVX2 == isa
+                   && !__builtin_cpu_supports("avx2"))) {
+        threadscan_diagnostic("warning: the CPU does not support the "
+                              "requested scan kernel.  Using SSE2.\n");
+        isa = SCAN_ISA_SSE2;
+    }
+
+    switch (isa) {
+    case SCAN_ISA_AVX512:
+        threadscan_scan_filter = filter_avx512;
+        threadscan_scan_index_find = index_find_avx512;
+        threadscan_scan_bitmap_merge = merge_avx512;
+        break;
+    case SCAN_ISA_AVX2:
+        threadscan_scan_filter = filter_avx2;
+        threadscan_scan_index_find = index_find_avx2;
+        threadscan_scan_bitmap_merge = merge_avx2;
+        break;
+    default:
+        threadscan_scan_filter = filter_sse2;
+        threadscan_scan_index_find = index_find_generic;
+        threadscan_scan_bitmap_merge = merge_sse2;
+        break;
+    }
+}
@@ -0,0 +1,163 @@
+/*
+Copyright (c) 2015 ThreadScan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Vectorized kernels for searching memory, and the search index they look
+   addresses up in.  Each kernel has SSE2, AVX2 and AVX-512 variants, and
+   the best one the CPU supports is picked once, when the library is loaded.
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+// The filter may write this many entries past the last candidate it
+// returns, so output buffers need the slack.
+#define SCAN_FILTER_SLACK 8
+
+/**
+ * Filter for words that might be pointers to collected addresses.  Each of
+ * the n words of mem has its low two bits masked off, and those in the
+ * range [min, max] are written to out.
+ * @return The number of words written to out.
+ */
+typedef size_t (*scan_filter_t) (const size_t *mem, size_t n,
+                                  size_t min, size_t max, size_t *out);
+
+// Keys per node of the search index: one cache line.
+#define SCAN_INDEX_FANOUT 8
+
+// Enough levels for 8^12 addresses.
+#define SCAN_INDEX_MAX_LEVELS 12
+
+// Pads the levels of the index out to whole nodes.  It's larger than any
+// address, and it compares that way whether compares are signed or not.
+#define SCAN_INDEX_SENTINEL ((size_t)0x7FFFFFFFFFFFFFFFULL)
+
+typedef struct scan_index_t scan_index_t;
+
+/**
+ * A static B-tree over a sorted array of addresses, where every node is one
+ * cache line.  Level 0 is the sorted array, itself, and each level above
+ * holds the first key of every node of the level below.  A lookup touches
+ * one line per level, and the upper levels are small enough to stay in
+ * cache.
+ */
+struct scan_index_t {
+    int n_levels;
+    size_t *levels[SCAN_INDEX_MAX_LEVELS];
+};
+
+typedef struct scan_hash_t scan_hash_t;
+
+/**
+ * An open-addressing hash set of addresses.  Empty slots are zero, and an
+ * address hashes to the slot where its probe sequence starts.  The table is
+ * at most half full, so a probe usually touches one cache line.
+ */
+struct scan_hash_t {
+    size_t *slots;
+    size_t n_slots;                   // A power of 2.
+    int shift;                        // 64 - log2(n_slots).
+    size_t min, max;                  // Bounds, without the low bits.
+};
+
+/**
+ * Find the position of each of the n keys in level 0 of the index.  out[i]
+ * is the position of the last address <= keys[i], ignoring the two low-order
+ * bits of the addresses.  The keys must be >= the first address.
+ */
+typedef void (*scan_index_find_t) (const scan_index_t *idx,
+                                   const size_t *keys, int n, int *out);
+
+/**
+ * OR the n words of the bitmap src into dst, and clear them in src.
+ */
+typedef void (*scan_bitmap_merge_t) (size_t *dst, size_t *src, size_t n);
+
+/****************************************************************************/
+/*                                 Kernels                                  */
+/****************************************************************************/
+
+/**
+ * The filter kernel for this CPU.
+ */
+extern scan_filter_t threadscan_scan_filter;
+
+/**
+ * The index lookup kernel for this CPU.
+ */
+extern scan_index_find_t threadscan_scan_index_find;
+
+/**
+ * The bitmap merge kernel for this CPU.
+ */
+extern scan_bitmap_merge_t threadscan_scan_bitmap_merge;
+
+/****************************************************************************/
+/*                               Search index                               */
+/****************************************************************************/
+
+/**
+ * Return the number of words of space an index over n addresses needs,
+ * not counting level 0.
+ */
+size_t threadscan_scan_index_size (size_t n);
+
+/**
+ * Build an index over the n sorted addresses, which must have room after
+ * them for SCAN_INDEX_FANOUT - 1 words of padding.  buf is the space for
+ * the upper levels, of threadscan_scan_index_size(n) words.
+ */
+void threadscan_scan_index_build (scan_index_t *idx, size_t *addrs, size_t n,
+                                  size_t *buf);
+
+/****************************************************************************/
+/*                                 Hash set                                 */
+/****************************************************************************/
+
+/**
+ * Return the number of slots in a hash set for n addresses.
+ */
+size_t threadscan_scan_hash_size (size_t n);
+
+/**
+ * Build a hash set of the n addresses in buf, which has room for
+ * threadscan_scan_hash_size(n) slots.  Duplicate addresses are stored once.
+ */
+void threadscan_scan_hash_build (scan_hash_t *hash, const size_t *addrs,
+                                 size_t n, size_t *buf);
+
+/**
+ * Find the slot of each of the n keys in the hash set.  out[i] is the slot
+ * that holds keys[i], ignoring the two low-order bits of the slots, or -1 if
+ * keys[i] is not in the set.
+ */
+void threadscan_scan_hash_find (const scan_hash_t *hash, const size_t *keys,
+                                int n, int *out);
+
+#endif // !defined _SCAN_H_
@@ -23,12 +23,15 @@ THE SOFTWARE.
 #include "alloc.h"
 #include <alloca.h>
 #include <assert.h>
+#include "numa.h"
 #include "proc.h"
 #include <pthread.h>
 #include <setjmp.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include "thread.h"
+#include <unistd.h>
 #include "util.h"
 
 /**
@@ -66,17 +69,26 @@ void *threadscan_thread_base (void *arg)
     if (unused_buffer > 0) {
         memset(unused_buffer, 0xDEADBEEF, buffer_size);
     }
+    // The buffer is never read, so keep the compiler from optimizing the
+    // alloca() away.  Without it, the user routine runs above
+    // user_stack_high and the stack searches walk off the end.
+    __asm__ __volatile__("" : : "r"(unused_buffer) : "memory");
 
     td->user_stack_high = (char*)(sp - buffer_size);
 
     // Put the thread metadata into TLS.
     threadscan_local_td = td;
 
-    // Counter for getting consensus during cleanup.
-    td->local_timestamp = 0;
-
     // Save info about this thread so that it can be signalled for cleanup.
     td->self = pthread_self();
+    td->tid = (pid_t)syscall(SYS_gettid);
+
+    // Keep the pointer list on this thread's node.
+    td->numa_node = threadscan_numa_thread_node();
+    threadscan_numa_bind(td->members[DEFAULT_DOMAIN].ptr_list.e,
+                         td->members[DEFAULT_DOMAIN].ptr_list.capacity
+                         * sizeof(size_t),
+                         td->numa_node);
     td->is_active = 1;
 
     // Call the user thread.  Exit with the return code when complete.
@@ -86,6 +98,19 @@ void *threadscan_thread_base (void *arg)
     return 0;
 }
 
+/**
+ * Return whether a reclaimer in any domain is waiting for td to search.
+ */
+static int has_scan_request (thread_data_t *td)
+{
+    int id;
+
+    for (id = 0; id < MAX_DOMAINS; ++id) {
+        if (td->members[id].scan_request) return 1;
+    }
+    return 0;
+}
+
 /**
  * Do metadata cleanup for the thread before it exits.
  */
@@ -95,21 +120,37 @@ void threadscan_thread_cleanup ()
     assert(td);
     td->is_active = 0;
     threadscan_proc_remove_thread_data(td);
+
+    // Reclaimers may have asked this thread to search before it left the
+    // list, and it won't be signalled now.  Answer so they aren't left
+    // waiting.  A reclaimer that asks after this sees that the thread is
+    // no longer active, and takes its request back.
+    __sync_synchronize(); // mfence.
+    if (has_scan_request(td)) {
+        raise(SIGTHREADSCAN);
+    }
+    // Threads in the same signalling tree may still look at td.
+    threadscan_proc_wait_for_fanout(td);
     threadscan_util_thread_data_decr_ref(td);
 }
 
 /**
- * Send the given signal to all threads in the process and return the number
- * of signals sent.
+ * Ask all other threads in the domain to search their memory for the given
+ * round, and signal them (or, if lazy, only the ones that have been late).
+ * Return the number of threads asked, and set *signal_count to the number
+ * signalled.
  */
-int threadscan_thread_signal_all_but_me (int sig)
+int threadscan_thread_request_scan_all_but_me (domain_t *dom, size_t round,
+                                               int sig, int lazy,
+                                               int *signal_count)
 {
     thread_data_t *me;
 
     me = threadscan_local_td;
     assert(me);
 
-    return threadscan_proc_signal_all_except(sig, me);
+    return threadscan_proc_request_scan_all_except(dom, round, sig, lazy, me,
+                                                   signal_count);
 }
 
 /**
@@ -127,24 +168,82 @@ mem_range_t threadscan_thread_user_stack ()
     return ret;
 }
 
-static volatile size_t global_timestamp = 1;
+/**
+ * The calling thread is about to block, and its stack from sp up won't
+ * change until it returns.  Publish sp so a reclaimer can search the stack
+ * without signalling the thread.  The caller must have spilled its
+ * callee-saved registers to the stack.
+ */
+void threadscan_thread_park (size_t sp)
+{
+    thread_data_t *td = threadscan_local_td;
+
+    if (NULL == td || !td->is_active) return;
+
+    td->park_sp = sp;
+    while (1) {
+        // Blocking is a safepoint.  Answer the rounds in progress, first.
+        if (has_scan_request(td)) {
+            raise(SIGTHREADSCAN);
+        }
+        td->park_state = THREAD_PARKED;
+        __sync_synchronize(); // mfence.
+
+        // A reclaimer that sets a request after this point either finds
+        // the thread parked, or its request is seen here.
+        if (!has_scan_request(td)) break;
+        threadscan_thread_unpark();
+    }
+}
+
+/**
+ * Return whether the reclaimer is done searching the thread at arg.
+ */
+static int not_searched (void *arg)
+{
+    return THREAD_SEARCHED != ((thread_data_t*)arg)->park_state;
+}
 
 /**
- * Raise the "helping" flag for this thread.
+ * The calling thread is back from blocking.  If a reclaimer is searching
+ * its stack, wait for it to finish before the thread changes anything.
  */
-void threadscan_thread_cleanup_raise_flag ()
+void threadscan_thread_unpark ()
 {
-    assert(threadscan_local_td != NULL);
     thread_data_t *td = threadscan_local_td;
-    size_t old_timestamp = td->local_timestamp;
+
+    if (NULL == td) return;
+
+    while (!BCAS(&td->park_state, THREAD_PARKED, THREAD_RUNNING)) {
+        if (THREAD_RUNNING == td->park_state) {
+            // Not parked: the thread was inactive, or a signal handler
+            // blocked and returned while it was parked.
+            return;
+        }
+        threadscan_util_wait(&td->park_wq, not_searched, td, NULL);
+    }
+}
+
+// Where a new reclaimer sleeps until the threads still helping the last
+// round lower their flags.
+static wait_queue_t g_helpers_wq;
+
+/**
+ * Raise the "helping" flag for this thread in the domain.
+ */
+void threadscan_thread_cleanup_raise_flag (domain_t *dom)
+{
+    assert(threadscan_local_td != NULL);
+    domain_member_t *member = &threadscan_local_td->members[dom->id];
+    size_t old_timestamp = member->local_timestamp;
     int updated;
 
     // Nothing needs to be atomic.  Only one thread ever writes to the
     // local timestamp.
-    td->local_timestamp = TIMESTAMP_RAISE_FLAG(old_timestamp);
+    member->local_timestamp = TIMESTAMP_RAISE_FLAG(old_timestamp);
     __sync_synchronize(); // mfence.
-    size_t curr = global_timestamp;
-    td->local_timestamp = TIMESTAMP_RAISE_FLAG(curr);
+    size_t curr = dom->timestamp;
+    member->local_timestamp = TIMESTAMP_RAISE_FLAG(curr);
 
     updated = TIMESTAMP(curr) != old_timestamp;
 
@@ -154,48 +253,60 @@ void threadscan_thread_cleanup_raise_flag ()
     // same timestamp twice, during a period of inactivity, it's a bad
     // write.
     if (updated) {
-        td->times_without_update = 0;
+        member->times_without_update = 0;
     } else if (!TIMESTAMP_IS_ACTIVE(curr)) {
-        if (td->times_without_update < 2) {
-            ++td->times_without_update;
+        if (member->times_without_update < 2) {
+            ++member->times_without_update;
         }
     }
 }
 
 /**
- * Lower the "helping" flag for this thread.
+ * Lower the "helping" flag for this thread in the domain.
  */
-void threadscan_thread_cleanup_lower_flag ()
+void threadscan_thread_cleanup_lower_flag (domain_t *dom)
 {
-    thread_data_t *td = threadscan_local_td;
+    domain_member_t *member = &threadscan_local_td->members[dom->id];
     // Nothing needs to be atomic.  Only one thread ever writes to this.
-    td->local_timestamp = TIMESTAMP(td->local_timestamp);
+    member->local_timestamp = TIMESTAMP(member->local_timestamp);
+    threadscan_util_wake(&g_helpers_wq);
 }
 
 /**
- * Try to become the reclaimer.  Return true if successful, false otherwise.
+ * Try to become the domain's reclaimer.  Return true if successful, false
+ * otherwise.
  */
-int threadscan_thread_cleanup_try_acquire ()
+int threadscan_thread_cleanup_try_acquire (domain_t *dom)
 {
-    size_t old_timestamp = global_timestamp;
+    size_t old_timestamp = dom->timestamp;
     if (TIMESTAMP_IS_ACTIVE(old_timestamp)) return 0;
 
     size_t attempt = TIMESTAMP_SET_ACTIVE(old_timestamp + 1);
-    if (!BCAS(&global_timestamp, old_timestamp, attempt)) {
+    if (!BCAS(&dom->timestamp, old_timestamp, attempt)) {
         // Failed to set the value -- someone else beat us to the punch.
         return 0;
     }
 
     // We have the critical section and are the new cleanup thread.  Wait
     // for all threads that are trying to "help out" to acknowledge this.
-    threadscan_proc_wait_for_timestamp(TIMESTAMP(attempt));
+    threadscan_proc_wait_for_timestamp(dom, TIMESTAMP(attempt),
+                                       &g_helpers_wq);
     return 1;
 }
 
 /**
- * Give up reclaimer lock.
+ * Give up the domain's reclaimer lock.
+ */
+void threadscan_thread_cleanup_release (domain_t *dom)
+{
+    dom->timestamp = TIMESTAMP(dom->timestamp);
+    threadscan_util_wake(&g_threadscan_reclaim_wq);
+}
+
+/**
+ * Return whether some thread holds the domain's reclaimer lock.
  */
-void threadscan_thread_cleanup_release ()
+int threadscan_thread_cleanup_in_progress (domain_t *dom)
 {
-    global_timestamp = TIMESTAMP(global_timestamp);
+    return TIMESTAMP_IS_ACTIVE(dom->timestamp) != 0;
 }
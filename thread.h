@@ -44,10 +44,14 @@ void *threadscan_thread_base (void *arg);
 void threadscan_thread_cleanup ();
 
 /**
- * Send the given signal to all threads in the process and return the number
- * of signals sent.
+ * Ask all other threads in the domain to search their memory for the given
+ * round, and signal them (or, if lazy, only the ones that have been late).
+ * Return the number of threads asked, and set *signal_count to the number
+ * signalled.
  */
-int threadscan_thread_signal_all_but_me (int sig);
+int threadscan_thread_request_scan_all_but_me (domain_t *dom, size_t round,
+                                               int sig, int lazy,
+                                               int *signal_count);
 
 /**
  * Return the address range of the stack where the user has (or might have)
@@ -56,23 +60,43 @@ int threadscan_thread_signal_all_but_me (int sig);
 mem_range_t threadscan_thread_user_stack ();
 
 /**
- * Raise the "helping" flag for this thread.
+ * The calling thread is about to block, and its stack from sp up won't
+ * change until it returns.  Publish sp so a reclaimer can search the stack
+ * without signalling the thread.  The caller must have spilled its
+ * callee-saved registers to the stack.
  */
-void threadscan_thread_cleanup_raise_flag ();
+void threadscan_thread_park (size_t sp);
 
 /**
- * Lower the "helping" flag for this thread.
+ * The calling thread is back from blocking.  If a reclaimer is searching
+ * its stack, wait for it to finish before the thread changes anything.
  */
-void threadscan_thread_cleanup_lower_flag ();
+void threadscan_thread_unpark ();
 
 /**
- * Try to become the reclaimer.  Return true if successful, false otherwise.
+ * Raise the "helping" flag for this thread in the domain.
  */
-int threadscan_thread_cleanup_try_acquire ();
+void threadscan_thread_cleanup_raise_flag (domain_t *dom);
 
 /**
- * Give up reclaimer lock.
+ * Lower the "helping" flag for this thread in the domain.
  */
-void threadscan_thread_cleanup_release ();
+void threadscan_thread_cleanup_lower_flag (domain_t *dom);
+
+/**
+ * Try to become the domain's reclaimer.  Return true if successful, false
+ * otherwise.
+ */
+int threadscan_thread_cleanup_try_acquire (domain_t *dom);
+
+/**
+ * Give up the domain's reclaimer lock.
+ */
+void threadscan_thread_cleanup_release (domain_t *dom);
+
+/**
+ * Return whether some thread holds the domain's reclaimer lock.
+ */
+int threadscan_thread_cleanup_in_progress (domain_t *dom);
 
 #endif // !defined _THREAD_H_
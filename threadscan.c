@@ -20,17 +20,26 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-#define _GNU_SOURCE // For pthread_yield().
+#define _GNU_SOURCE // For sched_setaffinity().
 #include "alloc.h"
 #include <assert.h>
+#include "dirty.h"
 #include "env.h"
+#include <errno.h>
+#include <limits.h>
+#include "numa.h"
 #include "proc.h"
+#include "pressure.h"
 #include <pthread.h>
+#include "reclaim.h"
+#include "scan.h"
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "thread.h"
+#include <time.h>
 #include <unistd.h>
 #include "util.h"
 
@@ -38,16 +47,34 @@ THE SOFTWARE.
 /*                                  Macros                                  */
 /****************************************************************************/
 
-#define SIGTHREADSCAN SIGUSR1
+#define SCAN_INDEX_OFFSET 0
+#define SORT_TMP_OFFSET 1
+#define MARKS_OFFSET 2
 
-#define SCAN_MAP_OFFSET 0
+// The working buffers a domain keeps mapped between rounds.  A round lets
+// the next one start before it's done with its buffer, so there can be two
+// in use at once.  A slot is ARENA_BUSY while a buffer goes in or out.
+#define ARENA_SLOTS 2
+#define ARENA_BUSY ((char*)1)
+
+// The working memory starts out with room for this many threads' lists of
+// collected pointers.  It doubles whenever a round needs more.
+#define INITIAL_THREAD_CAPACITY 256
 
 #define PTR_MASK(v) ((v) & ~3) // Mask off the low two bits.
 
-#define SET_LOW_BIT(p) do {                      \
-        size_t v = (size_t)*(p);                 \
-        if ((v & 1) == 0) { *(p) = (v + 1); }    \
-    } while (0)
+// Between rounds, the low two bits of a collected address are free, and
+// they hold its generation: how many rounds it has survived.
+#define GEN_NEW 0    // Collected since the last round.
+#define GEN_YOUNG 1  // Survived one round.
+#define GEN_OLD 2    // Survived more, and searched for less often.
+#define GEN_COUNT 3
+#define GEN_OF(v) ((v) & 3)
+
+// Bit i of a mark bitmap is for position i of the search list.
+#define MARK_WORD(i) ((i) / 64)
+#define MARK_BIT(i) ((size_t)1 << ((i) % 64))
+#define IS_MARKED(marks, i) ((marks)[MARK_WORD(i)] & MARK_BIT(i))
 
 #ifndef NDEBUG
 static void assert_monotonicity (size_t *a, int n)
@@ -67,46 +94,178 @@ static void assert_monotonicity (size_t *a, int n)
 #define assert_monotonicity(a, b) /* nothing. */
 #endif
 
-#define BINARY_THRESHOLD 32
+// Number of words the search filters at a time before looking up the
+// candidates that pass the filter.
+#define SCAN_BLOCK 256
+
+#define PAGE_WORDS (PAGESIZE / sizeof(size_t))
+
+// With soft-dirty tracking, this much of the bottom of a stack is always
+// read.  The searching thread's own frames are there, and they're written
+// between reading the dirty bits and clearing them.
+#define SELF_FRAMES_SIZE (2 * PAGESIZE)
 
-#define GET_STACK_POINTER(qword)                \
-    __asm__("movq %%rsp, %0"                    \
-            : "=m"(qword)                       \
-            : "r"("%rsp")                       \
-            : )
+// Under memory pressure, threads reclaim once their pointer lists are this
+// fraction of the usual size.
+#define PRESSURE_QUEUE_DIVISOR 8
+
+// Unreferenced pointers are looked up in the reclaim map this many at a
+// time.
+#define RECLAIM_BATCH 64
+
+// Initial capacity of a thread's list of reclaim functions to call.  It's
+// a whole number of pages.
+#define READY_MIN_CAPACITY 512
+
+// Max number of sorted runs merged into the working pointers list.  Beyond
+// this, the leftovers are sorted along with the new pointers.
+#define MAX_SORTED_RUNS 64
 
 /****************************************************************************/
 /*                           Typedefs and structs                           */
 /****************************************************************************/
 
-typedef struct threadscan_data_t threadscan_data_t;
+typedef struct threadscan_domain_t threadscan_domain_t;
 
 typedef struct addr_storage_t addr_storage_t;
 
+typedef struct arena_t arena_t;
+
 typedef struct do_reclaim_arg_t do_reclaim_arg_t;
 
-struct threadscan_data_t {
-    int max_ptrs; // Max pointer count that can be tracked during reclamation.
+typedef struct collector_t collector_t;
+
+typedef struct gen_stats_t gen_stats_t;
+
+typedef struct stats_t stats_t;
+
+typedef struct reclaim_wait_t reclaim_wait_t;
+
+typedef struct answer_wait_t answer_wait_t;
+
+typedef struct search_list_t search_list_t;
+
+// What a search looks addresses up in: the index over addrs, or the hash
+// set.
+struct search_list_t {
+    size_t *addrs;
+    scan_index_t index;
+    scan_hash_t hash;
+};
+
+// A working buffer kept for a later round, and its size.
+struct arena_t {
+    char *volatile buf;
+    size_t size;
+};
+
+struct threadscan_domain_t {
+    // The domain's id, reclaimer lock and signalling tree.  The default
+    // domain is g_tsdata, and every thread is in it.  The others only have
+    // the threads that attach to them, and they leave out the features that
+    // would take more than that: see domain_create().
+    domain_t base;
+
+    // Which features the domain's rounds use.  Only the default domain's
+    // rounds wait at safepoints, keep page caches, or skip searches for
+    // epochs.
+    int safepoint;
+    int soft_dirty;
+    int epoch;
+
+    // Max pointer count that can be tracked during reclamation.  It grows
+    // with the number of threads.
+    int max_ptrs;
 
     // Addresses being tracked for reclamation.
     int n_addrs;
     size_t *buf_addrs;
 
-    // Scan map is a mini-map of buf_addrs.  One element in the scan map
-    // corresponds to a page of addresses in buf_addrs.
-    int n_scan_map;
-    size_t *buf_scan_map;
+    // Search index over buf_addrs: a B-tree with one cache line per node.
+    // buf_index holds the levels above buf_addrs.
+    scan_index_t index;
+    size_t *buf_index;
+
+    // With the hash engine, the addresses are in a hash set, instead, and
+    // buf_addrs is not sorted.  The hash set reuses the space of buf_index
+    // and the sort space.
+    scan_hash_t hash;
+
+    // Bounds of the addresses being tracked.
+    size_t min_ptr, max_ptr;
+
+    // The search list for the threads on each NUMA node.  The reclaimer's
+    // node searches the one in the working memory, and the others search
+    // copies of it, each in the memory of its own node, in replicas.
+    int n_nodes;
+    search_list_t lists[MAX_NUMA_NODES];
+    char *replicas[MAX_NUMA_NODES];
+
+    // Scratch space for sorting buf_addrs.
+    size_t *buf_sort_tmp;
+
+    // The marks of all the threads, ORed together after the scan.  n_slots
+    // is the number of mark bits this round: one per address, or one per
+    // slot of the hash set.
+    size_t *buf_marks;
+    size_t n_slots;
 
     // Instead of allocating each of the above buffers, we allocate one _big_
     // buffer and then split it up.  The working_buffer_sz is the size of
     // that buffer, and the offset_list is used for assigning the pointers to
-    // the individual sub-buffers.
+    // the individual sub-buffers.  working_memory is the current round's.
     size_t working_buffer_sz;
-    size_t offset_list[2];
+    size_t offset_list[3];
+    char *working_memory;
+
+    // Working buffers that aren't in use.  They stay mapped, so the pages a
+    // round touches don't have to be faulted in again by the next one.
+    arena_t arenas[ARENA_SLOTS];
 
     // Some pointers may not have been free'd.  We have to keep them around
     // for the next iteration.  storage is a buffer of un-free'd pointers.
+    // Those that stay un-free'd go to old_storage, which is only searched
+    // every old_gen_interval rounds, or when it grows to old_gen_limit.
     addr_storage_t *storage;
+    addr_storage_t *old_storage;
+    volatile size_t old_count;
+    size_t old_gen_limit;
+    size_t round;
+
+    // With THREADSCAN_EPOCH, the pointers collected last round wait in limbo
+    // for every thread to be outside an operation.  grace is set for a
+    // round in which they have been, so it frees its pointers unsearched.
+    addr_storage_t *limbo;
+    int grace;
+
+    // Threads add the bytes they collect to g_threadscan_pending_bytes once
+    // they have this many.  The reclaimer moves them to bytes_in_flight, and
+    // they come off that once the round has free'd its pointers.
+    size_t byte_chunk;
+    volatile size_t bytes_in_flight;
+    size_t round_bytes;
+
+    // With soft-dirty tracking: the number of times the bits have been
+    // cleared, the clear that the bits read this round count from, how many
+    // of the signalled threads have read theirs this round, and whether
+    // this round reads every page anyway.  The page caches keep the words
+    // in [cache_low, cache_high].
+    volatile size_t dirty_epoch;
+    size_t read_epoch;
+    volatile int dirty_reads;
+    volatile size_t dirty_rounds; // Rounds past the clear, or its skip.
+    wait_queue_t dirty_wq;    // Woken when dirty_rounds goes up.
+    struct timespec last_clear;
+    int search_all;
+    size_t cache_low, cache_high;
+
+    // The number of threads asked to search this round, and where the
+    // reclaimer sleeps until they have.  The last one to finish wakes it.
+    volatile int n_requested;
+    wait_queue_t handshake_wq;
+
+    // The number of them that have searched their memory.
+    volatile int self_stacks_searched;
 };
 
 struct addr_storage_t {
@@ -118,7 +277,56 @@ struct addr_storage_t {
 struct do_reclaim_arg_t {
     // Return values:
     size_t *addrs;
+    size_t *marks;
     int count;
+    int hashed;               // Whether the marks are in the hash set.
+    size_t bytes;             // Bytes of the collected objects.
+    scan_hash_t hash;
+};
+
+struct collector_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // Signalled to wake the collector early.
+    volatile int wake;        // Set when a thread crosses the watermark.
+    size_t watermark;         // Pointer list length that wakes it.
+};
+
+struct gen_stats_t {
+    size_t searched;
+    size_t freed;
+    size_t survived;
+};
+
+struct stats_t {
+    size_t rounds;
+    size_t old_rounds;        // Rounds that searched the old generation.
+    size_t pressure_rounds;   // Rounds started by the pressure monitor.
+    size_t pages_read;        // With soft-dirty tracking, pages searched
+    size_t pages_skipped;     // by reading them, and from their caches,
+    size_t dirty_clears;      // and the number of times bits were cleared.
+    size_t safepoints;        // Requests to search taken at safepoints,
+    size_t signals;           // and signals sent to bystanders.
+    size_t parked;            // Parked threads searched by the reclaimer.
+    size_t epoch_rounds;      // Rounds that free'd without searching.
+    size_t handshakes;        // Rounds that asked the threads to search,
+    size_t handshake_ns;      // and how long until they all had.
+    gen_stats_t gen[GEN_COUNT];
+};
+
+// A thread waiting on a reclamation in dom until done(arg).  With no dom,
+// it waits on whichever round is running, or is about to finish.
+struct reclaim_wait_t {
+    threadscan_domain_t *dom;
+    int (*done) (void *);
+    void *arg;
+    thread_data_t *td;
+};
+
+// A reclaimer waiting for the threads it asked to search to add themselves
+// to counter.
+struct answer_wait_t {
+    threadscan_domain_t *dom;
+    volatile int *counter;
 };
 
 /****************************************************************************/
@@ -128,376 +336,2132 @@ struct do_reclaim_arg_t {
 __attribute__((visibility("default")))
 void threadscan_collect (void *ptr);
 
+__attribute__((visibility("default")))
+void threadscan_collect_bulk (void **ptrs, size_t n);
+
+__attribute__((visibility("default")))
+void threadscan_collect_sized (void *ptr, size_t bytes);
+
+__attribute__((visibility("default")))
+void threadscan_collect_fn (void *ptr, reclaim_fn_t fn, void *ctx);
+
+__attribute__((visibility("default")))
+void threadscan_set_reclaim_fn (reclaim_fn_t fn, void *ctx);
+
 __attribute__((visibility("default")))
 void threadscan_register_local_block (void *addr, size_t size);
 
-static threadscan_data_t g_tsdata;
+__attribute__((visibility("default")))
+void threadscan_resize_local_block (void *addr, size_t size);
+
+__attribute__((visibility("default")))
+void threadscan_unregister_local_block (void *addr);
+
+__attribute__((visibility("default")))
+threadscan_domain_t *threadscan_domain_create ();
+
+__attribute__((visibility("default")))
+void threadscan_domain_attach (threadscan_domain_t *dom);
+
+__attribute__((visibility("default")))
+void threadscan_domain_detach (threadscan_domain_t *dom);
+
+__attribute__((visibility("default")))
+void threadscan_domain_collect (threadscan_domain_t *dom, void *ptr);
+
+__attribute__((visibility("default")))
+void threadscan_domain_destroy (threadscan_domain_t *dom);
+
+__attribute__((visibility("default")))
+void threadscan_safepoint_poll ();
+
+__attribute__((visibility("default")))
+void threadscan_begin_op ();
+
+__attribute__((visibility("default")))
+void threadscan_end_op ();
+
+// The round waiting for threads to search at their safepoints, or 0.
+// threadscan_safepoint() reads it.
+__attribute__((visibility("default")))
+volatile size_t threadscan_safepoint_round;
+
+// The default domain.
+static threadscan_domain_t g_tsdata;
+
+static collector_t g_collector;
+
+// Whether the library's own threads (collector, pressure monitor) are up.
+static volatile int g_threads_started;
+
+// Set by the pressure monitor while memory is short.  Threads reclaim when
+// their pointer lists reach pressure_queue_limit, instead of when they're
+// full.
+static volatile int g_under_pressure;
+static size_t g_pressure_queue_limit;
 
-static volatile int self_stacks_searched = 1;
+static stats_t g_stats;
+
+// Reclaims pointers collected without a function of their own, or NULL for
+// free().
+static reclaim_fn_t g_default_fn;
+static void *g_default_ctx;
 
 /****************************************************************************/
 /*                            Pointer tracking.                             */
 /****************************************************************************/
 
-static void assign_working_space (char *buf)
+static void assign_working_space (threadscan_domain_t *dom, char *buf)
+{
+    dom->buf_addrs = (size_t*)buf;
+    dom->buf_index =
+        (size_t*)(buf + dom->offset_list[SCAN_INDEX_OFFSET]);
+    dom->buf_sort_tmp =
+        (size_t*)(buf + dom->offset_list[SORT_TMP_OFFSET]);
+    dom->buf_marks = (size_t*)(buf + dom->offset_list[MARKS_OFFSET]);
+}
+
+/**
+ * Work out the size of a working buffer with room for max_ptrs pointers,
+ * and where its sub-buffers go.  Since we allocate all the buffers in a
+ * single allocation, do all the necessary math to get the size of that
+ * alloc.  Also, calculate the offsets into that big buffer for all of the
+ * sub-buffers.
+ */
+static void lay_out_working_space (threadscan_domain_t *dom, int max_ptrs)
+{
+    dom->max_ptrs = max_ptrs;
+
+    // Reserve space for buf_addrs, plus padding out to a whole index node.
+    dom->working_buffer_sz =
+        (dom->max_ptrs * 2 + SCAN_INDEX_FANOUT) * sizeof(size_t);
+    dom->offset_list[SCAN_INDEX_OFFSET] = dom->working_buffer_sz;
+
+    // Reserve space for the upper levels of the search index, and round up
+    // to the nearest page to avoid sharing with the sort space.
+    dom->working_buffer_sz +=
+        threadscan_scan_index_size(dom->max_ptrs * 2) * sizeof(size_t);
+    if (dom->working_buffer_sz % PAGESIZE) {
+        dom->working_buffer_sz += PAGESIZE;
+        dom->working_buffer_sz &= ~(PAGESIZE - 1);
+    }
+    dom->offset_list[SORT_TMP_OFFSET] = dom->working_buffer_sz;
+
+    // Reserve scratch space for the sort.  Same size as buf_addrs.
+    dom->working_buffer_sz += dom->max_ptrs * sizeof(size_t) * 2;
+
+    // The hash engine puts its hash set where the index and the sort space
+    // would be.  Make sure it fits.
+    {
+        size_t hash_end = dom->offset_list[SCAN_INDEX_OFFSET]
+            + threadscan_scan_hash_size(dom->max_ptrs * 2)
+            * sizeof(size_t);
+        hash_end = (hash_end + PAGESIZE - 1) & ~(PAGESIZE - 1);
+        if (hash_end > dom->working_buffer_sz) {
+            dom->working_buffer_sz = hash_end;
+        }
+    }
+    dom->offset_list[MARKS_OFFSET] = dom->working_buffer_sz;
+
+    // Reserve space for the gathered marks, one bit per slot of the largest
+    // hash set, which has more slots than buf_addrs has addresses.
+    dom->working_buffer_sz +=
+        (MARK_WORD(threadscan_scan_hash_size(dom->max_ptrs * 2)) + 1)
+        * sizeof(size_t);
+    dom->working_buffer_sz =
+        (dom->working_buffer_sz + PAGESIZE - 1) & ~(PAGESIZE - 1);
+
+    // The old generation is searched once it's a quarter of what a round
+    // can hold, unless THREADSCAN_OLD_GEN_LIMIT says otherwise.
+    dom->old_gen_limit = g_threadscan_old_gen_limit > 0
+        ? (size_t)g_threadscan_old_gen_limit : (size_t)dom->max_ptrs / 4;
+}
+
+/**
+ * Take a working buffer for a round: one kept from an earlier round, or a
+ * new one.  Kept buffers from before the working memory grew are too small,
+ * and they're unmapped.
+ */
+static char *take_working_space (threadscan_domain_t *dom)
+{
+    int i;
+
+    for (i = 0; i < ARENA_SLOTS; ++i) {
+        arena_t *arena = &dom->arenas[i];
+        char *buf = arena->buf;
+        size_t size;
+        if (NULL == buf || ARENA_BUSY == buf
+            || !BCAS(&arena->buf, buf, ARENA_BUSY)) {
+            continue;
+        }
+        size = arena->size;
+        __sync_synchronize(); // mfence.
+        arena->buf = NULL;
+        if (size == dom->working_buffer_sz) return buf;
+        threadscan_alloc_munmap(buf);
+    }
+
+    if (g_threadscan_huge_pages) {
+        return (char*)threadscan_alloc_mmap_huge(dom->working_buffer_sz);
+    }
+    return (char*)threadscan_alloc_mmap(dom->working_buffer_sz);
+}
+
+/**
+ * Keep the working buffer of the given size for a later round, or unmap it
+ * if there are already enough of them.
+ */
+static void return_working_space (threadscan_domain_t *dom, char *buf,
+                                  size_t size)
+{
+    int i;
+
+    for (i = 0; i < ARENA_SLOTS; ++i) {
+        arena_t *arena = &dom->arenas[i];
+        if (NULL == arena->buf && BCAS(&arena->buf, NULL, ARENA_BUSY)) {
+            arena->size = size;
+            __sync_synchronize(); // mfence.
+            arena->buf = buf;
+            return;
+        }
+    }
+    threadscan_alloc_munmap(buf);
+}
+
+/**
+ * Make room in the working memory for at least need addresses, keeping the
+ * first n that are in buf_addrs already.  The search list replicas have the
+ * old layout, so they're dropped, too.
+ */
+static void grow_working_space (threadscan_domain_t *dom, int n, size_t need)
+{
+    char *old = dom->working_memory;
+    size_t old_sz = dom->working_buffer_sz;
+    int max_ptrs = dom->max_ptrs, node;
+
+    while ((size_t)max_ptrs * 2 < need) max_ptrs *= 2;
+    lay_out_working_space(dom, max_ptrs);
+    for (node = 0; node < MAX_NUMA_NODES; ++node) {
+        if (dom->replicas[node]) {
+            threadscan_alloc_munmap(dom->replicas[node]);
+            dom->replicas[node] = NULL;
+        }
+    }
+
+    dom->working_memory = take_working_space(dom);
+    assign_working_space(dom, dom->working_memory);
+    memcpy(dom->buf_addrs, old, n * sizeof(size_t));
+    return_working_space(dom, old, old_sz);
+}
+
+/**
+ * Clear the first n bits of the merged mark bitmap.  The threads' marks are
+ * ORed into it, and its buffer has the marks of an earlier round.
+ */
+static void clear_marks (threadscan_domain_t *dom, size_t n)
 {
-    g_tsdata.buf_addrs = (size_t*)buf;
-    g_tsdata.buf_scan_map =
-        (size_t*)(buf + g_tsdata.offset_list[SCAN_MAP_OFFSET]);
+    memset(dom->buf_marks, 0, (MARK_WORD(n) + 1) * sizeof(size_t));
 }
 
 /**
  * The remaining n pointers were unable to be free'd because there were
- * outstanding references.  Store them away until the next run.
+ * outstanding references.  Copy them out of the working buffer, which the
+ * next round reuses, and store them away in the given generation's storage
+ * until the next run.
  */
-static void store_remaining_addrs (size_t *addrs, int n)
+static void store_remaining_addrs (addr_storage_t **storage, size_t *addrs,
+                                   int n)
 {
     addr_storage_t *tmp;
+    size_t sz;
 
     if (n == 0) {
         // Nothing remaining, nothing to store.
-        threadscan_alloc_munmap(addrs);
         return;
     }
 
-    if (n + 2 > g_tsdata.max_ptrs * 2) {
-        threadscan_fatal("threadscan internal error: "
-                         "Ran out of storage space.\n");
-    }
-
-    // Convert the array of addresses to an addr_storage_t struct.  That
-    // struct ends with an array of addresses, but it starts with a pointer
-    // and a length field.  Move the first two addresses to the end and
-    // reuse the space they used to occupy as the pointer and length fields.
-    addrs[n] = addrs[0];
-    addrs[n + 1] = addrs[1];
-    tmp = (addr_storage_t*)addrs;
+    // The addresses are sorted, and they have to stay that way.
+    sz = (n + 2) * sizeof(size_t);
+    sz = (sz + PAGESIZE - 1) & ~(PAGESIZE - 1);
+    tmp = (addr_storage_t*)threadscan_alloc_mmap(sz);
     tmp->length = n;
+    memcpy(tmp->addrs, addrs, n * sizeof(size_t));
 
     do {
-        tmp->next = g_tsdata.storage;
-    } while (!BCAS(&g_tsdata.storage, tmp->next, tmp));
+        tmp->next = *storage;
+    } while (!BCAS(storage, tmp->next, tmp));
+}
+
+/**
+ * Age the n addresses that survived a round and store them by generation.
+ * Young ones are moved to the front of addrs and stored there.  Old ones
+ * get a buffer of their own.  Either way, sorted addresses stay sorted.
+ */
+static void store_survivors (threadscan_domain_t *dom, size_t *addrs, int n)
+{
+    addr_storage_t *old = NULL;
+    int n_young = 0, n_old = 0;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (GEN_OF(addrs[i]) != GEN_NEW) ++n_old;
+    }
+
+    if (n_old > 0) {
+        size_t sz = (n_old + 2) * sizeof(size_t);
+        sz = (sz + PAGESIZE - 1) & ~(PAGESIZE - 1);
+        old = (addr_storage_t*)threadscan_alloc_mmap(sz);
+        old->length = n_old;
+        n_old = 0;
+    }
+
+    for (i = 0; i < n; ++i) {
+        size_t addr = PTR_MASK(addrs[i]);
+        if (GEN_OF(addrs[i]) == GEN_NEW) {
+            addrs[n_young++] = addr | GEN_YOUNG;
+        } else {
+            old->addrs[n_old++] = addr | GEN_OLD;
+        }
+    }
+
+    store_remaining_addrs(&dom->storage, addrs, n_young);
+
+    if (old) {
+        __sync_fetch_and_add(&dom->old_count, n_old);
+        do {
+            old->next = dom->old_storage;
+        } while (!BCAS(&dom->old_storage, old->next, old));
+    }
 }
 
 /**
  * Move addresses over to the current working list of addrs.  Add the
  * number of elements copied over into *n.
  */
-static void add_to_buf_addrs (int *n, size_t *buf, int max)
+static void add_to_buf_addrs (threadscan_domain_t *dom, int *n, size_t *buf,
+                              int max)
 {
-    if (*n + max > g_tsdata.max_ptrs * 2) {
-        threadscan_diagnostic("*n = %d, max = %d\n", *n, max);
-        threadscan_fatal("threadscan internal error: "
-                         "overflowed address list.\n");
+    if (*n + max > dom->max_ptrs * 2) {
+        grow_working_space(dom, *n, (size_t)*n + max);
     }
 
-    memcpy(&g_tsdata.buf_addrs[*n], buf, max * sizeof(size_t));
+    memcpy(&dom->buf_addrs[*n], buf, max * sizeof(size_t));
     *n += max;
 }
 
-static int generate_working_pointers_list ()
+/**
+ * Append each batch of leftovers to buf_addrs as a sorted run, and free the
+ * batches.  *merge is cleared if there are too many runs to merge.  Return
+ * the number of addresses added.
+ */
+static int add_leftovers (threadscan_domain_t *dom, addr_storage_t *leftovers,
+                          int *n, int *run_bounds, int *n_runs, int *merge)
 {
-    int n = 0;
-    thread_list_t *thread_list = threadscan_proc_get_thread_list();
-    thread_data_t *td;
-
-    // Add leftover pointers.
-    addr_storage_t *leftovers =
-        __sync_lock_test_and_set(&g_tsdata.storage, NULL);
+    int start = *n;
 
     while (leftovers) {
-        add_to_buf_addrs(&n, leftovers->addrs, leftovers->length);
+        add_to_buf_addrs(dom, n, leftovers->addrs, leftovers->length);
+        if (*n_runs < MAX_SORTED_RUNS) {
+            run_bounds[++*n_runs] = *n;
+        } else {
+            *merge = 0;
+        }
         addr_storage_t *tmp = leftovers;
         leftovers = leftovers->next;
         threadscan_alloc_munmap(tmp);
     }
 
-    // Add the pointers from each of the individual thread buffers.
+    return *n - start;
+}
+
+/**
+ * With THREADSCAN_EPOCH, check whether every thread has been outside an
+ * operation since the reclaimer last looked, i.e., whether none of the
+ * pointers in limbo, or collected before them, can be referenced.  The
+ * limbo's pointers are added to buf_addrs as a run.  If they're free to go,
+ * the n new pointers at the front of buf_addrs take their place in limbo.
+ * Otherwise, the round searches, and it may as well search for the new
+ * pointers, too.  Return whether the round can skip the search.
+ */
+static int swap_limbo (threadscan_domain_t *dom, int *n, int *run_bounds,
+                       int *n_runs, int *merge)
+{
+    thread_list_t *thread_list = threadscan_proc_get_thread_list();
+    thread_data_t *td;
+    addr_storage_t *limbo = dom->limbo;
+    int grace = 1;
+
+    // The new pointers were collected before this, so a thread that isn't
+    // in the operation it was in now can't have found them.
+    __sync_synchronize();
     FOREACH_IN_THREAD_LIST(td, thread_list)
-        assert(td);
-        n += threadscan_queue_pop_bulk(&g_tsdata.buf_addrs[n],
-                                       g_tsdata.max_ptrs * 2 - n,
-                                       &td->ptr_list);
+        size_t epoch = td->op_epoch;
+        if ((td->op_snapshot & 1) && epoch == td->op_snapshot) grace = 0;
+        td->op_snapshot = epoch;
     ENDFOREACH_IN_THREAD_LIST(td, thread_list);
 
-    return n;
+    dom->limbo = NULL;
+    if (grace && *n > 0) {
+        size_t sz = (*n + 2) * sizeof(size_t);
+        sz = (sz + PAGESIZE - 1) & ~(PAGESIZE - 1);
+        dom->limbo = (addr_storage_t*)threadscan_alloc_mmap(sz);
+        dom->limbo->next = NULL;
+        dom->limbo->length = *n;
+        memcpy(dom->limbo->addrs, dom->buf_addrs,
+               *n * sizeof(size_t));
+        *n = 0;
+        *n_runs = 0;
+    }
+    add_leftovers(dom, limbo, n, run_bounds, n_runs, merge);
+    return grace;
 }
 
-static void generate_scan_map ()
+/**
+ * Build the sorted list of addresses to search for in buf_addrs and return
+ * its length.  Leftovers from previous rounds are already sorted, so only
+ * the new pointers from the thread queues get sorted.  The result is a
+ * merge of the sorted runs.  The hash engine skips the sorting; its list
+ * is in no particular order.  The old generation of leftovers is only
+ * included every so often.  With THREADSCAN_EPOCH, a round that doesn't
+ * need to search takes everything but the new pointers, unsorted.
+ */
+static int generate_working_pointers_list (threadscan_domain_t *dom)
 {
-    int i;
-    g_tsdata.n_scan_map = 0;
-    for (i = 0; i < g_tsdata.n_addrs;
-         i += (PAGESIZE / sizeof(size_t))) {
-        g_tsdata.buf_scan_map[g_tsdata.n_scan_map] =
-            g_tsdata.buf_addrs[i];
-        ++g_tsdata.n_scan_map;
+    int n = 0;
+    int run_bounds[MAX_SORTED_RUNS + 1];
+    int n_runs, merge = 1;
+    int count;
+    size_t drained = 0;
+    thread_list_t *thread_list = threadscan_proc_get_thread_list();
+    thread_data_t *td;
+
+    // Add the pointers from each of the individual thread buffers, and take
+    // their bytes off the pending count.  Threads that have left the domain
+    // emptied their lists first.  Only the default domain has sized
+    // objects.  If there are more threads than the working memory has room
+    // for, it grows.
+    FOREACH_IN_THREAD_LIST(td, thread_list)
+        assert(td);
+        if (IS_MEMBER(td, dom->base.id)) {
+            queue_t *q = &td->members[dom->base.id].ptr_list;
+            if (&g_tsdata == dom) {
+                drained += threadscan_util_thread_data_drain(td);
+            }
+            if (n + q->capacity > (size_t)dom->max_ptrs * 2) {
+                grow_working_space(dom, n, n + q->capacity);
+            }
+            n += threadscan_queue_pop_bulk(&dom->buf_addrs[n],
+                                           dom->max_ptrs * 2 - n, q);
+        }
+    ENDFOREACH_IN_THREAD_LIST(td, thread_list);
+    __sync_fetch_and_add(&dom->bytes_in_flight, drained);
+    __sync_fetch_and_sub(&g_threadscan_pending_bytes, drained);
+    dom->round_bytes = drained;
+
+    // Threads waiting for room on their lists have it.
+    threadscan_util_wake(&g_threadscan_reclaim_wq);
+
+    // The new pointers are the first run.
+    if (ENGINE_SORT == g_threadscan_engine) {
+        threadscan_util_sort(dom->buf_addrs, dom->buf_sort_tmp, n);
     }
+    run_bounds[0] = 0;
+    run_bounds[1] = n;
+    n_runs = 1;
+    dom->grace = 0;
+    if (dom->epoch) {
+        dom->grace = swap_limbo(dom, &n, run_bounds, &n_runs, &merge);
+    }
+    __sync_fetch_and_add(&g_stats.gen[GEN_NEW].searched, n);
+
+    // Add leftover pointers.  Each batch of leftovers is another run.
+    count = add_leftovers(dom, __sync_lock_test_and_set(&dom->storage, NULL),
+                          &n, run_bounds, &n_runs, &merge);
+    __sync_fetch_and_add(&g_stats.gen[GEN_YOUNG].searched, count);
+
+    ++dom->round;
+    __sync_fetch_and_add(&g_stats.rounds, 1);
+    dom->search_all = 0;
+    if (dom->grace) {
+        // Nothing collected before the limbo's pointers can be referenced,
+        // either.  Free the old generation along with them.
+        addr_storage_t *old =
+            __sync_lock_test_and_set(&dom->old_storage, NULL);
+        count = add_leftovers(dom, old, &n, run_bounds, &n_runs, &merge);
+        __sync_fetch_and_sub(&dom->old_count, count);
+        __sync_fetch_and_add(&g_stats.gen[GEN_OLD].searched, count);
+    } else if (dom->round % g_threadscan_old_gen_interval == 0
+               || dom->old_count >= dom->old_gen_limit) {
+        addr_storage_t *old =
+            __sync_lock_test_and_set(&dom->old_storage, NULL);
+        count = add_leftovers(dom, old, &n, run_bounds, &n_runs, &merge);
+        __sync_fetch_and_sub(&dom->old_count, count);
+        __sync_fetch_and_add(&g_stats.gen[GEN_OLD].searched, count);
+        __sync_fetch_and_add(&g_stats.old_rounds, 1);
+
+        // With soft-dirty tracking, the old generation's rounds also read
+        // every page, in case one changed without being written.
+        dom->search_all = 1;
+    }
+
+    if (ENGINE_SORT != g_threadscan_engine || dom->grace) {
+        // Order doesn't matter.
+    } else if (merge) {
+        threadscan_util_merge_runs(dom->buf_addrs, dom->buf_sort_tmp,
+                                   run_bounds, n_runs);
+    } else {
+        // Too many runs to merge.  Sort everything.
+        threadscan_util_sort(dom->buf_addrs, dom->buf_sort_tmp, n);
+    }
+    return n;
 }
 
-static int iterative_search (size_t val, size_t *a, int min, int max)
+static void generate_scan_index (threadscan_domain_t *dom)
 {
-    if (a[min] > val || min == max) return min;
-    for ( ; min < max; ++min) {
-        size_t cmp = a[min];
-        if (cmp == val) return min;
-        if (cmp > val) break;
+    if (ENGINE_HASH == g_threadscan_engine) {
+        threadscan_scan_hash_build(&dom->hash, dom->buf_addrs,
+                                   dom->n_addrs, dom->buf_index);
+        dom->min_ptr = dom->hash.min;
+        dom->max_ptr = dom->hash.max;
+        dom->n_slots = dom->hash.n_slots;
+    } else {
+        threadscan_scan_index_build(&dom->index, dom->buf_addrs,
+                                    dom->n_addrs, dom->buf_index);
+        dom->min_ptr = PTR_MASK(dom->buf_addrs[0]);
+        dom->max_ptr =
+            PTR_MASK(dom->buf_addrs[dom->n_addrs - 1]);
+        dom->n_slots = dom->n_addrs;
     }
-    return min - 1;
 }
 
-static int binary_search (size_t val, size_t *a, int min, int max)
+/**
+ * Copy the search list to the replica for node, so the threads there don't
+ * search across the interconnect.  The replica has the layout of the
+ * working memory, so the copy's pointers are the originals, moved over.
+ */
+static void copy_search_list (threadscan_domain_t *dom, int node,
+                              const search_list_t *list)
 {
-    while (max - min >= BINARY_THRESHOLD) {
-        int mid = (max + min) / 2;
-        size_t cmp = a[mid];
-        if (cmp == val) return mid;
+    char *base = (char*)dom->buf_addrs, *replica = dom->replicas[node];
+    search_list_t *copy = &dom->lists[node];
+    ptrdiff_t delta;
+    int i;
 
-        if (cmp > val) max = mid;
-        else min = mid;
+    if (NULL == replica) {
+        size_t size = dom->offset_list[MARKS_OFFSET];
+        replica = (char*)threadscan_alloc_mmap(size);
+        threadscan_numa_bind(replica, size, node);
+        dom->replicas[node] = replica;
     }
+    delta = replica - base;
+    *copy = *list;
 
-    return iterative_search(val, a, min, max);
-}
+    if (ENGINE_HASH == g_threadscan_engine) {
+        memcpy((char*)list->hash.slots + delta, list->hash.slots,
+               list->hash.n_slots * sizeof(size_t));
+        copy->hash.slots = (size_t*)((char*)list->hash.slots + delta);
+        return;
+    }
 
-/****************************************************************************/
-/*                            Search utilities.                             */
-/****************************************************************************/
+    // The addresses, padded out to a whole node, and the levels above them.
+    memcpy(replica, base,
+           (dom->n_addrs + SCAN_INDEX_FANOUT - 1) / SCAN_INDEX_FANOUT
+           * SCAN_INDEX_FANOUT * sizeof(size_t));
+    memcpy((char*)dom->buf_index + delta, dom->buf_index,
+           threadscan_scan_index_size(dom->n_addrs) * sizeof(size_t));
+    copy->addrs = (size_t*)replica;
+    for (i = 0; i < list->index.n_levels; ++i) {
+        copy->index.levels[i] = (size_t*)((char*)list->index.levels[i]
+                                          + delta);
+    }
+}
 
-static void do_search (size_t *mem, size_t range_size)
+/**
+ * Point the reclaimer's node at the search list that was just built, and
+ * give the other nodes copies of it.
+ */
+static void replicate_search_list (threadscan_domain_t *dom)
 {
-    size_t i;
-    size_t min_ptr, max_ptr;
+    int home = threadscan_thread_get_td()->numa_node, node;
+    search_list_t *list = &dom->lists[home];
 
-    min_ptr = g_tsdata.buf_addrs[0];
-    max_ptr = g_tsdata.buf_addrs[g_tsdata.n_addrs - 1];
+    list->addrs = dom->buf_addrs;
+    list->index = dom->index;
+    list->hash = dom->hash;
 
-    assert(min_ptr <= max_ptr);
-
-    for (i = 0; i < range_size; ++i) {
-        size_t cmp = PTR_MASK(mem[i]);
+    for (node = 0; node < dom->n_nodes; ++node) {
+        if (node != home) copy_search_list(dom, node, list);
+    }
+}
 
-        // PTR_MASK catches pointers that have been hidden through overloading
-        // the two low-order bits.
+/**
+ * With soft-dirty tracking, the page caches only keep words that could be
+ * addresses in [cache_low, cache_high].  If this round's addresses aren't
+ * all in there, widen it, and read every page to fill the caches again.
+ */
+static void plan_page_caches (threadscan_domain_t *dom)
+{
+    size_t span, low;
 
-        if (cmp < min_ptr || cmp > max_ptr) continue;
-        if (min_ptr == cmp) {
-            SET_LOW_BIT(&g_tsdata.buf_addrs[0]);
-            continue;
-        } else if (max_ptr == cmp) {
-            SET_LOW_BIT(&g_tsdata.buf_addrs[g_tsdata.n_addrs - 1]);
-            continue;
-        }
+    if (!dom->soft_dirty
+        || (dom->min_ptr >= dom->cache_low
+            && dom->max_ptr <= dom->cache_high)) {
+        return;
+    }
 
-        // Level 1 search: Find the page the address would be on.
-        int v = binary_search(cmp, g_tsdata.buf_scan_map, 0,
-                              g_tsdata.n_scan_map);
-        // Level 2 search: Find the address within the page.
-        int loc = binary_search(cmp, g_tsdata.buf_addrs,
-                                v * (PAGESIZE / sizeof(size_t)),
-                                v == g_tsdata.n_scan_map - 1
-                                ? g_tsdata.n_addrs
-                                : (v + 1) * (PAGESIZE / sizeof(size_t)));
-        if (g_tsdata.buf_addrs[loc] == cmp) {
-            SET_LOW_BIT(&g_tsdata.buf_addrs[loc]);
-        }
-#ifndef NDEBUG
-        else {
-            int loc2 = binary_search(cmp, g_tsdata.buf_addrs,
-                                     0, g_tsdata.n_addrs);
-            assert(g_tsdata.buf_addrs[loc2] != cmp);
-        }
-#endif
+    // Leave room for the heap to grow, so it doesn't happen every round.
+    span = dom->max_ptr - dom->min_ptr + PAGESIZE;
+    low = dom->min_ptr > span ? dom->min_ptr - span : 0;
+    dom->cache_low = MIN_OF(dom->cache_low, low);
+    if (dom->max_ptr + span > dom->cache_high) {
+        dom->cache_high = dom->max_ptr + span;
     }
+    dom->search_all = 1;
 }
 
-static void search_range (mem_range_t *mem_range)
+/**
+ * Make sure every thread has a mark bitmap big enough for this round.  The
+ * bitmaps only grow, a page at a time, so this rarely allocates.
+ */
+static void size_mark_bitmaps (threadscan_domain_t *dom)
 {
-    size_t *mem;
+    size_t words = MARK_WORD(dom->n_slots) + 1;
+    thread_list_t *thread_list = threadscan_proc_get_thread_list();
+    thread_data_t *td;
 
-    assert(mem_range);
+    words = (words * sizeof(size_t) + PAGESIZE - 1) / PAGESIZE
+        * PAGESIZE / sizeof(size_t);
 
-    mem = (size_t*)mem_range->low;
-    assert_monotonicity(g_tsdata.buf_addrs, g_tsdata.n_addrs);
-    do_search(mem, (mem_range->high - mem_range->low) / sizeof(size_t));
-    return;
+    FOREACH_IN_THREAD_LIST(td, thread_list)
+        domain_member_t *member = &td->members[dom->base.id];
+        if (IS_MEMBER(td, dom->base.id) && member->marks_words < words) {
+            if (member->marks) threadscan_alloc_munmap(member->marks);
+            member->marks = (size_t*)threadscan_alloc_mmap(words
+                                                           * sizeof(size_t));
+            threadscan_numa_bind(member->marks, words * sizeof(size_t),
+                                 td->numa_node);
+            member->marks_words = words;
+        }
+    ENDFOREACH_IN_THREAD_LIST(td, thread_list);
 }
 
-/****************************************************************************/
-/*                           Post-search analysis                           */
-/****************************************************************************/
+/**
+ * OR the marks of every thread into buf_marks, and clear them for the next
+ * round.  A thread that left the domain during the round may have marked,
+ * too.
+ */
+static void gather_marks (threadscan_domain_t *dom)
+{
+    thread_list_t *thread_list = threadscan_proc_get_thread_list();
+    thread_data_t *td;
+
+    FOREACH_IN_THREAD_LIST(td, thread_list)
+        domain_member_t *member = &td->members[dom->base.id];
+        if (member->mark_low <= member->mark_high) {
+            threadscan_scan_bitmap_merge(&dom->buf_marks[member->mark_low],
+                                         &member->marks[member->mark_low],
+                                         member->mark_high
+                                         - member->mark_low + 1);
+            member->mark_low = ~(size_t)0;
+            member->mark_high = 0;
+        }
+    ENDFOREACH_IN_THREAD_LIST(td, thread_list);
+}
 
-static int handle_unreferenced_ptrs (size_t *addrs, int count)
+/**
+ * Move the addresses in the hash set to the front of addrs and return how
+ * many there are.  Their marks move along with them, from slot to position,
+ * in the same bitmap: the position is never past the slot.
+ */
+static int compact_hash (scan_hash_t *hash, size_t *marks, size_t *addrs)
 {
-    int write_position;
-    int i;
+    size_t i;
+    int n = 0;
 
-    write_position = 0;
-    for (i = 0; i < count; ++i) {
-        if (addrs[i] & 1) {              // Outstanding reference.
-            addrs[write_position] = PTR_MASK(addrs[i]);
-            addrs[i] = 0;
-            ++write_position;
-        } else {                         // No remaining references.
-            free((void*)addrs[i]);
-            addrs[i] = 0;
+    for (i = 0; i < hash->n_slots; ++i) {
+        if (hash->slots[i] != 0) {
+            if (IS_MARKED(marks, i)) {
+                marks[MARK_WORD(n)] |= MARK_BIT(n);
+            } else {
+                marks[MARK_WORD(n)] &= ~MARK_BIT(n);
+            }
+            addrs[n++] = hash->slots[i];
         }
     }
 
-    return write_position;
+    return n;
 }
 
 /****************************************************************************/
-/*                             Cleanup thread.                              */
+/*                            Search utilities.                             */
 /****************************************************************************/
 
-static void do_reclaim (size_t rsp, do_reclaim_arg_t *do_reclaim_arg)
+/**
+ * Record that the address at position loc of the search list was found.
+ */
+static void mark (threadscan_domain_t *dom, thread_data_t *td, size_t loc)
 {
-    int sig_count;
-    mem_range_t user_stack = threadscan_thread_user_stack();
-    mem_range_t stack_search_range = { rsp, user_stack.high };
-    mem_range_t *local_block = &threadscan_thread_get_td()->local_block;
-
-    // Signal all of the threads that a scan is about to happen.
-    self_stacks_searched = 0;
-    sig_count = threadscan_thread_signal_all_but_me(SIGTHREADSCAN);
-
-    // Check my stack for references.
-    search_range(&stack_search_range);
-
-    // Search the local region, if it's been set.
-    if (local_block->low > 0) {
-        search_range(local_block);
-    }
-
-    while (self_stacks_searched < sig_count) {
-        __sync_synchronize(); // mfence.
+    domain_member_t *member = &td->members[dom->base.id];
+    size_t word = MARK_WORD(loc);
+
+    if (word >= member->marks_words) {
+        // This thread started, or joined the domain, after the bitmaps were
+        // sized for the round.  Mark the gathered bitmap directly; nobody
+        // else writes to it until the scan is over.
+        __sync_fetch_and_or(&dom->buf_marks[word], MARK_BIT(loc));
+        return;
     }
 
-    do_reclaim_arg->addrs = g_tsdata.buf_addrs;
-    do_reclaim_arg->count = g_tsdata.n_addrs;
+    member->marks[word] |= MARK_BIT(loc);
+    if (word < member->mark_low) member->mark_low = word;
+    if (word > member->mark_high) member->mark_high = word;
 }
 
-static void threadscan_reclaim ()
+/**
+ * Look up a batch of candidate addresses, which are known to be in the range
+ * of the search list, and mark the ones that are there.  The search list,
+ * itself, is only read.
+ */
+static void search_candidates (threadscan_domain_t *dom, thread_data_t *td,
+                               const search_list_t *list, size_t *candidates,
+                               int count)
 {
-    size_t rsp;
+    int locs[SCAN_BLOCK];
+    int i;
+
+    if (ENGINE_HASH == g_threadscan_engine) {
+        threadscan_scan_hash_find(&list->hash, candidates, count, locs);
+        for (i = 0; i < count; ++i) {
+            if (locs[i] >= 0) {
+                mark(dom, td, locs[i]);
+            }
+        }
+        return;
+    }
+
+    threadscan_scan_index_find(&list->index, candidates, count, locs);
+
+    for (i = 0; i < count; ++i) {
+        size_t *addr = &list->addrs[locs[i]];
+        if (PTR_MASK(*addr) == candidates[i]) {
+            mark(dom, td, locs[i]);
+        }
+        assert(PTR_MASK(*addr) <= candidates[i]);
+        assert(locs[i] + 1 == dom->n_addrs
+               || PTR_MASK(addr[1]) > candidates[i]);
+    }
+}
+
+static void do_search (threadscan_domain_t *dom, thread_data_t *td,
+                       size_t *mem, size_t range_size)
+{
+    size_t candidates[SCAN_BLOCK + SCAN_FILTER_SLACK];
+    size_t i;
+    size_t min_ptr, max_ptr;
+
+    // The searching thread, which isn't td for a parked thread, reads the
+    // search list on its own node.
+    const search_list_t *list =
+        &dom->lists[threadscan_thread_get_td()->numa_node];
+
+    min_ptr = dom->min_ptr;
+    max_ptr = dom->max_ptr;
+
+    assert(min_ptr <= max_ptr);
+
+    // Most words on a stack aren't in the range of collected addresses.  The
+    // filter throws those out a vector at a time (PTR_MASK catches pointers
+    // that have been hidden through overloading the two low-order bits), and
+    // the survivors get searched for in batches.
+    for (i = 0; i < range_size; i += SCAN_BLOCK) {
+        int count = threadscan_scan_filter(&mem[i],
+                                           MIN_OF(SCAN_BLOCK, range_size - i),
+                                           min_ptr, max_ptr, candidates);
+        if (count > 0) {
+            search_candidates(dom, td, list, candidates, count);
+        }
+    }
+}
+
+static void search_range (threadscan_domain_t *dom, thread_data_t *td,
+                          mem_range_t *mem_range)
+{
+    size_t *mem;
+
+    assert(mem_range);
+
+    mem = (size_t*)mem_range->low;
+    do_search(dom, td, mem,
+              (mem_range->high - mem_range->low) / sizeof(size_t));
+    return;
+}
+
+/**
+ * Search a range, and fill the page cache next with the words of its whole
+ * pages that could be addresses.  Pages that are in the cache prev and
+ * haven't been written since aren't read; their cached words are searched
+ * instead.  The first skip bytes, and partial pages at the ends, are always
+ * read.
+ */
+static void search_range_cached (threadscan_domain_t *dom, thread_data_t *td,
+                                 mem_range_t *mem_range, page_cache_t *prev,
+                                 page_cache_t *next, size_t skip)
+{
+    size_t first = PAGEALIGN(mem_range->low + skip + PAGESIZE - 1);
+    size_t last = PAGEALIGN(mem_range->high);
+    int reuse = !dom->search_all && prev->epoch == dom->read_epoch;
+    size_t n_pages, skipped = 0;
+    size_t i, page;
+    mem_range_t edge;
+
+    if (first >= last) {
+        next->epoch = 0;
+        search_range(dom, td, mem_range);
+        return;
+    }
+
+    n_pages = (last - first) / PAGESIZE;
+    threadscan_dirty_reserve(next, n_pages, 0);
+    next->low = first;
+    next->n_pages = n_pages;
+    next->n_words = 0;
+    for (i = 0, page = first; i < n_pages; ++i, page += PAGESIZE) {
+        size_t j = (page - prev->low) / PAGESIZE;
+
+        next->start[i] = next->n_words;
+        if (reuse && page >= prev->low && j < prev->n_pages
+            && !prev->dirty[j]) {
+            // Clean.  Take its words from the cache.
+            size_t n = prev->start[j + 1] - prev->start[j];
+            threadscan_dirty_reserve(next, n_pages, next->n_words + n);
+            memcpy(&next->words[next->n_words], &prev->words[prev->start[j]],
+                   n * sizeof(size_t));
+            next->n_words += n;
+            ++skipped;
+        } else {
+            threadscan_dirty_reserve(next, n_pages, next->n_words
+                                     + PAGE_WORDS + SCAN_FILTER_SLACK);
+            next->n_words +=
+                threadscan_scan_filter((size_t*)page, PAGE_WORDS,
+                                       dom->cache_low,
+                                       dom->cache_high,
+                                       &next->words[next->n_words]);
+        }
+    }
+    next->start[n_pages] = next->n_words;
+    next->epoch = dom->dirty_epoch;
+
+    edge.low = mem_range->low;
+    edge.high = first;
+    search_range(dom, td, &edge);
+    if (last < mem_range->high) {
+        edge.low = last;
+        edge.high = mem_range->high;
+        search_range(dom, td, &edge);
+    }
+    do_search(dom, td, next->words, next->n_words);
+
+    __sync_fetch_and_add(&g_stats.pages_read, n_pages - skipped);
+    __sync_fetch_and_add(&g_stats.pages_skipped, skipped);
+}
+
+/**
+ * Search a thread's stack, from sp up, and its local blocks.  It's either
+ * the calling thread, or a parked thread the caller is searching for it.
+ */
+static void search_thread_memory (threadscan_domain_t *dom, thread_data_t *td,
+                                  size_t sp)
+{
+    mem_range_t stack_search_range = { sp, (size_t)td->user_stack_high };
+    int cur = td->cache_cur;
+    int i;
+
+    // Search the stack for incriminating references.
+    if (dom->soft_dirty) {
+        search_range_cached(dom, td, &stack_search_range,
+                            &td->stack_cache[cur], &td->stack_cache[!cur],
+                            SELF_FRAMES_SIZE);
+    } else {
+        search_range(dom, td, &stack_search_range);
+    }
+
+    // Search the local blocks that have been registered.
+    for (i = 0; i < td->n_local_blocks; ++i) {
+        local_block_t *block = &td->local_blocks[i];
+        if (0 == block->range.low) continue;
+        if (dom->soft_dirty) {
+            search_range_cached(dom, td, &block->range, &block->cache[cur],
+                                &block->cache[!cur], 0);
+        } else {
+            search_range(dom, td, &block->range);
+        }
+    }
+    if (dom->soft_dirty) td->cache_cur = !cur;
+}
+
+/**
+ * Before the soft-dirty bits are cleared, note which pages of a thread's
+ * caches have been written since they were filled.
+ */
+static void read_dirty_bits (threadscan_domain_t *dom, thread_data_t *td)
+{
+    int cur = td->cache_cur;
+    int i;
+
+    if (dom->search_all) return; // Everything gets read, anyway.
+
+    if (td->stack_cache[cur].epoch == dom->dirty_epoch) {
+        threadscan_dirty_read(&td->stack_cache[cur]);
+    }
+    for (i = 0; i < td->n_local_blocks; ++i) {
+        local_block_t *block = &td->local_blocks[i];
+        if (block->range.low > 0
+            && block->cache[cur].epoch == dom->dirty_epoch) {
+            threadscan_dirty_read(&block->cache[cur]);
+        }
+    }
+}
+
+/****************************************************************************/
+/*                           Post-search analysis                           */
+/****************************************************************************/
+
+/**
+ * Add a reclaim function call to td's list of them.
+ */
+static void ready_push (thread_data_t *td, const reclaim_record_t *rec)
+{
+    if (td->n_ready == td->ready_capacity) {
+        size_t capacity = td->ready_capacity > 0
+            ? td->ready_capacity * 2 : READY_MIN_CAPACITY;
+        reclaim_record_t *ready = (reclaim_record_t*)
+            threadscan_alloc_mmap(capacity * sizeof(reclaim_record_t));
+        if (td->ready) {
+            memcpy(ready, td->ready, td->n_ready * sizeof(reclaim_record_t));
+            threadscan_alloc_munmap(td->ready);
+        }
+        td->ready = ready;
+        td->ready_capacity = capacity;
+    }
+    td->ready[td->n_ready++] = *rec;
+}
+
+/**
+ * Free n unreferenced pointers, or give them to the helpers on their NUMA
+ * nodes, if there are any, in frees.
+ */
+static void free_batch (numa_frees_t *frees, const size_t *ptrs, int n)
+{
+    int i;
+
+    if (frees) {
+        threadscan_numa_free(frees, ptrs, n);
+        return;
+    }
+    for (i = 0; i < n; ++i) free((void*)ptrs[i]);
+}
+
+/**
+ * Reclaim n unreferenced pointers.  Those with reclaim functions, their own
+ * or the default, go on td's list to be called once the round is done.
+ * The rest are free'd.
+ */
+static void reclaim_batch (thread_data_t *td, numa_frees_t *frees,
+                           const size_t *ptrs, int n)
+{
+    reclaim_record_t recs[RECLAIM_BATCH];
+    size_t plain[RECLAIM_BATCH];
+    int i, n_plain = 0;
+
+    threadscan_reclaim_map_take(ptrs, n, recs);
+    for (i = 0; i < n; ++i) {
+        if (NULL == recs[i].fn) {
+            if (NULL == g_default_fn) {
+                plain[n_plain++] = recs[i].ptr;
+                continue;
+            }
+            recs[i].fn = g_default_fn;
+            recs[i].ctx = g_default_ctx;
+        }
+        ready_push(td, &recs[i]);
+    }
+    free_batch(frees, plain, n_plain);
+}
+
+/**
+ * Call the reclaim functions on td's list.  They may collect more pointers,
+ * and if that fills td's pointer list, td reclaims from inside one of them.
+ * The functions that round finds only go on the list, and this loop gets
+ * to them, so rounds never nest more than one deep.
+ */
+static __attribute__((noinline)) void run_reclaim_fns (thread_data_t *td)
+{
+    if (td->in_callbacks) return; // Already in this loop, further up.
+
+    td->in_callbacks = 1;
+    while (td->n_ready > 0) {
+        reclaim_record_t rec = td->ready[--td->n_ready];
+        rec.fn((void*)rec.ptr, rec.ctx);
+    }
+    td->in_callbacks = 0;
+}
+
+/**
+ * Free, or queue the reclaim functions of, the addresses that weren't
+ * marked, and compact the rest to the front of addrs.  Kept out of line,
+ * like run_reclaim_fns(): threadscan_reclaim()'s frame is searched by the
+ * next round on this stack, and a batch of addresses left in it would keep
+ * whatever is allocated at them next from being reclaimed.
+ */
+static __attribute__((noinline)) int
+handle_unreferenced_ptrs (thread_data_t *td, size_t *addrs, size_t *marks,
+                          int count)
+{
+    size_t freed[GEN_COUNT] = { 0 }, survived[GEN_COUNT] = { 0 };
+    size_t batch[RECLAIM_BATCH];
+    int n_batch = 0;
+    int write_position;
+    int i;
+    numa_frees_t node_frees, *frees = NULL;
+
+    // Unless there are reclaim functions, everything gets free'd right here.
+    // With node helpers, it all goes in batches, instead, to be handed to
+    // them.
+    int plain = NULL == g_default_fn && threadscan_reclaim_map_is_empty();
+    if (threadscan_numa_helpers_running()) {
+        memset(&node_frees, 0, sizeof(node_frees));
+        frees = &node_frees;
+    }
+
+    write_position = 0;
+    for (i = 0; i < count; ++i) {
+        if (IS_MARKED(marks, i)) {       // Outstanding reference.
+            ++survived[GEN_OF(addrs[i])];
+            addrs[write_position] = addrs[i];
+            if (write_position != i) addrs[i] = 0;
+            ++write_position;
+        } else {                         // No remaining references.
+            ++freed[GEN_OF(addrs[i])];
+            if (plain && !frees) {
+                free((void*)PTR_MASK(addrs[i]));
+            } else {
+                batch[n_batch++] = PTR_MASK(addrs[i]);
+                if (RECLAIM_BATCH == n_batch) {
+                    if (plain) free_batch(frees, batch, n_batch);
+                    else reclaim_batch(td, frees, batch, n_batch);
+                    n_batch = 0;
+                }
+            }
+            addrs[i] = 0;
+        }
+    }
+    if (n_batch > 0) {
+        if (plain) free_batch(frees, batch, n_batch);
+        else reclaim_batch(td, frees, batch, n_batch);
+    }
+    if (frees) threadscan_numa_flush(frees);
+
+    for (i = 0; i < GEN_COUNT; ++i) {
+        __sync_fetch_and_add(&g_stats.gen[i].freed, freed[i]);
+        __sync_fetch_and_add(&g_stats.gen[i].survived, survived[i]);
+    }
+
+    return write_position;
+}
+
+/****************************************************************************/
+/*                             Cleanup thread.                              */
+/****************************************************************************/
+
+/**
+ * The reclaimer searches the memory of the threads it found parked, in
+ * their places.  With soft-dirty tracking, it first notes their written
+ * pages, before the bits are cleared, as they would have.
+ */
+static void read_parked_dirty_bits (threadscan_domain_t *dom)
+{
+    thread_list_t *thread_list = threadscan_proc_get_thread_list();
+    thread_data_t *td;
+
+    FOREACH_IN_THREAD_LIST(td, thread_list)
+        if (td->members[dom->base.id].parked) read_dirty_bits(dom, td);
+    ENDFOREACH_IN_THREAD_LIST(td, thread_list);
+}
+
+/**
+ * Return whether to clear the soft-dirty bits this round.  Clearing them
+ * walks the page tables of the whole process, so it's skipped when the
+ * next round reads every page anyway, and when the bits were cleared less
+ * than THREADSCAN_SOFT_DIRTY_INTERVAL ago.  The caches are still good
+ * without it: a page reads as dirty if it was written since the last
+ * clear, which came before the cache was filled.  A page written before
+ * this round just reads as dirty until the next clear.
+ */
+static int should_clear_dirty_bits (threadscan_domain_t *dom)
+{
+    struct timespec now;
+    long elapsed_ms;
+
+    if ((dom->round + 1) % g_threadscan_old_gen_interval == 0) return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ms = (now.tv_sec - dom->last_clear.tv_sec) * 1000
+        + (now.tv_nsec - dom->last_clear.tv_nsec) / 1000000;
+    if (elapsed_ms < g_threadscan_soft_dirty_interval) return 0;
+    dom->last_clear = now;
+    return 1;
+}
+
+static void search_parked_threads (threadscan_domain_t *dom)
+{
+    thread_list_t *thread_list = threadscan_proc_get_thread_list();
+    thread_data_t *td;
+
+    FOREACH_IN_THREAD_LIST(td, thread_list)
+        domain_member_t *member = &td->members[dom->base.id];
+        if (member->parked) {
+            search_thread_memory(dom, td, td->park_sp);
+            __sync_fetch_and_add(&g_stats.parked, 1);
+
+            // Let the thread go, if it has woken up.
+            member->parked = 0;
+            __sync_synchronize(); // mfence.
+            td->park_state = THREAD_PARKED;
+            threadscan_util_wake(&td->park_wq);
+        }
+    ENDFOREACH_IN_THREAD_LIST(td, thread_list);
+}
+
+/**
+ * Return whether all the threads asked to search have added themselves to
+ * the counter of the answer_wait_t at arg.
+ */
+static int all_answered (void *arg)
+{
+    answer_wait_t *wait = (answer_wait_t*)arg;
+    return *wait->counter >= wait->dom->n_requested;
+}
+
+/**
+ * Threads asked to search have added n to counter: themselves, or a whole
+ * subtree of the signalling tree.  Wake the reclaimer if they're the last.
+ */
+static void answer (threadscan_domain_t *dom, volatile int *counter, int n)
+{
+    if (__sync_add_and_fetch(counter, n) >= dom->n_requested) {
+        threadscan_util_wake(&dom->handshake_wq);
+    }
+}
+
+/**
+ * Wait for the threads asked to search to have added themselves to
+ * *counter.  In safepoint mode, the threads that haven't taken this round's
+ * request by the deadline are signalled.
+ */
+static void wait_for_threads (threadscan_domain_t *dom,
+                              volatile int *counter,
+                              const struct timespec *deadline,
+                              int *signalled)
+{
+    answer_wait_t wait = { dom, counter };
+
+    if (dom->safepoint && !*signalled) {
+        if (threadscan_util_wait(&dom->handshake_wq, all_answered, &wait,
+                                 deadline)) {
+            return;
+        }
+        __sync_fetch_and_add(&g_stats.signals,
+                             threadscan_proc_signal_requested
+                             (&dom->base, dom->round, SIGTHREADSCAN));
+        *signalled = 1;
+    }
+    threadscan_util_wait(&dom->handshake_wq, all_answered, &wait, NULL);
+}
+
+static void do_reclaim (threadscan_domain_t *dom, size_t rsp,
+                        do_reclaim_arg_t *do_reclaim_arg)
+{
+    int thread_count, sig_count, signalled = 0;
+    struct timespec deadline = { 0, 0 }, start, end;
+    thread_data_t *td = threadscan_thread_get_td();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Tell all of the threads that a scan is about to happen.  Either
+    // signal them, or let them find out at their next safepoints, and only
+    // signal the ones that haven't by the deadline.
+    dom->self_stacks_searched = 0;
+    dom->dirty_reads = 0;
+    dom->n_requested = INT_MAX;
+    if (dom->safepoint) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += (long)g_threadscan_safepoint_timeout * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+    }
+    thread_count =
+        threadscan_thread_request_scan_all_but_me(&dom->base, dom->round,
+                                                  SIGTHREADSCAN,
+                                                  dom->safepoint,
+                                                  &sig_count);
+    dom->n_requested = thread_count;
+    if (dom->safepoint) threadscan_safepoint_round = dom->round;
+    __sync_fetch_and_add(&g_stats.signals, sig_count);
+    if (dom->safepoint) {
+        // Threads waiting on the round have a safepoint to answer.
+        threadscan_util_wake(&g_threadscan_reclaim_wq);
+    }
+
+    if (dom->soft_dirty) {
+        // Every thread notes which of its pages have been written since the
+        // last round.  Then the bits are cleared, and the threads search.
+        // Anything written after a thread's search is dirty next round.
+        read_dirty_bits(dom, td);
+        read_parked_dirty_bits(dom);
+        wait_for_threads(dom, &dom->dirty_reads, &deadline, &signalled);
+        dom->read_epoch = dom->dirty_epoch;
+        if (should_clear_dirty_bits(dom)) {
+            threadscan_dirty_clear();
+            ++dom->dirty_epoch;
+            __sync_fetch_and_add(&g_stats.dirty_clears, 1);
+        }
+        ++dom->dirty_rounds;
+        threadscan_util_wake(&dom->dirty_wq);
+    }
+
+    // Check my stack and local blocks for references, and those of the
+    // parked threads.
+    search_thread_memory(dom, td, rsp);
+    search_parked_threads(dom);
+
+    wait_for_threads(dom, &dom->self_stacks_searched, &deadline, &signalled);
+    if (dom->safepoint) threadscan_safepoint_round = 0;
+    threadscan_proc_release_fanout(&dom->base);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    __sync_fetch_and_add(&g_stats.handshake_ns,
+                         (end.tv_sec - start.tv_sec) * 1000000000
+                         + end.tv_nsec - start.tv_nsec);
+    __sync_fetch_and_add(&g_stats.handshakes, 1);
+
+    // Every thread marked what it found in its own bitmap.  Put them
+    // together.
+    gather_marks(dom);
+
+    do_reclaim_arg->addrs = dom->buf_addrs;
+    do_reclaim_arg->marks = dom->buf_marks;
+    do_reclaim_arg->count = dom->n_addrs;
+    do_reclaim_arg->hashed = ENGINE_HASH == g_threadscan_engine;
+    do_reclaim_arg->hash = dom->hash;
+    do_reclaim_arg->bytes = dom->round_bytes;
+}
+
+static void threadscan_reclaim (threadscan_domain_t *dom)
+{
+    size_t rsp;
     do_reclaim_arg_t do_reclaim_arg;
-    void *working_memory;
+    char *working_memory;
+    size_t working_size;
+    int grace;
+
+    GET_STACK_POINTER(rsp);
+
+    dom->working_memory = take_working_space(dom);
+    assign_working_space(dom, dom->working_memory);
+    dom->n_addrs = generate_working_pointers_list(dom);
+
+    // The list may have outgrown the buffer.  The next round can start once
+    // this one releases the lock, so hold on to the one that was used.
+    working_memory = dom->working_memory;
+    working_size = dom->working_buffer_sz;
+    if (0 == dom->n_addrs) {
+        // Nothing to collect.  The collector's timer can go off when no
+        // pointers have been collected since the last round.
+        size_t bytes = dom->round_bytes;
+        threadscan_thread_cleanup_release(&dom->base);
+        __sync_fetch_and_sub(&dom->bytes_in_flight, bytes);
+        threadscan_util_wake(&g_threadscan_reclaim_wq);
+        return_working_space(dom, working_memory, working_size);
+        return;
+    }
+
+    grace = dom->grace;
+    if (grace) {
+        // Every thread has been outside an operation since these pointers
+        // were collected, so none of them is referenced.  With no marks
+        // set, every pointer gets free'd.
+        clear_marks(dom, dom->n_addrs);
+        do_reclaim_arg.addrs = dom->buf_addrs;
+        do_reclaim_arg.marks = dom->buf_marks;
+        do_reclaim_arg.count = dom->n_addrs;
+        do_reclaim_arg.hashed = 0;
+        do_reclaim_arg.bytes = dom->round_bytes;
+        threadscan_thread_cleanup_release(&dom->base);
+        __sync_fetch_and_add(&g_stats.epoch_rounds, 1);
+    } else {
+        // Build the search index: a static B-tree over buf_addrs whose nodes
+        // are each a cache line.  A lookup touches one node per level, and
+        // the upper levels are small enough to stay in cache.  Or, with the
+        // hash engine, a hash set of the addresses.
+        generate_scan_index(dom);
+        clear_marks(dom, dom->n_slots);
+        replicate_search_list(dom);
+        plan_page_caches(dom);
+        size_mark_bitmaps(dom);
+
+        do_reclaim(dom, rsp, &do_reclaim_arg);
+        threadscan_thread_cleanup_release(&dom->base);
+    }
+
+    if (do_reclaim_arg.hashed) {
+        // Gather the marked addresses out of the hash set.  buf_addrs is
+        // free for reuse since the hash set is a copy of it.
+        do_reclaim_arg.count = compact_hash(&do_reclaim_arg.hash,
+                                            do_reclaim_arg.marks,
+                                            do_reclaim_arg.addrs);
+    } else if (!grace) {
+        assert_monotonicity(do_reclaim_arg.addrs, do_reclaim_arg.count);
+    }
+
+    // Check for pointers to free.  w00t!
+    int remaining =
+        handle_unreferenced_ptrs(threadscan_thread_get_td(),
+                                 do_reclaim_arg.addrs, do_reclaim_arg.marks,
+                                 do_reclaim_arg.count);
+    __sync_fetch_and_sub(&dom->bytes_in_flight, do_reclaim_arg.bytes);
+    threadscan_util_wake(&g_threadscan_reclaim_wq);
+
+    // There may be some remaining pointers that could not be free'd.  They
+    // should be stored for the next round, and will be searched again until
+    // there are no outstanding references to them.  With the sort engine
+    // they are still sorted, so the next round only has to merge them in.
+    // Those that keep surviving are searched for less often.
+    store_survivors(dom, do_reclaim_arg.addrs, remaining);
+    return_working_space(dom, working_memory, working_size);
+
+    // Last, call the reclaim functions.  They're user code, and they may
+    // collect more pointers.
+    run_reclaim_fns(threadscan_thread_get_td());
+}
+
+/****************************************************************************/
+/*                             Collector thread.                            */
+/****************************************************************************/
+
+/**
+ * Sleep until the interval has passed or a thread wakes the collector.
+ */
+static void collector_wait ()
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&g_collector.lock);
+    if (g_threadscan_collector_interval > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += g_threadscan_collector_interval / 1000;
+        deadline.tv_nsec +=
+            (long)(g_threadscan_collector_interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_nsec -= 1000000000;
+            ++deadline.tv_sec;
+        }
+    }
+    while (!g_collector.wake) {
+        if (g_threadscan_collector_interval == 0) {
+            pthread_cond_wait(&g_collector.cond, &g_collector.lock);
+        } else if (ETIMEDOUT == pthread_cond_timedwait(&g_collector.cond,
+                                                       &g_collector.lock,
+                                                       &deadline)) {
+            break;
+        }
+    }
+    g_collector.wake = 0;
+    pthread_mutex_unlock(&g_collector.lock);
+}
+
+/**
+ * Routine of the collector thread.  It's created through the pthread_create
+ * wrapper, so it's a thread like any other: it has a stack to search, and
+ * it can be signalled if it isn't the one reclaiming.
+ */
+static void *collector_main (void *arg)
+{
+    if (g_threadscan_collector_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(g_threadscan_collector_cpu, &cpus);
+        if (0 != sched_setaffinity(0, sizeof(cpus), &cpus)) {
+            threadscan_diagnostic("warning: unable to pin the collector to "
+                                  "CPU %d.\n", g_threadscan_collector_cpu);
+        }
+    }
+
+    while (1) {
+        collector_wait();
+        if (threadscan_thread_cleanup_try_acquire(&g_tsdata.base)) {
+            // reclaim() will release the cleanup lock.
+            threadscan_reclaim(&g_tsdata);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Wake the collector, if nobody else has.
+ */
+static void collector_wake ()
+{
+    if (g_collector.wake) return;
+
+    pthread_mutex_lock(&g_collector.lock);
+    g_collector.wake = 1;
+    pthread_cond_signal(&g_collector.cond);
+    pthread_mutex_unlock(&g_collector.lock);
+}
+
+/**
+ * Called after td collects a pointer, when there's a collector.  Wake it if
+ * td's list is past the watermark.
+ */
+static void collector_poke (thread_data_t *td)
+{
+    if (threadscan_queue_length(&td->members[DEFAULT_DOMAIN].ptr_list)
+        >= g_collector.watermark) {
+        collector_wake();
+    }
+}
+
+/****************************************************************************/
+/*                             Pressure monitor.                            */
+/****************************************************************************/
+
+/**
+ * Routine of the pressure monitor thread.  While memory is short, it starts
+ * a round every time it checks, and threads reclaim with fewer pointers on
+ * their lists.
+ */
+static void *pressure_main (void *arg)
+{
+    struct timespec interval;
+
+    while (1) {
+        // Scans interrupt the sleep, so sleep out whatever is left of it.
+        interval.tv_sec = g_threadscan_pressure_interval / 1000;
+        interval.tv_nsec =
+            (long)(g_threadscan_pressure_interval % 1000) * 1000000;
+        while (-1 == nanosleep(&interval, &interval) && EINTR == errno);
+
+        g_under_pressure = threadscan_pressure_poll();
+        if (g_under_pressure
+            && threadscan_thread_cleanup_try_acquire(&g_tsdata.base)) {
+            ++g_stats.pressure_rounds;
+            // reclaim() will release the cleanup lock.
+            threadscan_reclaim(&g_tsdata);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the threads the library runs for itself.  They're created through
+ * the pthread_create wrapper, so the first call to collect does it, once
+ * the process is up.
+ */
+static void start_threads ()
+{
+    pthread_t thread;
+
+    if (!BCAS(&g_threads_started, 0, 1)) return;
+
+    if (g_threadscan_collector) {
+        if (0 != pthread_create(&thread, NULL, collector_main, NULL)) {
+            threadscan_fatal("threadscan: unable to start the collector.\n");
+        }
+        pthread_detach(thread);
+    }
+
+    if (g_threadscan_numa_helpers) threadscan_numa_start_helpers();
+
+    if (g_threadscan_pressure && threadscan_pressure_init()) {
+        if (0 != pthread_create(&thread, NULL, pressure_main, NULL)) {
+            threadscan_fatal("threadscan: unable to start the pressure "
+                             "monitor.\n");
+        }
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * Return whether a thread waiting on a reclamation should stop: its wait is
+ * over, there's no reclamation to wait on, or it can help with one.
+ */
+static int stop_waiting (void *arg)
+{
+    reclaim_wait_t *wait = (reclaim_wait_t*)arg;
+
+    return wait->done(wait->arg)
+        || (wait->dom
+            && !threadscan_thread_cleanup_in_progress(&wait->dom->base))
+        || (threadscan_safepoint_round
+            && wait->td->members[DEFAULT_DOMAIN].scan_request)
+        || threadscan_util_sort_pending();
+}
+
+/**
+ * Help the round that wait is on, or sleep until stop_waiting() says not
+ * to.  Waiting is a safepoint, so a round waiting on this thread's search
+ * gets it before and after.
+ */
+static void wait_on_round (reclaim_wait_t *wait)
+{
+    if (threadscan_safepoint_round) {
+        threadscan_safepoint_poll();
+    }
+    if (!threadscan_util_sort_help()) {
+        threadscan_util_wait(&g_threadscan_reclaim_wq, stop_waiting, wait,
+                             NULL);
+    }
+    if (threadscan_safepoint_round) {
+        threadscan_safepoint_poll();
+    }
+}
+
+/**
+ * Wait for reclamation in dom: do it, help with it, or get out of its way
+ * until done(arg) is true.
+ */
+static void reclaim_or_help (threadscan_domain_t *dom,
+                             int (*done) (void *), void *arg)
+{
+    reclaim_wait_t wait = { dom, done, arg, threadscan_thread_get_td() };
+
+    if (threadscan_thread_cleanup_try_acquire(&dom->base)) {
+        threadscan_reclaim(dom); // reclaim() will release the cleanup lock.
+        return;
+    }
+    wait_on_round(&wait);
+}
+
+/**
+ * Return whether the pointer list at arg has room, or under memory
+ * pressure, whether it's short enough.
+ */
+static int ptr_list_has_room (void *arg)
+{
+    queue_t *q = (queue_t*)arg;
+
+    return !threadscan_queue_is_full(q)
+        && !(g_under_pressure
+             && threadscan_queue_length(q) >= g_pressure_queue_limit);
+}
+
+/**
+ * td has put pointers on its list for dom.  Start the library's threads if
+ * this is the first time, and reclaim if the list is full.
+ */
+static void check_ptr_list (threadscan_domain_t *dom, thread_data_t *td)
+{
+    queue_t *q = &td->members[dom->base.id].ptr_list;
+
+    if (!g_threads_started) {
+        start_threads();
+    }
+    if (g_threadscan_collector && &g_tsdata == dom) {
+        collector_poke(td);
+    }
+
+    // With a collector, the list only fills up if the collector has fallen
+    // behind.  Then this thread helps, the same as without one.  Under
+    // memory pressure, it doesn't wait for the list to fill.
+    while (!ptr_list_has_room(q)) {
+        // While this thread's local queue of pointers is full, try to cleanup
+        // or help with cleanup.  If someone else has already started cleanup,
+        // this thread will break out of this loop soon enough.
+        reclaim_or_help(dom, ptr_list_has_room, q);
+    }
+}
+
+/**
+ * Interface for applications.  "Collecting" a pointer registers it with
+ * threadscan.  When a sweep of memory occurs, all registered pointers are
+ * sought in memory.  Any that can't be found are free()'d because no
+ * remaining threads have pointers to them.
+ */
+__attribute__((visibility("default")))
+void threadscan_collect (void *ptr)
+{
+    if (NULL == ptr) {
+        threadscan_diagnostic("Tried to collect NULL.\n");
+        return;
+    }
 
-    GET_STACK_POINTER(rsp);
+    thread_data_t *td = threadscan_thread_get_td();
+    // Add the pointer.
+    threadscan_queue_push(&td->members[DEFAULT_DOMAIN].ptr_list, (size_t)ptr);
+    check_ptr_list(&g_tsdata, td);
+}
 
-    working_memory = threadscan_alloc_mmap(g_tsdata.working_buffer_sz);
-    assign_working_space(working_memory);
-    g_tsdata.n_addrs = generate_working_pointers_list();
+/**
+ * Interface for applications.  Collect n pointers at once.  They go onto
+ * this thread's list a block at a time, and the list is only checked once
+ * per block.
+ */
+__attribute__((visibility("default")))
+void threadscan_collect_bulk (void **ptrs, size_t n)
+{
+    thread_data_t *td = threadscan_thread_get_td();
+    queue_t *q = &td->members[DEFAULT_DOMAIN].ptr_list;
+    size_t i = 0;
+
+    while (i < n) {
+        size_t room = q->capacity - 1 - threadscan_queue_length(q);
+        size_t count = MIN_OF(room, n - i);
+        size_t j;
+
+        // Stop the block short at a NULL, and skip it.
+        for (j = 0; j < count && NULL != ptrs[i + j]; ++j);
+        if (j < count) {
+            threadscan_diagnostic("Tried to collect NULL.\n");
+        }
 
-    // Sort the pointers and remove duplicates.
-    threadscan_util_sort(g_tsdata.buf_addrs, g_tsdata.n_addrs);
+        threadscan_queue_push_bulk(q, (size_t*)&ptrs[i], j);
+        i += j < count ? j + 1 : j;
+        check_ptr_list(&g_tsdata, td);
+    }
+}
 
-    // Populate the scan_map: a minimap for searching for addresses.  This map
-    // takes the first address on each page of memory and is used as a level 1
-    // search that indicates where an address would be in the buf_addrs list,
-    // if it's there at all.
-    generate_scan_map();
+/**
+ * Interface for applications.  Collect a pointer that's reclaimed by
+ * calling fn(ptr, ctx), instead of free().  The record goes in the reclaim
+ * map before the pointer goes on the list, so any round that has the
+ * pointer can find it.
+ */
+__attribute__((visibility("default")))
+void threadscan_collect_fn (void *ptr, reclaim_fn_t fn, void *ctx)
+{
+    if (NULL == ptr) {
+        threadscan_diagnostic("Tried to collect NULL.\n");
+        return;
+    }
 
-    do_reclaim(rsp, &do_reclaim_arg);
-    threadscan_thread_cleanup_release();
+    if (fn) {
+        threadscan_reclaim_map_insert((size_t)ptr, fn, ctx);
+    }
+    threadscan_collect(ptr);
+}
 
-    // Check for pointers to free.  w00t!
-    assert_monotonicity(do_reclaim_arg.addrs, do_reclaim_arg.count);
-    int remaining =
-        handle_unreferenced_ptrs(do_reclaim_arg.addrs,
-                                 do_reclaim_arg.count);
+/**
+ * Interface for applications.  Set the reclaim function for pointers that
+ * are collected without one.
+ */
+__attribute__((visibility("default")))
+void threadscan_set_reclaim_fn (reclaim_fn_t fn, void *ctx)
+{
+    g_default_ctx = ctx;
+    __sync_synchronize();
+    g_default_fn = fn;
+}
 
-    // There may be some remaining pointers that could not be free'd.  They
-    // should be stored for the next round, and will be searched again until
-    // there are no outstanding references to them.
-    threadscan_util_randomize(do_reclaim_arg.addrs, remaining);
-    store_remaining_addrs(do_reclaim_arg.addrs, remaining);
+/**
+ * Return whether the bytes collected and not yet free'd are within the
+ * budget.
+ */
+static int under_budget (void *arg)
+{
+    return g_threadscan_pending_bytes + g_tsdata.bytes_in_flight
+        < g_threadscan_byte_budget;
 }
 
 /**
- * Interface for applications.  "Collecting" a pointer registers it with
- * threadscan.  When a sweep of memory occurs, all registered pointers are
- * sought in memory.  Any that can't be found are free()'d because no
- * remaining threads have pointers to them.
+ * Return whether a thread waiting for a round to free its bytes should
+ * stop: they're within the budget, or the thread could start a round.
+ */
+static int budget_wait_over (void *arg)
+{
+    return under_budget(arg)
+        || g_threadscan_pending_bytes >= g_threadscan_byte_budget / 2;
+}
+
+/**
+ * Interface for applications.  Collect a pointer to an object of the given
+ * size.  The bytes count against a budget, and when there are too many
+ * waiting for reclamation, this thread doesn't return until a reclamation
+ * has taken them.
  */
 __attribute__((visibility("default")))
-void threadscan_collect (void *ptr)
+void threadscan_collect_sized (void *ptr, size_t bytes)
 {
+    thread_data_t *td = threadscan_thread_get_td();
+
     if (NULL == ptr) {
         threadscan_diagnostic("Tried to collect NULL.\n");
         return;
     }
 
-    thread_data_t *td = threadscan_thread_get_td();
-    threadscan_queue_push(&td->ptr_list, (size_t)ptr); // Add the pointer.
-    while (threadscan_queue_is_full(&td->ptr_list)) {
-        // While this thread's local queue of pointers is full, try to cleanup
-        // or help with cleanup.  If someone else has already started cleanup,
-        // this thread will break out of this loop soon enough.
+    td->bytes_collected += bytes;
+    threadscan_collect(ptr);
+
+    // Publish the bytes in chunks, so threads aren't all hammering the same
+    // counter.
+    if (td->bytes_collected - td->bytes_published >= g_tsdata.byte_chunk) {
+        __sync_fetch_and_add(&g_threadscan_pending_bytes,
+                             td->bytes_collected - td->bytes_published);
+        td->bytes_published = td->bytes_collected;
+    }
+
+    // The budget covers bytes that a round is still working on.  If those
+    // are most of it, wait for the round to free them rather than start
+    // another.  The round may be past releasing its lock, so the wait
+    // isn't on the lock.
+    while (!under_budget(NULL)) {
+        if (g_threadscan_pending_bytes < g_threadscan_byte_budget / 2) {
+            reclaim_wait_t wait = { NULL, budget_wait_over, NULL, td };
+            wait_on_round(&wait);
+        } else {
+            if (g_threadscan_collector) collector_wake();
+            reclaim_or_help(&g_tsdata, under_budget, NULL);
+        }
+    }
+}
+
+/**
+ * Return the calling thread's local block that starts at addr, or NULL.
+ */
+static local_block_t *find_local_block (thread_data_t *td, size_t addr)
+{
+    int i;
 
-        threadscan_thread_cleanup_try_acquire()
-            ? threadscan_reclaim() // reclaim() will release the cleanup lock.
-            : pthread_yield();
+    for (i = 0; i < td->n_local_blocks; ++i) {
+        if (td->local_blocks[i].range.low == addr) {
+            return &td->local_blocks[i];
+        }
     }
+    return NULL;
 }
 
+/**
+ * Interface for applications.  Add a block of memory to the ones searched
+ * along with this thread's stack.  If it's already registered, this sets
+ * its size.
+ */
 __attribute__((visibility("default")))
 void threadscan_register_local_block (void *addr, size_t size)
 {
-    mem_range_t *local_block = &threadscan_thread_get_td()->local_block;
-    local_block->high = (size_t)addr + size;
+    thread_data_t *td = threadscan_thread_get_td();
+    local_block_t *block;
+    int i;
+
+    if (NULL == addr) {
+        threadscan_diagnostic("Tried to register a NULL local block.\n");
+        return;
+    }
+
+    block = find_local_block(td, (size_t)addr);
+    if (block) {
+        block->range.high = (size_t)addr + size;
+        return;
+    }
+
+    for (i = 0; i < MAX_LOCAL_BLOCKS; ++i) {
+        if (0 == td->local_blocks[i].range.low) break;
+    }
+    if (MAX_LOCAL_BLOCKS == i) {
+        threadscan_fatal("threadscan: a thread registered more than %d "
+                         "local blocks.\n", MAX_LOCAL_BLOCKS);
+    }
+    block = &td->local_blocks[i];
+    block->range.high = (size_t)addr + size;
 
     // Set "low" last.  This is for safety -- if a thread is setting this value
     // when a reclamation happens, it will check the "low" value, and if it
     // hasn't been set, there's no chance of funky reads.
-    local_block->low = (size_t)addr;
+    __sync_synchronize();
+    block->range.low = (size_t)addr;
+    if (i == td->n_local_blocks) {
+        __sync_synchronize();
+        td->n_local_blocks = i + 1;
+    }
+}
+
+/**
+ * Interface for applications.  Change the size of a registered local
+ * block.
+ */
+__attribute__((visibility("default")))
+void threadscan_resize_local_block (void *addr, size_t size)
+{
+    local_block_t *block =
+        find_local_block(threadscan_thread_get_td(), (size_t)addr);
+
+    if (NULL == block) {
+        threadscan_diagnostic("Tried to resize a local block that isn't "
+                              "registered.\n");
+        return;
+    }
+    block->range.high = (size_t)addr + size;
+}
+
+/**
+ * Interface for applications.  Stop searching a local block.  Once this
+ * returns, the block can be freed.
+ */
+__attribute__((visibility("default")))
+void threadscan_unregister_local_block (void *addr)
+{
+    thread_data_t *td = threadscan_thread_get_td();
+    local_block_t *block = find_local_block(td, (size_t)addr);
+
+    if (NULL == addr || NULL == block) {
+        threadscan_diagnostic("Tried to unregister a local block that isn't "
+                              "registered.\n");
+        return;
+    }
+
+    // Clear "low" first, for the same reason it's set last.  The search
+    // happens in this thread's signal handler, so once the store is done,
+    // no search can be reading the block.
+    block->range.low = 0;
+    __sync_synchronize();
+    block->range.high = 0;
+    while (td->n_local_blocks > 0
+           && 0 == td->local_blocks[td->n_local_blocks - 1].range.low) {
+        --td->n_local_blocks;
+    }
+}
+
+/****************************************************************************/
+/*                                 Domains.                                 */
+/****************************************************************************/
+
+/**
+ * Set up a domain's buffers and register it.  The working memory starts out
+ * with room for INITIAL_THREAD_CAPACITY threads' lists.  Return 0 if there
+ * is no id left for it.
+ */
+static int domain_init (threadscan_domain_t *dom)
+{
+    lay_out_working_space(dom, g_threadscan_ptrs_per_thread
+                          * INITIAL_THREAD_CAPACITY);
+
+    dom->storage = NULL;
+    dom->old_storage = NULL;
+    dom->byte_chunk = g_threadscan_byte_budget / 64;
+    dom->n_nodes = threadscan_numa_node_count();
+
+    // The page caches start out empty, and cover no addresses.
+    dom->dirty_epoch = 1;
+    dom->cache_low = ~(size_t)0;
+    dom->cache_high = 0;
+
+    dom->self_stacks_searched = 1;
+    return threadscan_proc_add_domain(&dom->base);
+}
+
+/**
+ * Interface for applications.  Create a reclamation domain.  Its rounds
+ * only search the threads attached to it, and they run independently of
+ * the rounds of other domains.  Safepoints, page caches, epochs, and the
+ * collector and pressure threads are only for the default domain, so a
+ * domain's threads are always signalled and searched in full.  Return NULL
+ * if there are MAX_DOMAINS domains already.
+ */
+__attribute__((visibility("default")))
+threadscan_domain_t *threadscan_domain_create ()
+{
+    threadscan_domain_t *dom = (threadscan_domain_t*)
+        threadscan_alloc_mmap((sizeof(threadscan_domain_t) + PAGESIZE - 1)
+                              & ~(PAGESIZE - 1));
+
+    if (!domain_init(dom)) {
+        threadscan_alloc_munmap(dom);
+        return NULL;
+    }
+    return dom;
+}
+
+/**
+ * Interface for applications.  Make the calling thread a member of the
+ * domain, so it can collect into it, and it's searched in its rounds.
+ */
+__attribute__((visibility("default")))
+void threadscan_domain_attach (threadscan_domain_t *dom)
+{
+    thread_data_t *td = threadscan_thread_get_td();
+    queue_t *q = &td->members[dom->base.id].ptr_list;
+
+    if (IS_MEMBER(td, dom->base.id)) return;
+
+    threadscan_proc_set_membership(&dom->base, td, 1);
+    threadscan_numa_bind(q->e, q->capacity * sizeof(size_t), td->numa_node);
+}
+
+/**
+ * Return whether the pointer list at arg is empty.
+ */
+static int ptr_list_is_empty (void *arg)
+{
+    return 0 == threadscan_queue_length((queue_t*)arg);
+}
+
+/**
+ * Interface for applications.  Stop the calling thread being a member of
+ * the domain.  The pointers it collected into the domain are handed to a
+ * round first.
+ */
+__attribute__((visibility("default")))
+void threadscan_domain_detach (threadscan_domain_t *dom)
+{
+    thread_data_t *td = threadscan_thread_get_td();
+    queue_t *q = &td->members[dom->base.id].ptr_list;
+
+    if (&g_tsdata == dom) {
+        threadscan_diagnostic("Tried to detach from the default domain.\n");
+        return;
+    }
+    if (!IS_MEMBER(td, dom->base.id)) return;
+
+    // Rounds only take pointers from the lists of members.
+    while (!ptr_list_is_empty(q)) {
+        reclaim_or_help(dom, ptr_list_is_empty, q);
+    }
+    threadscan_proc_set_membership(&dom->base, td, 0);
+
+    // A round may have asked this thread to search before it left.
+    if (td->members[dom->base.id].scan_request) {
+        raise(SIGTHREADSCAN);
+    }
+}
+
+/**
+ * Interface for applications.  Collect a pointer into a domain the calling
+ * thread is attached to.  It's searched for in the memory of the domain's
+ * threads, only.
+ */
+__attribute__((visibility("default")))
+void threadscan_domain_collect (threadscan_domain_t *dom, void *ptr)
+{
+    thread_data_t *td = threadscan_thread_get_td();
+
+    if (NULL == ptr) {
+        threadscan_diagnostic("Tried to collect NULL.\n");
+        return;
+    }
+    if (!IS_MEMBER(td, dom->base.id)) {
+        threadscan_fatal("threadscan: collected into a domain the thread "
+                         "isn't attached to.\n");
+    }
+
+    threadscan_queue_push(&td->members[dom->base.id].ptr_list, (size_t)ptr);
+    check_ptr_list(dom, td);
+}
+
+/**
+ * Reclaim every address in a list of leftovers, and free the list.  They're
+ * unmarked, so none of them survive.
+ */
+static void free_leftovers (thread_data_t *td, addr_storage_t *leftovers)
+{
+    while (leftovers) {
+        addr_storage_t *tmp = leftovers;
+        size_t sz = (MARK_WORD(tmp->length) + 1) * sizeof(size_t);
+        size_t *marks;
+        sz = (sz + PAGESIZE - 1) & ~(PAGESIZE - 1);
+        marks = (size_t*)threadscan_alloc_mmap(sz);
+        handle_unreferenced_ptrs(td, tmp->addrs, marks, tmp->length);
+        threadscan_alloc_munmap(marks);
+        leftovers = tmp->next;
+        threadscan_alloc_munmap(tmp);
+    }
+}
+
+/**
+ * Interface for applications.  Destroy a domain that no thread is attached
+ * to, and let a later threadscan_domain_create() have its id.  Only the
+ * domain's threads are searched for its pointers, so with none left, the
+ * ones that survived its rounds are reclaimed now.  The threads that were
+ * attached must be done with their calls on the domain.
+ */
+__attribute__((visibility("default")))
+void threadscan_domain_destroy (threadscan_domain_t *dom)
+{
+    thread_data_t *td = threadscan_thread_get_td();
+    int i;
+
+    if (&g_tsdata == dom) {
+        threadscan_diagnostic("Tried to destroy the default domain.\n");
+        return;
+    }
+    if (!threadscan_proc_remove_domain(&dom->base)) {
+        threadscan_diagnostic("Tried to destroy a domain that threads are "
+                              "still attached to.\n");
+        return;
+    }
+
+    free_leftovers(td, dom->storage);
+    free_leftovers(td, dom->old_storage);
+    free_leftovers(td, dom->limbo);
+    for (i = 0; i < ARENA_SLOTS; ++i) {
+        if (dom->arenas[i].buf) threadscan_alloc_munmap(dom->arenas[i].buf);
+    }
+    for (i = 0; i < MAX_NUMA_NODES; ++i) {
+        if (dom->replicas[i]) threadscan_alloc_munmap(dom->replicas[i]);
+    }
+    threadscan_alloc_munmap(dom);
+    run_reclaim_fns(td);
 }
 
 /****************************************************************************/
 /*                            Bystander threads.                            */
 /****************************************************************************/
 
+/**
+ * Return whether the reclaimer is done with the soft-dirty bits for the
+ * round after the one at arg.  Only the default domain tracks them.
+ */
+static int dirty_round_passed (void *arg)
+{
+    return g_tsdata.dirty_rounds != *(size_t*)arg;
+}
+
 /**
  * Perform a search of the thread stack for pointers to objects that have
- * been removed.
+ * been removed, for a round in dom.
  */
-static void *search_self_stack (void *arg)
+static void *search_self_stack (threadscan_domain_t *dom, void *arg)
 {
-    mem_range_t user_stack = threadscan_thread_user_stack();
-    mem_range_t stack_search_range = { (size_t)arg, user_stack.high };
-    mem_range_t *local_block = &threadscan_thread_get_td()->local_block;
+    thread_data_t *td = threadscan_thread_get_td();
+    int n;
 
     assert(arg);
 
-    // Search the stack for incriminating references.
-    search_range(&stack_search_range);
-
-    // Search the local region, if it's been set.
-    if (local_block->low > 0) {
-        search_range(local_block);
+    // Pass the signal on first, so the threads under this one search at
+    // the same time.
+    threadscan_proc_forward_scan(&dom->base, td, SIGTHREADSCAN);
+
+    if (dom->soft_dirty) {
+        // Wait for the reclaimer to clear the soft-dirty bits, or decide
+        // not to, once every thread has read its own.
+        size_t rounds = dom->dirty_rounds;
+        read_dirty_bits(dom, td);
+        answer(dom, &dom->dirty_reads, 1);
+        threadscan_util_wait(&dom->dirty_wq, dirty_round_passed, &rounds,
+                             NULL);
     }
 
-    // Mark this thread done.
-    __sync_fetch_and_add(&self_stacks_searched, 1);
+    // Search the stack and local block for incriminating references.
+    search_thread_memory(dom, td, (size_t)arg);
+
+    // Mark this thread done, and with it, its subtree if that's finished.
+    n = threadscan_proc_scan_done(&dom->base, td);
+    if (n > 0) answer(dom, &dom->self_stacks_searched, n);
 
     // Go back to work.
     return NULL;
 }
 
 /**
- * Got a signal from a thread wanting to do cleanup.
+ * Take a reclaimer's request for this thread to search its memory.
+ * Return true if there was one, and it's this caller's to answer.
+ */
+static int take_scan_request (domain_member_t *member)
+{
+    size_t round = member->scan_request;
+    return round != 0 && BCAS(&member->scan_request, round, 0);
+}
+
+/**
+ * Search this thread's memory for the round in the domain with the given
+ * id, with the stack from rsp up.
+ */
+static void answer_request (int id, size_t rsp)
+{
+    threadscan_domain_t *dom =
+        (threadscan_domain_t*)threadscan_proc_get_domain(id);
+
+    threadscan_thread_cleanup_raise_flag(&dom->base);
+    search_self_stack(dom, (void*)rsp);
+    threadscan_thread_cleanup_lower_flag(&dom->base);
+}
+
+/**
+ * Got a signal from a thread wanting to do cleanup.  Reclaimers in several
+ * domains may be waiting on this thread, and it answers all of them.
  */
 static void signal_handler (int sig)
 {
+    thread_data_t *td = threadscan_thread_get_td();
     size_t rsp;
+    int id;
     assert(SIGTHREADSCAN == sig);
 
     GET_STACK_POINTER(rsp);
 
-    threadscan_thread_cleanup_raise_flag(); // FIXME: Do we need timestamps?
-    search_self_stack((void*)rsp);
-    threadscan_thread_cleanup_lower_flag();
+    // In safepoint mode, the thread may have answered already.
+    for (id = 0; id < MAX_DOMAINS; ++id) {
+        if (take_scan_request(&td->members[id])) answer_request(id, rsp);
+    }
+}
+
+/**
+ * Interface for applications.  threadscan_safepoint() calls this while a
+ * reclaimer is waiting on safepoints.  Search this thread's memory, if it
+ * hasn't been already, the same as the signal handler would.
+ */
+__attribute__((visibility("default"), noinline))
+void threadscan_safepoint_poll ()
+{
+    size_t rsp;
+
+    thread_data_t *td = threadscan_thread_get_td();
+
+    // Only the default domain waits at safepoints.
+    if (!take_scan_request(&td->members[DEFAULT_DOMAIN])) return;
+
+    // Without a signal frame, the callers' values in callee-saved registers
+    // are only on the stack if they're spilled here.
+    __builtin_unwind_init();
+    GET_STACK_POINTER(rsp);
+
+    answer_request(DEFAULT_DOMAIN, rsp);
+    __sync_fetch_and_add(&g_stats.safepoints, 1);
+}
+
+/**
+ * Interface for applications.  With THREADSCAN_EPOCH, the calling thread
+ * may hold references to collected objects from here to the matching
+ * threadscan_end_op().  Operations nest.
+ */
+__attribute__((visibility("default")))
+void threadscan_begin_op ()
+{
+    thread_data_t *td = threadscan_thread_get_td();
+
+    if (0 == td->op_depth++) {
+        ++td->op_epoch;
+        // The reclaimer has to see that this thread is in an operation
+        // before the thread reads anything it might collect.
+        __sync_synchronize();
+    }
+}
+
+/**
+ * Interface for applications.  End the operation started by the matching
+ * threadscan_begin_op().
+ */
+__attribute__((visibility("default")))
+void threadscan_end_op ()
+{
+    thread_data_t *td = threadscan_thread_get_td();
+
+    assert(td->op_depth > 0);
+    if (0 == --td->op_depth) {
+        // Loads don't pass stores on x86, so only the compiler has to be
+        // kept from moving the operation's reads below this.
+        __asm__ __volatile__("" ::: "memory");
+        ++td->op_epoch;
+    }
 }
 
 /**
@@ -512,30 +2476,84 @@ static void register_signal_handlers ()
         threadscan_fatal("threadscan: Unable to register signal handler.\n");
     }
 
-    g_tsdata.max_ptrs = g_threadscan_ptrs_per_thread
-        * MAX_THREAD_COUNT;
-
-    // Figure out how big the scan map needs to be.  It should be large
-    // enough to store one pointer for every page in the main buffer of
-    // addresses, and we round up to the nearest page to avoid sharing
-    // with the buf_addrs.
-    int scan_map_sz = (2 * g_tsdata.max_ptrs * sizeof(size_t) * sizeof(size_t))
-        / PAGESIZE;
-    if (scan_map_sz % PAGESIZE) {
-        scan_map_sz += PAGESIZE;
-        scan_map_sz &= ~(PAGESIZE - 1);
+    threadscan_numa_init();
+    domain_init(&g_tsdata);
+    g_tsdata.safepoint = g_threadscan_safepoint;
+    g_tsdata.epoch = g_threadscan_epoch;
+    g_pressure_queue_limit =
+        g_threadscan_ptrs_per_thread / PRESSURE_QUEUE_DIVISOR;
+
+    // The collector thread is started by the first call to collect.
+    if (g_threadscan_collector) {
+        pthread_condattr_t attr;
+        pthread_mutex_init(&g_collector.lock, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&g_collector.cond, &attr);
+        pthread_condattr_destroy(&attr);
+        g_collector.watermark = MIN_OF((size_t)g_threadscan_ptrs_per_thread
+                                       * g_threadscan_collector_watermark
+                                       / 100,
+                                       g_threadscan_ptrs_per_thread - 1);
     }
 
-    // Since we allocate all the buffers in a single allocation, do all the
-    // necessary math to get the size of that alloc.  Also, calculate the
-    // offsets into that big buffer for all of the sub-buffers.
-
-    // Reserve space for buf_addrs.
-    g_tsdata.working_buffer_sz = g_tsdata.max_ptrs * sizeof(size_t) * 2;
-    g_tsdata.offset_list[SCAN_MAP_OFFSET] = g_tsdata.working_buffer_sz;
+    if (g_threadscan_soft_dirty) {
+        g_tsdata.soft_dirty = threadscan_dirty_init();
+        if (!g_tsdata.soft_dirty) {
+            threadscan_diagnostic("warning: the kernel does not track "
+                                  "soft-dirty pages.  Reading all of "
+                                  "memory every round.\n");
+        }
+    }
+}
 
-    // Reserve space for the scan map.
-    g_tsdata.working_buffer_sz += scan_map_sz;
+/**
+ * Print the statistics, if they were asked for.
+ */
+__attribute__((destructor))
+static void print_stats ()
+{
+    static const char *gen_names[GEN_COUNT] = { "new", "young", "old" };
+    int i;
 
-    g_tsdata.storage = NULL;
+    if (!g_threadscan_stats) return;
+
+    threadscan_diagnostic("threadscan: %zu rounds, %zu searched the old "
+                          "generation, %zu started by memory pressure\n",
+                          g_stats.rounds, g_stats.old_rounds,
+                          g_stats.pressure_rounds);
+    threadscan_diagnostic("  %-10s %12s %12s %12s\n",
+                          "generation", "searched", "freed", "survived");
+    for (i = 0; i < GEN_COUNT; ++i) {
+        threadscan_diagnostic("  %-10s %12zu %12zu %12zu\n", gen_names[i],
+                              g_stats.gen[i].searched, g_stats.gen[i].freed,
+                              g_stats.gen[i].survived);
+    }
+    threadscan_diagnostic("  %zu pointers in the old generation\n",
+                          g_tsdata.old_count);
+    if (g_tsdata.soft_dirty) {
+        threadscan_diagnostic("  %zu pages read, %zu skipped as clean, "
+                              "%zu soft-dirty clears\n",
+                              g_stats.pages_read, g_stats.pages_skipped,
+                              g_stats.dirty_clears);
+    }
+    if (g_threadscan_safepoint) {
+        threadscan_diagnostic("  %zu searches at safepoints, %zu signals\n",
+                              g_stats.safepoints, g_stats.signals);
+    }
+    threadscan_diagnostic("  %zu parked threads searched without a "
+                          "signal\n", g_stats.parked);
+    if (g_tsdata.n_nodes > 1) {
+        threadscan_diagnostic("  %d NUMA nodes, each with its own copy of "
+                              "the search list\n", g_tsdata.n_nodes);
+    }
+    if (g_stats.handshakes > 0) {
+        threadscan_diagnostic("  %zu us per handshake, on average\n",
+                              g_stats.handshake_ns / g_stats.handshakes
+                              / 1000);
+    }
+    if (g_threadscan_epoch) {
+        threadscan_diagnostic("  %zu rounds free'd without a search\n",
+                              g_stats.epoch_rounds);
+    }
 }
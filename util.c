@@ -24,12 +24,16 @@ THE SOFTWARE.
 #include "alloc.h"
 #include "env.h"
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "util.h"
 
 /****************************************************************************/
@@ -37,12 +41,24 @@ THE SOFTWARE.
 /****************************************************************************/
 
 // Size of a per-thread metadata memory block.
-#define MEMBLOCK_SIZE PAGESIZE
+#define MEMBLOCK_SIZE                                                   \
+    ((sizeof(thread_data_t) + PAGESIZE - 1) & ~(PAGESIZE - 1))
+
+// Times a waiter checks before it goes to sleep.  Long enough to cover a
+// thread on another CPU finishing what it was doing, and short enough not to
+// eat much of the time of a thread that needs this CPU.
+#define WAIT_SPINS 512
 
 // FIXME: Are these actually used?
 static pthread_mutex_t g_staged_lock = PTHREAD_MUTEX_INITIALIZER;
 static thread_data_t *g_td_staged_to_free = NULL;
 
+// Bytes collected and not yet taken by the reclaimer, summed over threads.
+volatile size_t g_threadscan_pending_bytes = 0;
+
+// Threads waiting on a reclamation sleep here.
+wait_queue_t g_threadscan_reclaim_wq;
+
 /****************************************************************************/
 /*                       Storage for per-thread data.                       */
 /****************************************************************************/
@@ -50,17 +66,64 @@ static thread_data_t *g_td_staged_to_free = NULL;
 thread_data_t *threadscan_util_thread_data_new ()
 {
     char *memblock = (char*)threadscan_alloc_mmap(MEMBLOCK_SIZE);
-    size_t *local_list =
-        (size_t*)threadscan_alloc_mmap(g_threadscan_ptrs_per_thread
-                                        * sizeof(size_t));
     thread_data_t *td = (thread_data_t*)memblock;
-    threadscan_queue_init(&td->ptr_list, local_list,
-                          g_threadscan_ptrs_per_thread);
-    td->local_block.low = td->local_block.high = 0;
+    int i;
+
+    for (i = 0; i < MAX_DOMAINS; ++i) {
+        domain_member_t *member = &td->members[i];
+        memset(&member->ptr_list, 0, sizeof(member->ptr_list));
+        member->local_timestamp = 0;
+        member->times_without_update = 0;
+        member->scan_request = 0;
+        member->fanout_index = -1;
+        member->fanout_left = member->fanout_size = 0;
+        member->parked = 0;
+        member->marks = NULL;
+        member->marks_words = 0;
+        member->mark_low = ~(size_t)0;
+        member->mark_high = 0;
+    }
+    td->domains = 0;
+    threadscan_util_thread_data_join(td, DEFAULT_DOMAIN);
+    memset(td->local_blocks, 0, sizeof(td->local_blocks));
+    td->n_local_blocks = 0;
+    td->numa_node = 0;
+    td->late_rounds = 0;
+    td->park_state = THREAD_RUNNING;
+    td->park_sp = 0;
+    td->park_wq.seq = td->park_wq.sleepers = 0;
+    td->op_epoch = 0;
+    td->op_depth = 0;
+    td->op_snapshot = 0;
+    td->bytes_collected = td->bytes_published = td->bytes_drained = 0;
+    td->ready = NULL;
+    td->n_ready = td->ready_capacity = 0;
+    td->in_callbacks = 0;
+    memset(td->stack_cache, 0, sizeof(td->stack_cache));
+    td->cache_cur = 0;
     td->ref_count = 1;
     return td;
 }
 
+/**
+ * Make td a member of the domain with the given id.  Its pointer list for
+ * the domain is allocated the first time, before a round can see td in the
+ * domain.
+ */
+void threadscan_util_thread_data_join (thread_data_t *td, int id)
+{
+    domain_member_t *member = &td->members[id];
+
+    if (NULL == member->ptr_list.e) {
+        size_t *local_list =
+            (size_t*)threadscan_alloc_mmap(g_threadscan_ptrs_per_thread
+                                            * sizeof(size_t));
+        threadscan_queue_init(&member->ptr_list, local_list,
+                              g_threadscan_ptrs_per_thread);
+    }
+    __sync_fetch_and_or(&td->domains, 1U << id);
+}
+
 void threadscan_util_thread_data_decr_ref (thread_data_t *td)
 {
     if (0 == __sync_fetch_and_sub(&td->ref_count, 1) - 1) {
@@ -73,12 +136,25 @@ void threadscan_util_thread_data_decr_ref (thread_data_t *td)
 
 void threadscan_util_thread_data_free (thread_data_t *td)
 {
+    int i;
+
     assert(td);
     assert(td->ref_count == 0);
 
     // FIXME: Should do something about any possible remaining pointers in this
-    // thread's ptr_list!  Right now, they're getting leaked.
-    threadscan_alloc_munmap(td->ptr_list.e);
+    // thread's ptr_lists!  Right now, they're getting leaked.
+    for (i = 0; i < MAX_DOMAINS; ++i) {
+        domain_member_t *member = &td->members[i];
+        if (member->ptr_list.e) threadscan_alloc_munmap(member->ptr_list.e);
+        if (member->marks) threadscan_alloc_munmap(member->marks);
+    }
+    if (td->ready) threadscan_alloc_munmap(td->ready);
+    threadscan_dirty_cache_free(&td->stack_cache[0]);
+    threadscan_dirty_cache_free(&td->stack_cache[1]);
+    for (i = 0; i < MAX_LOCAL_BLOCKS; ++i) {
+        threadscan_dirty_cache_free(&td->local_blocks[i].cache[0]);
+        threadscan_dirty_cache_free(&td->local_blocks[i].cache[1]);
+    }
 
     threadscan_alloc_munmap(td);
 }
@@ -115,56 +191,156 @@ void threadscan_util_thread_data_cleanup (pthread_t tid)
     threadscan_util_thread_data_free(td);
 }
 
-void threadscan_util_thread_list_init (thread_list_t *tl)
+/**
+ * Take the bytes td has published and that haven't been taken, and return
+ * how many there are.  The reclaimer does this for each round, and td's
+ * thread does it as it leaves, so whichever moves bytes_drained up takes
+ * them.
+ */
+size_t threadscan_util_thread_data_drain (thread_data_t *td)
+{
+    size_t published = td->bytes_published, drained;
+
+    do {
+        drained = td->bytes_drained;
+        if (published <= drained) return 0;
+    } while (!BCAS(&td->bytes_drained, drained, published));
+
+    return published - drained;
+}
+
+/**
+ * Double the room in the thread list.  Readers may still be going through
+ * the old slots, so they're returned for the caller to free once they're
+ * done, or NULL if there weren't any.  The caller holds the list's lock.
+ */
+static thread_data_t **grow_thread_list (thread_list_t *tl)
 {
-    assert(tl);
-    if (tl->head == NULL) {
-        // Do not reinitialize the mutex.  That would be bad.
-        pthread_mutex_init(&tl->lock, NULL);
+    int capacity = tl->capacity > 0 ? tl->capacity * 2
+        : (int)(PAGESIZE / sizeof(thread_data_t*));
+    size_t free_size = (capacity * sizeof(int) + PAGESIZE - 1)
+        & ~(PAGESIZE - 1);
+    thread_data_t **old = (thread_data_t**)tl->slots;
+    thread_data_t **slots = (thread_data_t**)
+        threadscan_alloc_mmap(capacity * sizeof(thread_data_t*));
+    int *free_slots = (int*)threadscan_alloc_mmap(free_size);
+
+    if (old) {
+        memcpy(slots, old, tl->high * sizeof(thread_data_t*));
+        memcpy(free_slots, tl->free_slots, tl->n_free * sizeof(int));
+        threadscan_alloc_munmap(tl->free_slots);
     }
+    tl->free_slots = free_slots;
+    __sync_synchronize(); // mfence.
+    tl->slots = slots;
+    tl->capacity = capacity;
+    return old;
 }
 
 void threadscan_util_thread_list_add (thread_list_t *tl, thread_data_t *td)
 {
+    thread_data_t **retired = NULL;
+    int slot;
+
     assert(tl); assert(td);
     pthread_mutex_lock(&tl->lock);
-    td->next = tl->head;
-    tl->head = td;
+    if (tl->n_free > 0) {
+        slot = tl->free_slots[--tl->n_free];
+        td->slot = slot;
+        tl->slots[slot] = td;
+    } else {
+        // The slot has to be filled before readers look that far.
+        if (tl->high == tl->capacity) retired = grow_thread_list(tl);
+        slot = tl->high;
+        td->slot = slot;
+        tl->slots[slot] = td;
+        __sync_synchronize(); // mfence.
+        tl->high = slot + 1;
+    }
     pthread_mutex_unlock(&tl->lock);
+
+    // The new slots were published before the epoch moves on, so readers
+    // counted in the new epoch never saw the old ones.  Once the readers
+    // of the old epoch are gone, nobody has them.
+    if (retired) {
+        threadscan_util_thread_list_wait_for_readers(tl);
+        threadscan_alloc_munmap(retired);
+    }
 }
 
 void threadscan_util_thread_list_remove (thread_list_t *tl, thread_data_t *td)
 {
-    thread_data_t *tmp;
     assert(tl); assert(td);
     pthread_mutex_lock(&tl->lock);
-    tmp = tl->head;
-    assert(tmp);
-    if (tmp == td) {
-        tl->head = td->next;
-    } else {
-        while (tmp->next != td) {
-            tmp = tmp->next;
-            assert(NULL != tmp);
-        }
-        tmp->next = td->next;
-    }
+    assert(tl->slots[td->slot] == td);
+    tl->slots[td->slot] = NULL;
+    tl->free_slots[tl->n_free++] = td->slot;
     pthread_mutex_unlock(&tl->lock);
+
+    // A reclaimer may still see this thread, but its bytes are taken once.
+    __sync_fetch_and_sub(&g_threadscan_pending_bytes,
+                         threadscan_util_thread_data_drain(td));
+}
+
+/**
+ * Start going through the thread list.  Return the epoch to pass to
+ * threadscan_util_thread_list_exit() when done.
+ */
+size_t threadscan_util_thread_list_enter (thread_list_t *tl)
+{
+    size_t epoch;
+
+    while (1) {
+        epoch = tl->epoch;
+        __sync_fetch_and_add(&tl->readers[epoch % 2], 1);
+        // If the epoch moved on before this reader was counted, a thread
+        // waiting for readers may have missed it.  Count it in the new one.
+        if (epoch == tl->epoch) return epoch;
+        threadscan_util_thread_list_exit(tl, epoch);
+    }
+}
+
+void threadscan_util_thread_list_exit (thread_list_t *tl, size_t epoch)
+{
+    if (0 == __sync_sub_and_fetch(&tl->readers[epoch % 2], 1)) {
+        threadscan_util_wake(&tl->wq);
+    }
+}
+
+/**
+ * Return whether the half of the readers at arg is empty.
+ */
+static int no_readers (void *arg)
+{
+    return 0 == *(volatile int*)arg;
+}
+
+/**
+ * Wait until no reader can still have the data of a thread that has been
+ * removed from the list.  New readers don't hold this up.
+ */
+void threadscan_util_thread_list_wait_for_readers (thread_list_t *tl)
+{
+    size_t epoch;
+
+    pthread_mutex_lock(&tl->epoch_lock);
+    epoch = __sync_fetch_and_add(&tl->epoch, 1);
+    threadscan_util_wait(&tl->wq, no_readers,
+                         (void*)&tl->readers[epoch % 2], NULL);
+    pthread_mutex_unlock(&tl->epoch_lock);
 }
 
 thread_data_t *threadscan_util_thread_list_find (thread_list_t *tl, size_t addr)
 {
-    thread_data_t *ret;
+    thread_data_t *td, *ret = NULL;
 
-    pthread_mutex_lock(&tl->lock);
-    for (ret = tl->head; ret != NULL; ret = ret->next) {
-        if (addr >= (size_t)ret->user_stack_low
-            && addr < (size_t)ret->user_stack_high) {
-            __sync_fetch_and_add(&ret->ref_count, 1);
-            break;
+    FOREACH_IN_THREAD_LIST(td, tl)
+        if (NULL == ret && addr >= (size_t)td->user_stack_low
+            && addr < (size_t)td->user_stack_high) {
+            __sync_fetch_and_add(&td->ref_count, 1);
+            ret = td;
         }
-    }
-    pthread_mutex_unlock(&tl->lock);
+    ENDFOREACH_IN_THREAD_LIST(td, tl);
 
     return ret;
 }
@@ -201,6 +377,65 @@ void threadscan_fatal (const char *format, ...)
     exit(1);
 }
 
+/****************************************************************************/
+/*                                 Waiting.                                 */
+/****************************************************************************/
+
+/**
+ * Wait until done(arg) is true, or until the deadline (CLOCK_MONOTONIC), if
+ * there is one.  Whatever makes done(arg) true has to wake wq afterwards.
+ * This may be called from a signal handler.
+ * @return done(arg)'s last value.
+ */
+int threadscan_util_wait (wait_queue_t *wq, int (*done) (void *), void *arg,
+                          const struct timespec *deadline)
+{
+    int saved_errno = errno;
+    int i, seq, ret;
+
+    for (i = 0; i < WAIT_SPINS; ++i) {
+        if (done(arg)) return 1;
+        __builtin_ia32_pause();
+    }
+
+    while (1) {
+        // Announce this sleeper before the last check.  A waker that makes
+        // done(arg) true afterwards sees it, and bumps seq, so the futex
+        // doesn't sleep on the old value.
+        seq = wq->seq;
+        __sync_fetch_and_add(&wq->sleepers, 1);
+        if (done(arg)) {
+            __sync_fetch_and_sub(&wq->sleepers, 1);
+            ret = 1;
+            break;
+        }
+        ret = syscall(SYS_futex, &wq->seq,
+                      FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, seq, deadline,
+                      NULL, FUTEX_BITSET_MATCH_ANY);
+        __sync_fetch_and_sub(&wq->sleepers, 1);
+        if (ret < 0 && ETIMEDOUT == errno) {
+            ret = done(arg);
+            break;
+        }
+    }
+
+    errno = saved_errno;
+    return ret;
+}
+
+/**
+ * Wake everything waiting on wq.  Call it after making their wait over.
+ */
+void threadscan_util_wake (wait_queue_t *wq)
+{
+    __sync_synchronize(); // mfence.
+    if (wq->sleepers > 0) {
+        __sync_fetch_and_add(&wq->seq, 1);
+        syscall(SYS_futex, &wq->seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
+    }
+}
+
 /****************************************************************************/
 /*                              Sort utility.                               */
 /****************************************************************************/
@@ -234,7 +469,7 @@ static void insertion_sort (size_t *addrs, int min, int max)
 {
     int i, j;
     for (i = min + 1; i <= max; ++i) {
-        for (j = i; j > 0 && addrs[j - 1] > addrs[j]; --j) {
+        for (j = i; j > min && addrs[j - 1] > addrs[j]; --j) {
             swap(addrs, j, j - 1);
         }
     }
@@ -256,25 +491,309 @@ static void quicksort (size_t *addrs, int min, int max)
     }
 }
 
+/****************************************************************************/
+/*                           Radix sort utility.                            */
+/****************************************************************************/
+
+// Arrays shorter than this are sorted with quicksort, which is faster than
+// radix sorting when the histograms would dominate the cost.
+#define RADIX_THRESHOLD 1024
+
+// The first (most significant) digit splits the array into buckets that are
+// each sorted independently, and possibly on different threads.
+#define MSD_BITS 8
+#define MSD_BUCKETS (1 << MSD_BITS)
+
+// Width of the least significant digits used to sort each bucket.
+#define LSD_MAX_BITS 11
+#define LSD_BUCKETS (1 << LSD_MAX_BITS)
+
+typedef struct sort_job_t sort_job_t;
+
+/**
+ * A parallel sort in progress.  After the MSD pass, tmp holds the array
+ * partitioned into buckets on the top digit, and each bucket is a task that
+ * sorts its range of tmp and leaves the result in the same range of a.
+ */
+struct sort_job_t {
+    size_t *a;
+    size_t *tmp;
+    int low_bit;                      // Lowest bit that differs among addrs.
+    int lsd_bits;                     // Bits sorted per bucket, below MSD.
+    int offsets[MSD_BUCKETS + 1];     // Bucket boundaries in tmp.
+
+    volatile int next_task;           // Next bucket to be claimed.
+    volatile int tasks_done;          // Buckets that have been sorted.
+    volatile int helpers;             // Threads looking at this job.
+    volatile int active;              // Nonzero when tasks can be claimed.
+    wait_queue_t wq;                  // Woken by the last task and helper.
+};
+
+static sort_job_t g_sort_job;
+
+// Set while a sort has g_sort_job.  Rounds in different domains can sort at
+// the same time, and the ones that don't get it sort on their own.
+static volatile int g_sort_job_taken;
+
+/**
+ * LSD radix sort of the range [min, max) of src on the given bits, starting
+ * at low_bit.  dst is scratch space.  The sorted values end up in dst.
+ */
+static void lsd_sort_bucket (size_t *src, size_t *dst, int min, int max,
+                             int low_bit, int bits)
+{
+    int n = max - min;
+    int passes, digit_bits, pass, i;
+
+    if (n < RADIX_THRESHOLD) {
+        quicksort(src, min, max - 1);
+        memcpy(&dst[min], &src[min], n * sizeof(size_t));
+        return;
+    }
+
+    // Spread the bits evenly over the passes.  An even pass count would leave
+    // the result in src, so round up to an odd number of passes; an extra
+    // pass over a bucket that fits in cache is cheaper than a copy.
+    passes = (bits + LSD_MAX_BITS - 1) / LSD_MAX_BITS;
+    if (passes % 2 == 0) ++passes;
+    digit_bits = (bits + passes - 1) / passes;
+
+    for (pass = 0; pass < passes; ++pass) {
+        int counts[LSD_BUCKETS];
+        int shift = low_bit + pass * digit_bits;
+        size_t mask = ((size_t)1 << digit_bits) - 1;
+        int nbuckets = 1 << digit_bits;
+        int sum = min;
+
+        memset(counts, 0, nbuckets * sizeof(int));
+        for (i = min; i < max; ++i) {
+            ++counts[(src[i] >> shift) & mask];
+        }
+        for (i = 0; i < nbuckets; ++i) {
+            int c = counts[i];
+            counts[i] = sum;
+            sum += c;
+        }
+        for (i = min; i < max; ++i) {
+            size_t v = src[i];
+            dst[counts[(v >> shift) & mask]++] = v;
+        }
+
+        size_t *swap_tmp = src;
+        src = dst;
+        dst = swap_tmp;
+    }
+}
+
+/**
+ * Sort the bucket of the given index for the sort job.
+ */
+static void sort_job_do_task (sort_job_t *job, int idx)
+{
+    int min = job->offsets[idx];
+    int max = job->offsets[idx + 1];
+
+    if (max - min < 2 || job->lsd_bits == 0) {
+        // Already sorted by the MSD pass.
+        memcpy(&job->a[min], &job->tmp[min], (max - min) * sizeof(size_t));
+    } else {
+        lsd_sort_bucket(job->tmp, job->a, min, max,
+                        job->low_bit, job->lsd_bits);
+    }
+}
+
+/**
+ * Claim and sort buckets until there are none left.
+ */
+static void sort_job_work (sort_job_t *job)
+{
+    int idx;
+    while ((idx = __sync_fetch_and_add(&job->next_task, 1)) < MSD_BUCKETS) {
+        sort_job_do_task(job, idx);
+        if (MSD_BUCKETS - 1 == __sync_fetch_and_add(&job->tasks_done, 1)) {
+            threadscan_util_wake(&job->wq);
+        }
+    }
+}
+
+/**
+ * Return whether every bucket of the sort job in arg has been sorted.
+ */
+static int sort_job_done (void *arg)
+{
+    return ((sort_job_t*)arg)->tasks_done == MSD_BUCKETS;
+}
+
+/**
+ * Return whether no thread is still helping with the sort job in arg.
+ */
+static int sort_job_unhelped (void *arg)
+{
+    return ((sort_job_t*)arg)->helpers == 0;
+}
+
+/**
+ * Radix sort specialized for addresses.  Only the bits that differ among
+ * the addresses are sorted on: heap addresses share their high-order bits
+ * and the low-order bits are fixed by alignment, so a round with millions
+ * of pointers usually needs three or four passes.
+ */
+static void radix_sort (size_t *a, size_t *tmp, int length)
+{
+    sort_job_t local_job, *job = &g_sort_job;
+    size_t diff = 0;
+    int counts[MSD_BUCKETS];
+    int high_bit, msd_shift, msd_bits, shared, i;
+
+    for (i = 1; i < length; ++i) diff |= a[i] ^ a[0];
+    if (0 == diff) return; // All the same value.
+
+    shared = BCAS(&g_sort_job_taken, 0, 1);
+    if (!shared) {
+        job = &local_job;
+        job->helpers = 0;
+        job->active = 0;
+        job->wq.seq = job->wq.sleepers = 0;
+    }
+
+    high_bit = 63 - __builtin_clzl(diff);
+    job->low_bit = __builtin_ctzl(diff);
+    msd_bits = MIN_OF(MSD_BITS, high_bit - job->low_bit + 1);
+    msd_shift = high_bit - msd_bits + 1;
+    job->lsd_bits = msd_shift - job->low_bit;
+    job->a = a;
+    job->tmp = tmp;
+
+    // MSD pass: partition a into tmp on the top digit.
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < length; ++i) {
+        ++counts[(a[i] >> msd_shift) & (MSD_BUCKETS - 1)];
+    }
+    job->offsets[0] = 0;
+    for (i = 0; i < MSD_BUCKETS; ++i) {
+        job->offsets[i + 1] = job->offsets[i] + counts[i];
+        counts[i] = job->offsets[i];
+    }
+    for (i = 0; i < length; ++i) {
+        size_t v = a[i];
+        tmp[counts[(v >> msd_shift) & (MSD_BUCKETS - 1)]++] = v;
+    }
+
+    // Each bucket is now an independent task.  Publish the job so threads
+    // waiting on the reclaimer can help, and then work on it, too.
+    job->next_task = 0;
+    job->tasks_done = 0;
+    if (shared && g_threadscan_sort_helpers) {
+        __sync_synchronize(); // mfence.
+        job->active = 1;
+        threadscan_util_wake(&g_threadscan_reclaim_wq);
+    }
+
+    sort_job_work(job);
+
+    // Helpers may still be sorting the last buckets they claimed.
+    threadscan_util_wait(&job->wq, sort_job_done, job, NULL);
+
+    // Retire the job and wait for stragglers to let go of it.
+    job->active = 0;
+    __sync_synchronize(); // mfence.
+    threadscan_util_wait(&job->wq, sort_job_unhelped, job, NULL);
+    if (shared) g_sort_job_taken = 0;
+}
+
 /**
  * Sort the array, a, of the given length from lowest to highest.  The sort
- * happens in-place.
+ * happens in-place, but tmp must be scratch space of at least the same
+ * length.
+ */
+void threadscan_util_sort (size_t *a, size_t *tmp, int length)
+{
+    if (length < RADIX_THRESHOLD) {
+        quicksort(a, 0, length - 1);
+    } else {
+        radix_sort(a, tmp, length);
+    }
+}
+
+/**
+ * Return whether a sort on another thread has work left to help with.
  */
-void threadscan_util_sort (size_t *a, int length)
+int threadscan_util_sort_pending ()
 {
-    quicksort(a, 0, length - 1);
+    return g_sort_job.active && g_sort_job.next_task < MSD_BUCKETS;
 }
 
 /**
- * Randomize the ordering of an array of addrs (of length n) in place.
+ * Help a sort that is in progress on another thread, if there is one.
+ * @return Nonzero if this thread did any sorting.
  */
-void threadscan_util_randomize (size_t *addrs, int n)
+int threadscan_util_sort_help ()
 {
-    unsigned int i;
-    for (i = 0; i < n; ++i) {
-        unsigned int tmp = (i * 2147483647) % n;
-        if (i != tmp) {
-            swap(addrs, i, tmp);
+    sort_job_t *job = &g_sort_job;
+    int ret = 0;
+
+    if (!job->active) return 0;
+
+    __sync_fetch_and_add(&job->helpers, 1);
+    if (job->active && job->next_task < MSD_BUCKETS) {
+        sort_job_work(job);
+        ret = 1;
+    }
+    if (1 == __sync_fetch_and_sub(&job->helpers, 1)) {
+        threadscan_util_wake(&job->wq);
+    }
+
+    return ret;
+}
+
+/**
+ * Merge two adjacent sorted runs of src, [min, mid) and [mid, max), into
+ * the same range of dst.
+ */
+static void merge_pair (size_t *src, size_t *dst, int min, int mid, int max)
+{
+    int i = min, j = mid, k = min;
+
+    while (i < mid && j < max) {
+        dst[k++] = src[i] <= src[j] ? src[i++] : src[j++];
+    }
+    if (i < mid) memcpy(&dst[k], &src[i], (mid - i) * sizeof(size_t));
+    if (j < max) memcpy(&dst[k], &src[j], (max - j) * sizeof(size_t));
+}
+
+/**
+ * Merge the n_runs sorted runs of a into one sorted array, in-place.  Run i
+ * is [bounds[i], bounds[i + 1]), so bounds has n_runs + 1 entries; it is
+ * overwritten.  tmp must be scratch space as long as a.  Runs are merged
+ * pairwise, so the cost is O(n log n_runs): linear when there are only a
+ * few runs.
+ */
+void threadscan_util_merge_runs (size_t *a, size_t *tmp, int *bounds,
+                                 int n_runs)
+{
+    size_t *src = a, *dst = tmp;
+
+    while (n_runs > 1) {
+        int i, out = 0;
+        for (i = 0; i < n_runs; i += 2) {
+            int min = bounds[i];
+            if (i + 1 < n_runs) {
+                merge_pair(src, dst, min, bounds[i + 1], bounds[i + 2]);
+            } else {
+                memcpy(&dst[min], &src[min],
+                       (bounds[i + 1] - min) * sizeof(size_t));
+            }
+            bounds[out++] = min;
         }
+        bounds[out] = bounds[n_runs];
+        n_runs = out;
+
+        size_t *swap_tmp = src;
+        src = dst;
+        dst = swap_tmp;
+    }
+
+    if (src != a) {
+        memcpy(a, src, bounds[n_runs] * sizeof(size_t));
     }
 }
@@ -23,29 +23,56 @@ THE SOFTWARE.
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include "dirty.h"
 #include <pthread.h>
 #include "queue.h"
+#include "reclaim.h"
 #include <signal.h>
+#include <time.h>
 
 /****************************************************************************/
 /*                         Defines, typedefs, etc.                          */
 /****************************************************************************/
 
-#define FOREACH_IN_THREAD_LIST(td, tl) do { \
-    pthread_mutex_lock(&(tl)->lock);        \
-    (td) = (tl)->head;                      \
-    while (NULL != (td)) {
-
-#define ENDFOREACH_IN_THREAD_LIST(td, tl) (td) = (td)->next; }     \
-    pthread_mutex_unlock(&(tl)->lock);                             \
+// Go through the threads in the list without locking it.  Threads that
+// come or go in the meantime may or may not be seen, but the thread data
+// seen stays valid until the loop is over.
+#define FOREACH_IN_THREAD_LIST(td, tl) do {                             \
+    size_t tl_epoch_ = threadscan_util_thread_list_enter(tl);           \
+    int tl_high_ = (tl)->high, tl_i_;                                   \
+    thread_data_t *volatile *tl_slots_ = (tl)->slots;                   \
+    for (tl_i_ = 0; tl_i_ < tl_high_; ++tl_i_) {                        \
+        (td) = tl_slots_[tl_i_];                                        \
+        if (NULL == (td)) continue;
+
+#define ENDFOREACH_IN_THREAD_LIST(td, tl) }                             \
+    threadscan_util_thread_list_exit((tl), tl_epoch_);                  \
     } while (0)
 
-#define FOREACH_BREAK_THREAD_LIST(tl) do {      \
-    pthread_mutex_unlock(&(tl)->lock);          \
+#define FOREACH_BREAK_THREAD_LIST(tl) do {                              \
+    threadscan_util_thread_list_exit((tl), tl_epoch_);                  \
     } while (0)
 
 #define PAGESIZE ((size_t)0x1000)
 
+// Signal that asks a thread to search its memory.
+#define SIGTHREADSCAN SIGUSR1
+
+// In safepoint mode, a thread that has to be signalled is signalled right
+// away for this many rounds before it gets another chance to answer at a
+// safepoint.
+#define SAFEPOINT_LATE_ROUNDS 8
+
+// Most local blocks a thread can have registered at once.
+#define MAX_LOCAL_BLOCKS 8
+
+// Most reclamation domains, counting the default one, which every thread
+// is in.
+#define MAX_DOMAINS 16
+#define DEFAULT_DOMAIN 0
+
+#define IS_MEMBER(td, id) (((td)->domains >> (id)) & 1)
+
 #define PAGEALIGN(addr) ((addr) & ~(PAGESIZE - 1))
 
 #define MIN_OF(a, b) ((a) < (b) ? (a) : (b))
@@ -53,6 +80,20 @@ THE SOFTWARE.
 #define BCAS(ptr, compare, swap)                        \
     __sync_bool_compare_and_swap(ptr, compare, swap)
 
+#define GET_STACK_POINTER(qword)                \
+    __asm__("movq %%rsp, %0"                    \
+            : "=m"(qword)                       \
+            : "r"("%rsp")                       \
+            : )
+
+// States of a thread, for searching the stacks of threads that are blocked
+// without signalling them.  A parked thread is blocked in one of the
+// wrapped calls, and the reclaimer may take it to searched while it
+// searches the thread's memory.
+#define THREAD_RUNNING 0
+#define THREAD_PARKED 1
+#define THREAD_SEARCHED 2
+
 #define _TIMESTAMP_MASK 0x7FFFFFFFFFFFFFFF
 #define _TIMESTAMP_FLAG 0x8000000000000000
 
@@ -61,12 +102,34 @@ THE SOFTWARE.
 #define TIMESTAMP_IS_ACTIVE(field) ((field) & _TIMESTAMP_FLAG)
 #define TIMESTAMP_SET_ACTIVE(field) TIMESTAMP_RAISE_FLAG(field)
 
+typedef struct wait_queue_t wait_queue_t;
+
 typedef struct mem_range_t mem_range_t;
 
+typedef struct local_block_t local_block_t;
+
+typedef struct domain_member_t domain_member_t;
+
 typedef struct thread_data_t thread_data_t;
 
+typedef struct signal_tree_t signal_tree_t;
+
+typedef struct domain_t domain_t;
+
 typedef struct thread_list_t thread_list_t;
 
+/****************************************************************************/
+/*                                 Waiting.                                 */
+/****************************************************************************/
+
+// Somewhere for threads to sleep until something happens.  A waiter spins
+// for a while, then sleeps on seq.  Whoever makes it happen bumps seq and
+// wakes the sleepers, if there are any.  With nobody asleep, that's a load.
+struct wait_queue_t {
+    volatile int seq;
+    volatile int sleepers;
+};
+
 /****************************************************************************/
 /*                 Memory range data for write protection.                  */
 /****************************************************************************/
@@ -76,10 +139,51 @@ struct mem_range_t {
     size_t high;
 };
 
+struct local_block_t {
+    mem_range_t range;        // range.low is 0 if the slot is free.
+    page_cache_t cache[2];    // Like stack_cache, below.
+};
+
 /****************************************************************************/
 /*                       Storage for per-thread data.                       */
 /****************************************************************************/
 
+/**
+ * What a thread has to do with one reclamation domain.  Each thread has one
+ * for every domain, and the ones it isn't a member of go unused.
+ */
+struct domain_member_t {
+    queue_t ptr_list;         // Local list of pointers to be collected.
+
+    size_t local_timestamp;
+    int times_without_update;
+
+    // The round whose reclaimer is waiting for this thread to search its
+    // memory, or 0.  The thread takes the request once, at a safepoint or
+    // in its signal handler, whichever comes first.
+    volatile size_t scan_request;
+
+    // This thread's place in the round's signalling tree, or -1 if the
+    // reclaimer didn't signal it.  fanout_left counts this node and its
+    // children that have yet to finish, and fanout_size is the number of
+    // threads in its subtree.
+    int fanout_index;
+    volatile int fanout_left;
+    int fanout_size;
+
+    // Set when the reclaimer took the thread from parked to searched, so
+    // it's the reclaimer's to search and let go.
+    int parked;
+
+    // Addresses this thread finds during a scan, one bit per position in the
+    // search list.  Only this thread writes to it while scanning, and the
+    // reclaimer gathers and clears words mark_low through mark_high, the
+    // ones that have been touched.
+    size_t *marks;
+    size_t marks_words;       // Capacity, in words.
+    size_t mark_low, mark_high;
+};
+
 struct thread_data_t {
 
     // User parameters for creating a new thread.
@@ -87,39 +191,162 @@ struct thread_data_t {
     void *user_arg;
 
     // Thread metadata fields.
-    thread_data_t *next;      // Linked list of thread metadata.
+    thread_data_t *next;      // Exited threads waiting to be joined.
+    int slot;                 // Where the thread is in the thread list.
     pthread_t self;           // That's me!
+    pid_t tid;                // Kernel thread ID, for signalling.
     char *user_stack_low;     // Low address on the user stack.
     char *user_stack_high;    // Actually, just the high address to lock.
 
     int stack_is_ours;        // Whether threadscan allocated the stack.
     int is_active;            // The thread is running user code.
-
-    queue_t ptr_list;         // Local list of pointers to be collected.
-
-    size_t local_timestamp;
-    int times_without_update;
-
-    mem_range_t local_block;  // Non-stack memory local to this thread.
+    int numa_node;            // Where the thread keeps its memory.
+
+    // One bit for each domain this thread is a member of.  Only this thread
+    // changes it.  A round may see a change partway through, so a thread
+    // that leaves checks for requests afterwards, and the reclaimer checks
+    // for the change after it asks.
+    volatile unsigned int domains;
+    domain_member_t members[MAX_DOMAINS];
+
+    // In safepoint mode, the number of rounds this thread is signalled
+    // right away, instead of given time to get to a safepoint, because it
+    // was late the last time.
+    int late_rounds;
+
+    // THREAD_RUNNING, THREAD_PARKED or THREAD_SEARCHED.  While the thread
+    // isn't running, it doesn't write to its stack above park_sp, or to
+    // its local blocks, and the reclaimer can search them in its place.
+    volatile int park_state;
+    size_t park_sp;
+    wait_queue_t park_wq;     // Woken when the search is over.
+
+    // With THREADSCAN_EPOCH, op_epoch counts the thread's operations: it's
+    // odd while the thread is in one.  Only this thread writes it, and
+    // op_depth, for nested operations.  op_snapshot is op_epoch as the
+    // reclaimer last saw it, when it put pointers in limbo.
+    volatile size_t op_epoch;
+    int op_depth;
+    size_t op_snapshot;
+
+    // Non-stack memory local to this thread.  Slots below n_local_blocks
+    // have been used.  Only this thread changes them, while it's running.
+    // They're searched by this thread, in its signal handler, or by a
+    // reclaimer that took the thread from THREAD_PARKED to THREAD_SEARCHED.
+    // The thread waits in threadscan_thread_unpark() until that search is
+    // over, so it can't change them during one.  Ordering the stores is
+    // enough to keep its own searches from seeing half of a change.
+    local_block_t local_blocks[MAX_LOCAL_BLOCKS];
+    int n_local_blocks;
+
+    // Bytes of the objects this thread has collected, how much of that has
+    // been added to g_threadscan_pending_bytes, and how much of that has
+    // been taken by the reclaimer.  The reclaimer and the exiting thread
+    // both take bytes, with threadscan_util_thread_data_drain().
+    size_t bytes_collected;
+    size_t bytes_published;
+    size_t bytes_drained;
+
+    // Unreferenced pointers whose reclaim functions this thread has yet to
+    // call, and whether it's calling them now.
+    reclaim_record_t *ready;
+    size_t n_ready, ready_capacity;
+    int in_callbacks;
+
+    // With THREADSCAN_SOFT_DIRTY, the words of this thread's stack that
+    // might be addresses, as of the last time it searched them, and the
+    // same for each local block.  Each search fills one of the pair from
+    // the other, and cache_cur is the one filled last.  They belong to
+    // whoever searches the thread's memory: the thread itself, or, while
+    // it's THREAD_SEARCHED, the reclaimer that put it there.  The CAS
+    // out of THREAD_PARKED picks one, so two never touch them at once.
+    page_cache_t stack_cache[2];
+    int cache_cur;
 
     // Reference count prevents premature free'ing of the structure while
     // other threads are looking at it.
     int ref_count;
 };
 
+/**
+ * The registered threads, in slots that are reused once a thread leaves,
+ * and NULL while they're empty.  Readers go through the slots below high
+ * without a lock; threads coming and going take lock to change them.  A
+ * full array is copied to one twice the size, and the old one is kept,
+ * since a reader may still be going through it.
+ *
+ * Readers count themselves in readers[epoch % 2].  The data of a thread
+ * that has left is only freed once the readers that could have seen it,
+ * the ones counted before epoch moved on, are gone.
+ */
 struct thread_list_t {
-    thread_data_t *head;
+    thread_data_t *volatile *volatile slots;
+    volatile int high;
+    int capacity;
+    int *free_slots;          // Empty slots below high.
+    int n_free;
     pthread_mutex_t lock;
+
+    volatile size_t epoch;
+    volatile int readers[2];
+    wait_queue_t wq;          // Woken when a half has no readers.
+    pthread_mutex_t epoch_lock;
+};
+
+/**
+ * The threads to signal in a round, as a tree, so no one thread sends all
+ * the signals.  The reclaimer signals the roots, nodes 0 through degree - 1,
+ * and each thread that takes its request signals its children before it
+ * searches.  Node i's children are degree * (i + 1) and the degree - 1
+ * nodes after it.  A thread in the tree doesn't exit until the reclaimer
+ * releases the tree, so the others can still signal it and finish its
+ * node.
+ */
+struct signal_tree_t {
+    thread_data_t **nodes;
+    int count;
+    int capacity; // Of nodes, which grows with the number of threads.
+    int degree;
+    pid_t pid;
+
+    // Set once the tree is built.  A thread that takes its request before
+    // then waits here to learn its children, and an exiting thread waits
+    // here for the tree to be released.
+    volatile int ready;
+    wait_queue_t wq;
 };
 
+/**
+ * A reclamation domain, as the thread and process modules see it: the slot
+ * of members[] that its threads keep their part of it in, the lock that
+ * makes one of them its reclaimer, and the tree they're signalled through.
+ */
+struct domain_t {
+    int id;
+    volatile size_t timestamp;
+    signal_tree_t tree;
+};
+
+// Bytes collected and not yet taken by the reclaimer, summed over threads.
+// Threads add to it in chunks, so it's approximate.
+extern volatile size_t g_threadscan_pending_bytes;
+
+// Threads waiting on a reclamation sleep here.  It's woken when the
+// reclamation has made room on their lists, needs their help, or is over.
+extern wait_queue_t g_threadscan_reclaim_wq;
+
 thread_data_t *threadscan_util_thread_data_new ();
+void threadscan_util_thread_data_join (thread_data_t *td, int id);
 void threadscan_util_thread_data_decr_ref (thread_data_t *td);
 void threadscan_util_thread_data_free (thread_data_t *td);
 void threadscan_util_thread_data_cleanup (pthread_t tid);
+size_t threadscan_util_thread_data_drain (thread_data_t *td);
 
-void threadscan_util_thread_list_init (thread_list_t *tl);
 void threadscan_util_thread_list_add (thread_list_t *tl, thread_data_t *td);
 void threadscan_util_thread_list_remove (thread_list_t *tl, thread_data_t *td);
+size_t threadscan_util_thread_list_enter (thread_list_t *tl);
+void threadscan_util_thread_list_exit (thread_list_t *tl, size_t epoch);
+void threadscan_util_thread_list_wait_for_readers (thread_list_t *tl);
 thread_data_t *threadscan_util_thread_list_find (thread_list_t *tl,
                                                  size_t addr);
 
@@ -130,11 +357,22 @@ thread_data_t *threadscan_util_thread_list_find (thread_list_t *tl,
 int threadscan_diagnostic (const char *format, ...);
 void threadscan_fatal (const char *format, ...);
 
+/****************************************************************************/
+/*                                 Waiting.                                 */
+/****************************************************************************/
+
+int threadscan_util_wait (wait_queue_t *wq, int (*done) (void *), void *arg,
+                          const struct timespec *deadline);
+void threadscan_util_wake (wait_queue_t *wq);
+
 /****************************************************************************/
 /*                              Sort utility.                               */
 /****************************************************************************/
 
-void threadscan_util_randomize (size_t *addrs, int n);
-void threadscan_util_sort (size_t *a, int length);
+void threadscan_util_sort (size_t *a, size_t *tmp, int length);
+void threadscan_util_merge_runs (size_t *a, size_t *tmp, int *bounds,
+                                 int n_runs);
+int threadscan_util_sort_pending ();
+int threadscan_util_sort_help ();
 
 #endif // !defined _UTIL_H_
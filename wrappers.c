@@ -26,13 +26,38 @@ THE SOFTWARE.
 #include <assert.h>
 #include <dlfcn.h>
 #include "env.h"
+#include <errno.h>
+#include <poll.h>
 #include "proc.h"
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/epoll.h>
 #include "thread.h"
+#include <time.h>
+#include <unistd.h>
 #include "util.h"
 
+/****************************************************************************/
+/*                                  Macros                                  */
+/****************************************************************************/
+
+// Make a blocking call with the thread parked, so its stack can be searched
+// without a signal.  The callee-saved registers may hold the caller's
+// pointers, and they aren't on the stack while the thread is blocked
+// unless they're spilled to this frame.
+#define PARKED_CALL(ret, call) do {             \
+        size_t park_sp_;                        \
+        int errno_;                             \
+        __builtin_unwind_init();                \
+        GET_STACK_POINTER(park_sp_);            \
+        threadscan_thread_park(park_sp_);       \
+        (ret) = (call);                         \
+        errno_ = errno;                         \
+        threadscan_thread_unpark();             \
+        errno = errno_;                         \
+    } while (0)
+
 /****************************************************************************/
 /*                   Types of functions that get wrapped.                   */
 /****************************************************************************/
@@ -46,6 +71,20 @@ typedef void (*pthread_exit_t) (void *);
 
 typedef int (*pthread_join_t) (pthread_t, void **);
 
+typedef int (*pthread_cond_wait_t) (pthread_cond_t *, pthread_mutex_t *);
+
+typedef int (*pthread_cond_timedwait_t) (pthread_cond_t *,
+                                         pthread_mutex_t *,
+                                         const struct timespec *);
+
+typedef int (*epoll_wait_t) (int, struct epoll_event *, int, int);
+
+typedef int (*poll_t) (struct pollfd *, nfds_t, int);
+
+typedef ssize_t (*read_t) (int, void *, size_t);
+
+typedef int (*nanosleep_t) (const struct timespec *, struct timespec *);
+
 typedef int (*__libc_start_main_t)(int (*) (int, char **, char **),
                                    int, char **,
                                    void (*) (void),
@@ -55,12 +94,6 @@ typedef int (*__libc_start_main_t)(int (*) (int, char **, char **),
 
 typedef int (*main_t) (int, char **, char **);
 
-/****************************************************************************/
-/*                                 Globals.                                 */
-/****************************************************************************/
-
-static int g_thread_count = 1;
-
 /****************************************************************************/
 /*                            Wrapped functions.                            */
 /****************************************************************************/
@@ -68,6 +101,12 @@ static int g_thread_count = 1;
 static pthread_create_t orig_pthread_create;
 static pthread_exit_t orig_pthread_exit;
 static pthread_join_t orig_pthread_join;
+static pthread_cond_wait_t orig_pthread_cond_wait;
+static pthread_cond_timedwait_t orig_pthread_cond_timedwait;
+static epoll_wait_t orig_epoll_wait;
+static poll_t orig_poll;
+static read_t orig_read;
+static nanosleep_t orig_nanosleep;
 static __libc_start_main_t orig_libc_start_main;
 static main_t orig_main;
 
@@ -89,12 +128,6 @@ int pthread_create (pthread_t *thread,
 
     assert(orig_pthread_create);
 
-    if (MAX_THREAD_COUNT < __sync_fetch_and_add(&g_thread_count, 1)) {
-        // Don't overflow buffers.
-        threadscan_fatal("Exceeded maximum thread count (%d).\n",
-                         MAX_THREAD_COUNT);
-    }
-
     // Wrap the user data.
     td = threadscan_util_thread_data_new();
     if (NULL == td) {
@@ -146,6 +179,8 @@ int pthread_create (pthread_t *thread,
         // Ruh, roh!  Failed to create a thread.  That isn't really our
         // problem, though.  Just clean up the memory we allocated for
         // the thread.  The end.
+        threadscan_proc_remove_thread_data(td);
+        threadscan_proc_wait_for_readers();
         if (td->stack_is_ours) {
             threadscan_alloc_munmap(stack);
         }
@@ -161,7 +196,6 @@ void pthread_exit (void *retval)
     assert(orig_pthread_exit);
 
     threadscan_thread_cleanup();
-    __sync_fetch_and_sub(&g_thread_count, 1);
     orig_pthread_exit(retval);
 
     abort(); // Should never get past orig_pthread_exit();
@@ -172,10 +206,74 @@ int pthread_join (pthread_t thread, void **retval)
 {
     assert(orig_pthread_join);
     int ret = orig_pthread_join(thread, retval);
+    // A reclaimer going through the thread list may still have the thread's
+    // data.
+    threadscan_proc_wait_for_readers();
     threadscan_util_thread_data_cleanup(thread);
     return ret;
 }
 
+/*
+ * Blocking calls.  The thread is parked while it's in them, and a reclaimer
+ * searches its stack instead of waking it up with a signal.
+ */
+
+__attribute__((visibility("default")))
+int pthread_cond_wait (pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int ret;
+    assert(orig_pthread_cond_wait);
+    PARKED_CALL(ret, orig_pthread_cond_wait(cond, mutex));
+    return ret;
+}
+
+__attribute__((visibility("default")))
+int pthread_cond_timedwait (pthread_cond_t *cond, pthread_mutex_t *mutex,
+                            const struct timespec *abstime)
+{
+    int ret;
+    assert(orig_pthread_cond_timedwait);
+    PARKED_CALL(ret, orig_pthread_cond_timedwait(cond, mutex, abstime));
+    return ret;
+}
+
+__attribute__((visibility("default")))
+int epoll_wait (int epfd, struct epoll_event *events, int maxevents,
+                int timeout)
+{
+    int ret;
+    assert(orig_epoll_wait);
+    PARKED_CALL(ret, orig_epoll_wait(epfd, events, maxevents, timeout));
+    return ret;
+}
+
+__attribute__((visibility("default")))
+int poll (struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    int ret;
+    assert(orig_poll);
+    PARKED_CALL(ret, orig_poll(fds, nfds, timeout));
+    return ret;
+}
+
+__attribute__((visibility("default")))
+ssize_t read (int fd, void *buf, size_t count)
+{
+    ssize_t ret;
+    assert(orig_read);
+    PARKED_CALL(ret, orig_read(fd, buf, count));
+    return ret;
+}
+
+__attribute__((visibility("default")))
+int nanosleep (const struct timespec *req, struct timespec *rem)
+{
+    int ret;
+    assert(orig_nanosleep);
+    PARKED_CALL(ret, orig_nanosleep(req, rem));
+    return ret;
+}
+
 typedef struct main_args_t main_args_t;
 
 struct main_args_t {
@@ -228,6 +326,31 @@ int __libc_start_main(int (*main) (int, char **, char **),
 /*                           Replacement routine.                           */
 /****************************************************************************/
 
+/**
+ * Return the next definition of the named function after this library's.
+ * Without it, the wrapper would have nothing to call, so this doesn't
+ * return if there isn't one.
+ */
+static void *lookup (const char *name)
+{
+    void *sym = dlsym(RTLD_NEXT, name);
+    if (NULL == sym) {
+        threadscan_fatal("threadscan: unable to find %s(): %s\n", name,
+                         dlerror());
+    }
+    return sym;
+}
+
+/**
+ * Like lookup(), but ask for a particular version of the function.  If the
+ * C library doesn't have that version, take its default one.
+ */
+static void *lookup_version (const char *name, const char *version)
+{
+    void *sym = dlvsym(RTLD_NEXT, name, version);
+    return sym ? sym : lookup(name);
+}
+
 /**
  * Find the functions that are being wrapped and keep pointers to them so
  * they can be called by their respective wrappers.  This function gets
@@ -236,8 +359,18 @@ int __libc_start_main(int (*main) (int, char **, char **),
 __attribute__((constructor))
 static void do_wrapper_replacement ()
 {
-    orig_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
-    orig_pthread_exit = dlsym(RTLD_NEXT, "pthread_exit");
-    orig_pthread_join = dlsym(RTLD_NEXT, "pthread_join");
-    orig_libc_start_main = dlsym(RTLD_NEXT, "__libc_start_main");
+    orig_pthread_create = lookup("pthread_create");
+    orig_pthread_exit = lookup("pthread_exit");
+    orig_pthread_join = lookup("pthread_join");
+    // The condition variable calls have an older version, too, with a
+    // different pthread_cond_t.  Ask for the current one.
+    orig_pthread_cond_wait =
+        lookup_version("pthread_cond_wait", "GLIBC_2.3.2");
+    orig_pthread_cond_timedwait =
+        lookup_version("pthread_cond_timedwait", "GLIBC_2.3.2");
+    orig_epoll_wait = lookup("epoll_wait");
+    orig_poll = lookup("poll");
+    orig_read = lookup("read");
+    orig_nanosleep = lookup("nanosleep");
+    orig_libc_start_main = lookup("__libc_start_main");
 }